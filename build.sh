@@ -4,29 +4,76 @@ DATOVIZ_FOLDER="../datoviz"
 GLSLC_PATH=$DATOVIZ_FOLDER/bin/vulkan/linux/glslc
 SHADER_DIR="shaders/"
 
-# Compile GLSL shaders to SPIR-V.
-for shader in "$SHADER_DIR"*.vert "$SHADER_DIR"*.frag; do
-    [ -e "$shader" ] || continue
+# With ./build.sh shaders, every shader variant is compiled again, and the build stops after
+# reporting all the variants that fail.
+FORCE_SHADERS=0
+if [ "$1" = "shaders" ]; then
+    FORCE_SHADERS=1
+fi
+SHADER_ERRORS=0
 
-    output="${shader}.spv"
+# Compile a GLSL shader to SPIR-V, extra arguments are passed to glslc.
+compile_shader() {
+    shader=$1
+    output=$2
+    shift 2
 
-    # Only compile if source is newer than the output
-    if [ ! -e "$output" ] || [ "$shader" -nt "$output" ]; then
+    # Only compile if source, or the shared include file, is newer than the output
+    if [ "$FORCE_SHADERS" = 1 ] || [ ! -e "$output" ] || [ "$shader" -nt "$output" ] ||
+        [ "${SHADER_DIR}sphere_common.glsl" -nt "$output" ]; then
         echo "Compiling $shader -> $output"
-        "$GLSLC_PATH" "$shader" -o "$output"
-
-        if [ $? -ne 0 ]; then
-            echo "Error compiling $shader"
+        if ! "$GLSLC_PATH" "$@" "$shader" -o "$output"; then
+            echo "Error compiling $shader $*"
+            SHADER_ERRORS=$((SHADER_ERRORS + 1))
         fi
     # else
     #     echo "Skipping $shader (up to date)"
     fi
+}
+
+# Compile GLSL shaders to SPIR-V.
+for shader in "$SHADER_DIR"*.vert "$SHADER_DIR"*.frag; do
+    [ -e "$shader" ] || continue
+    compile_shader "$shader" "${shader}.spv"
 done
 
-# Compile datostim.c
-gcc -I$DATOVIZ_FOLDER/include \
+# Shader variants.
+compile_shader "${SHADER_DIR}sphere.vert" "${SHADER_DIR}sphere_multiview.vert.spv" -DMULTIVIEW
+compile_shader "${SHADER_DIR}sphere.vert" "${SHADER_DIR}sphere_compact.vert.spv" -DCOMPACT_MESH
+compile_shader "${SHADER_DIR}sphere.vert" "${SHADER_DIR}sphere_multiview_compact.vert.spv" \
+    -DMULTIVIEW -DCOMPACT_MESH
+compile_shader "${SHADER_DIR}sphere.frag" "${SHADER_DIR}sphere_array.frag.spv" -DTEXTURE_ARRAY
+compile_shader "${SHADER_DIR}sphere.frag" "${SHADER_DIR}sphere_raycast.frag.spv" -DRAYCAST
+compile_shader "${SHADER_DIR}sphere.frag" "${SHADER_DIR}sphere_raycast_array.frag.spv" \
+    -DRAYCAST -DTEXTURE_ARRAY
+compile_shader "${SHADER_DIR}sphere.frag" "${SHADER_DIR}sphere_mipmap.frag.spv" -DMIPMAP
+compile_shader "${SHADER_DIR}sphere.frag" "${SHADER_DIR}sphere_raycast_mipmap.frag.spv" \
+    -DRAYCAST -DMIPMAP
+
+if [ "$SHADER_ERRORS" -ne 0 ]; then
+    echo "$SHADER_ERRORS shader(s) failed to compile"
+    exit 1
+fi
+if [ "$1" = "shaders" ]; then
+    exit 0
+fi
+
+# Compile datostim.c. NOTE: no -march=native, the AVX2 kernels are selected at runtime, and AVX
+# changes the alignment of the cglm matrices in the uniform structs.
+gcc -O2 -I$DATOVIZ_FOLDER/include \
     -I$DATOVIZ_FOLDER/build/_deps/cglm-src/include/ \
     -L$DATOVIZ_FOLDER/build \
     datostim.c -o datostim \
-    -lm -ldatoviz \
+    -lm -lpthread -ldatoviz -lvulkan \
     -Wl,-rpath,$DATOVIZ_FOLDER/build
+
+# Tests, with ./build.sh test (no GPU needed).
+if [ "$1" = "test" ]; then
+    gcc -O2 -I$DATOVIZ_FOLDER/include \
+        -I$DATOVIZ_FOLDER/build/_deps/cglm-src/include/ \
+        -L$DATOVIZ_FOLDER/build \
+        tests/test_queue.c -o tests/test_queue \
+        -lm -lpthread -ldatoviz -lvulkan \
+        -Wl,-rpath,$DATOVIZ_FOLDER/build
+    ./tests/test_queue
+fi
@@ -9,12 +9,23 @@
 /*************************************************************************************************/
 
 #include <math.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #include <cglm/cglm.h>
+#include <vulkan/vulkan.h>
 
 #include <datoviz_protocol.h>
 #include <datoviz_types.h>
@@ -31,17 +42,88 @@
 #define DSTIM_DEFAULT_HEIGHT     400
 #define DSTIM_DEFAULT_BACKGROUND 127, 127, 127, 255
 
+// Number of latitude bands of the sphere mesh, with twice as many longitude bands.
+#define DSTIM_DEFAULT_TESSELLATION 101
+
 #define DSTIM_DEFAULT_SQUARE_WIDTH  100
 #define DSTIM_DEFAULT_SQUARE_HEIGHT 100
 
-#define DSTIM_MAX_SCREENS 8
-#define DSTIM_MAX_LAYERS  16
+#define DSTIM_MAX_SCREENS   8
+#define DSTIM_MAX_LAYERS    16
+#define DSTIM_MAX_PIPELINES 64
+#define DSTIM_MAX_SAMPLERS  8
+#define DSTIM_MAX_TEXTURES  64
+#define DSTIM_MAX_TRACKS    (DSTIM_MAX_LAYERS * DSTIM_TRACK_PARAM_COUNT)
+
+// Layer parameters that curves evaluated on the GPU may animate (all but the visibility), and
+// total number of curve samples in the curves buffer.
+#define DSTIM_CURVE_PARAM_COUNT  DSTIM_TRACK_VISIBLE
+#define DSTIM_MAX_CURVE_SAMPLES  65536
 
 #define DSTIM_DEFAULT_SQUARE_COLOR     0, 255, 255, 255
 #define DSTIM_ALTERNATIVE_SQUARE_COLOR 255, 255, 0, 255
 
 #define SQUARE_VERTEX_COUNT 6
 
+// Maximum width and height of a layer texture in the texture array (instanced rendering).
+#define DSTIM_TEXTURE_ARRAY_MAX_SIZE 1024
+
+// Maximum width, height and number of images of the texture bank, a 3D texture. Vulkan only
+// guarantees 256 for maxImageDimension3D, desktop GPUs support at least 2048.
+#define DSTIM_BANK_MAX_SIZE 2048
+
+// Number of submitted batches that the renderer may not have processed yet. Texture data is
+// uploaded without copy, so a buffer is only written again or released that many frames after its
+// last upload.
+#define DSTIM_FRAMES_IN_FLIGHT 2
+
+// Size of the tiles of the cache-blocked transpose of column-major (MATLAB) arrays, in columns
+// and rows. Tall tiles keep the reads of each column sequential over several pages.
+#define DSTIM_INGEST_TILE_WIDTH  64
+#define DSTIM_INGEST_TILE_HEIGHT 512
+
+// Number of frames in the ring of staging buffers filled by a movie's reader thread.
+#define DSTIM_MOVIE_RING_SIZE 8
+
+// Maximum size of the header and number of dimensions of the NPY movie files.
+#define DSTIM_NPY_MAX_HEADER 65536
+#define DSTIM_NPY_MAX_DIMS   8
+
+// Threaded mode: the states published by the experiment thread go through a triple buffer, the
+// index of the last published state has this bit set until the render thread takes it.
+#define DSTIM_STATE_COUNT 3
+#define DSTIM_STATE_FRESH 0x4
+
+// Capacity of the command queue, a power of 2.
+#define DSTIM_QUEUE_SIZE 4096
+
+// Frame log: capacity of the ring of frame records (a power of 2), and number of frames waiting
+// for their presentation timestamp, the oldest being logged without one when there are more.
+#define DSTIM_FRAME_LOG_SIZE    16384
+#define DSTIM_FRAME_LOG_PENDING 8
+
+// Maximum number of caller buffers waiting to be released.
+#define DSTIM_MAX_RELEASES (DSTIM_FRAMES_IN_FLIGHT * DSTIM_MAX_LAYERS)
+
+// Maximum number of pipelines and textures waiting to be deleted.
+#define DSTIM_MAX_DELETIONS                                                                       \
+    ((DSTIM_FRAMES_IN_FLIGHT + 1) * (DSTIM_MAX_PIPELINES + DSTIM_MAX_TEXTURES))
+
+// Layer flags, must match the shaders.
+#define DSTIM_LAYER_FLAG_PERIODIC       0x1
+#define DSTIM_LAYER_FLAG_SINGLE_CHANNEL 0x2
+#define DSTIM_LAYER_FLAG_ANIMATED       0x4
+
+// Spatial chunks of the sphere mesh for frustum culling, on an azimuth-major grid of directions.
+// The last chunk holds the triangles that cannot be bounded, it is always drawn.
+#define DSTIM_CHUNK_COLS  16
+#define DSTIM_CHUNK_ROWS  8
+#define DSTIM_MAX_CHUNKS  (DSTIM_CHUNK_COLS * DSTIM_CHUNK_ROWS + 1)
+#define DSTIM_CHUNK_WORDS ((DSTIM_MAX_CHUNKS + 63) / 64)
+
+// Size of the post-transform vertex cache assumed when ordering the sphere triangles.
+#define DSTIM_VERTEX_CACHE_SIZE 16
+
 
 
 /*************************************************************************************************/
@@ -54,7 +136,12 @@
         log_error("screen_idx must be lower than %d", DSTIM_MAX_SCREENS);                         \
         return;                                                                                   \
     }                                                                                             \
-    stim->screen_count = MAX(stim->screen_count, screen_idx + 1);                                 \
+    if (screen_idx >= stim->screen_count)                                                         \
+    {                                                                                             \
+        stim->screen_count = screen_idx + 1;                                                      \
+        stim->is_record_dirty = true;                                                             \
+        stim->is_culling_dirty = true;                                                            \
+    }                                                                                             \
     DScreen* screen = &stim->screens[screen_idx];
 
 #define GET_LAYER                                                                                 \
@@ -68,6 +155,25 @@
 
 #define TOUCH_LAYER         layer->is_dirty = true;
 #define TOUCH_LAYER_TEXTURE layer->is_texture_dirty = true;
+#define TOUCH_LAYER_STATE   layer->is_state_dirty = true;
+#define TOUCH_SCREEN        screen->is_dirty = true;
+#define TOUCH_RECORD        stim->is_record_dirty = true;
+#define TOUCH_CULLING       stim->is_culling_dirty = true;
+
+// Threaded mode: the parameters set by the experiment thread go to the shadow, see
+// dstim_thread_run().
+#define GET_STATE                                                                                 \
+    if (is_threaded(stim))                                                                        \
+        stim = stim->shadow;
+
+// Threaded mode: the functions that emit requests or own buffers must be called before or after
+// dstim_thread_run(), not by the experiment.
+#define CHECK_UNTHREADED                                                                          \
+    if (is_threaded(stim))                                                                        \
+    {                                                                                             \
+        log_error("%s() cannot be called while the render thread runs", __func__);                \
+        return;                                                                                   \
+    }
 
 
 
@@ -77,11 +183,28 @@
 
 typedef struct DScreen DScreen;
 typedef struct DLayer DLayer;
+typedef struct DPipeline DPipeline;
+typedef struct DSampler DSampler;
+typedef struct DTexture DTexture;
+typedef struct DChunk DChunk;
+typedef struct DRelease DRelease;
+typedef struct DDeletion DDeletion;
+typedef struct DTrack DTrack;
+typedef struct DCurve DCurve;
+typedef struct DLayerState DLayerState;
+typedef struct DScreenState DScreenState;
+typedef struct DState DState;
+typedef struct DCommand DCommand;
+typedef struct DMovie DMovie;
 typedef struct DStim DStim;
 typedef struct DStimSquareVertex DStimSquareVertex;
 typedef struct DStimVertex DStimVertex;
+typedef struct DStimCompactVertex DStimCompactVertex;
 typedef struct DStimPush DStimPush;
-// typedef struct DStimParams DStimParams;
+typedef struct DStimParams DStimParams;
+typedef struct DStimScreenParams DStimScreenParams;
+typedef struct DStimCurvesHeader DStimCurvesHeader;
+typedef struct DStimCurveParams DStimCurveParams;
 
 
 
@@ -112,8 +235,9 @@ void log_log(LogLevel level, const char* fmt, ...)
     // Time string
     char timebuf[20];
     time_t t = time(NULL);
-    struct tm* lt = localtime(&t);
-    strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S", lt);
+    struct tm lt = {0};
+    localtime_r(&t, &lt); // the render and experiment threads both log
+    strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S", &lt);
 
     // Variadic args
     va_list args;
@@ -136,6 +260,127 @@ void log_log(LogLevel level, const char* fmt, ...)
 
 
 
+/*************************************************************************************************/
+/*  GPU structs                                                                                  */
+/*************************************************************************************************/
+
+struct DStimSquareVertex
+{
+    vec3 pos;
+};
+
+
+
+struct DStimVertex
+{
+    vec3 vertexPos;
+    vec2 vertexUV;
+};
+
+
+
+// Vertex of the generated unit sphere: vertexUV packed as two unorm16, the vertex shader derives
+// the position from it.
+struct DStimCompactVertex
+{
+    uint32_t packedUV;
+};
+
+
+
+// NOTE: the push constant only contains what changes with the draw structure (model, layer and
+// screen indices). It is recorded in the command buffer once and for all.
+struct DStimPush
+{
+    mat4 model;
+
+    uint32_t layer_idx;   // first layer drawn
+    uint32_t layer_count; // number of consecutive layers drawn with instancing
+    uint32_t screen_idx;  // first screen drawn
+    uint32_t _padding;
+};
+
+
+
+// NOTE: std140 layout, the size must be a multiple of 16 bytes (array of structs in a uniform).
+struct DStimParams
+{
+    mat4 view;
+
+    vec4 min_color;
+    vec4 max_color;
+
+    vec2 tex_offset;
+    vec2 tex_size;
+    vec2 tex_scale; // part of the texture array slice covered by the layer texture
+
+    float tex_angle;
+    float tex_slice; // slice coordinate in the texture array or bank
+    uint32_t flags;
+
+    // Procedural patterns.
+    uint32_t kind;
+    float spatial_frequency;
+    float phase;
+    float contrast;
+    float sigma;
+    float inner_radius;
+    float outer_radius;
+    float plaid_angle;
+
+    // Mip atlas: number of mip levels (0 without mip atlas), and size of the base level in texels.
+    uint32_t mip_levels;
+    vec2 mip_size;
+};
+
+
+
+// NOTE: std140 layout, the size must be a multiple of 16 bytes (array of structs in a uniform).
+struct DStimScreenParams
+{
+    mat4 projection;
+
+    // Scale (xy) and offset (zw) from the screen's NDC to the window's NDC (multiview rendering).
+    vec4 ndc_transform;
+};
+
+
+
+// NOTE: std430 layout. The curves storage buffer has this header, then the DStimCurveParams of
+// all layers and parameters (layer-major), then the samples of all curves.
+struct DStimCurvesHeader
+{
+    float time; // seconds since the timeline origin, at the present time of the frame
+    uint32_t _padding[3];
+};
+
+
+
+struct DStimCurveParams
+{
+    uint32_t offset; // index of the first sample in the samples array
+    uint32_t count;  // number of samples, 0 if the parameter is not animated
+    float rate;      // samples per second
+    float period;    // loop period, 0 to hold the last sample
+};
+
+
+
+// NOTE: the uniform buffers are written at these strides, they must match the std140 strides of
+// the shaders. cglm aligns mat4 on 32 bytes when AVX is enabled at compile time (-mavx,
+// -march=native), which pads the structs: keep AVX to the target("avx2") ingestion kernels.
+_Static_assert(sizeof(DStimParams) == 176, "DStimParams must match the std140 Layer struct");
+_Static_assert(sizeof(DStimScreenParams) == 80, "DStimScreenParams must match the std140 Screen");
+
+// std140 offsets of the Layer members that follow scalars, and std430 strides of the curves
+// storage buffer, see sphere_common.glsl.
+_Static_assert(offsetof(DStimParams, tex_angle) == 120, "DStimParams must match the Layer struct");
+_Static_assert(offsetof(DStimParams, mip_size) == 168, "DStimParams must match the Layer struct");
+_Static_assert(sizeof(DStimCurvesHeader) == 16, "DStimCurvesHeader must match the Curves block");
+_Static_assert(sizeof(DStimCurveParams) == 16, "DStimCurveParams must match the std430 Curve");
+
+
+
 /*************************************************************************************************/
 /*  Structs                                                                                      */
 /*************************************************************************************************/
@@ -145,6 +390,15 @@ struct DScreen
     uvec2 offset;
     uvec2 size;
     mat4 projection;
+
+    bool is_dirty; // need to upload the screen's parameters to the screen params buffer
+
+    // Bit mask of the sphere chunks intersecting the screen's frustum, for each layer view.
+    uint64_t visible_chunks[DSTIM_MAX_LAYERS][DSTIM_CHUNK_WORDS];
+
+    // Copy of the parameters last uploaded to the GPU, to skip uploads that would not change them.
+    DStimScreenParams gpu_params;
+    bool has_gpu_params;
 };
 
 
@@ -166,201 +420,742 @@ struct DLayer
     uint32_t tex_width;
     uint32_t tex_height;
 
-    // Texture data.
+    // Texture data, either in one of the layer's staging buffers or in a caller's buffer.
     DvzSize tex_nbytes;
     uint8_t* rgba;
 
+    // Staging buffers, used in turn so that the one being filled is not read by the renderer.
+    uint8_t* staging[DSTIM_FRAMES_IN_FLIGHT];
+    DvzSize staging_nbytes[DSTIM_FRAMES_IN_FLIGHT];
+    uint64_t staging_free[DSTIM_FRAMES_IN_FLIGHT]; // first frame the buffer may be written again
+    uint32_t staging_idx;
+
+    // Caller's buffer, released with the callback once the renderer no longer reads it.
+    bool is_borrowed;
+    DStimReleaseCallback release;
+    void* release_data;
+
+    // Whether the texture data has been uploaded since it was set, and in which frame.
+    bool is_uploaded;
+    uint64_t upload_frame;
+
+    // Movie showing its frames in the layer's texture.
+    DMovie* movie;
+
+    // Hash of the texture data, 0 if unknown (borrowed, mapped, or partially updated data).
+    uint64_t tex_hash;
+
+    // Mip atlas of trilinear layers, built at upload time, reused across uploads.
+    uint8_t* mips;
+    DvzSize mips_nbytes;
+
+    // Bounding box (x0, y0, x1, y1) of the texture regions changed since the last upload, and
+    // scratch buffer with the region's texels, reused across frames.
+    uint32_t dirty_region[4];
+    bool has_dirty_region;
+    uint8_t* region;
+    DvzSize region_nbytes;
+
     DvzFormat format;
     DStimInterpolation interpolation;
     DStimBlend blend;
 
+    // Procedural patterns (in degrees).
+    DStimLayerKind kind;
+    float spatial_frequency; // cycles per degree
+    float phase;
+    float contrast;
+    float sigma;
+    float inner_radius;
+    float outer_radius;
+    float plaid_angle;
+
     bool is_periodic;
+    bool is_clipped;       // only draw the chunks covered by the texture (non-periodic layers)
     bool is_visible;       // false by default
-    bool is_blank;         // need to prepare the pipeline
-    bool is_dirty;         // need to update the layer's parameters with push constant
+    bool is_dirty;         // need to upload the layer's parameters to the layer params buffer
     bool is_texture_dirty; // need to upload the texture data again
+    bool is_state_dirty;   // need to resolve the layer's pipeline in the pipeline cache again
+    bool is_in_array;      // the layer texture lives in the texture array (instanced rendering)
+    bool is_banked;        // the layer shows bank_image instead of its own texture
+    uint32_t bank_image;
+
+    // Parameters animated by curves evaluated on the GPU, one bit per DStimTrackParam.
+    uint32_t curve_mask;
+
+    // Copy of the parameters last uploaded to the GPU, to skip uploads that would not change them.
+    DStimParams gpu_params;
+    bool has_gpu_params;
 };
 
 
 
-struct DStim
+// Entry of the pipeline cache, keyed on the fixed state, the shaders, and the bound texture and
+// sampler.
+struct DPipeline
 {
-    DvzApp* app;
-    DvzBatch* batch;
+    DvzBlendType blend;
+    int mask;
+    DvzId vertex_id;
+    DvzId fragment_id;
+    DvzId sampler_id;
+    DvzId texture_id;
+    bool is_compact; // compact vertex format
+    bool is_raycast; // full-screen ray-casting pipeline
+
+    DvzId graphics_id;
+};
 
-    // Window size.
+
+
+// Entry of the sampler cache.
+struct DSampler
+{
+    DvzFilter filter;
+    DvzSamplerAddressMode address_mode;
+
+    DvzId sampler_id;
+};
+
+
+
+// Entry of the texture pool, keyed on the format and size. Textures released by layers are
+// recycled by the next layers that need the same format and size. Layers showing the same content
+// share the same texture.
+struct DTexture
+{
+    DvzId tex_id;
+    DvzFormat format;
     uint32_t width;
     uint32_t height;
+    uint64_t hash;      // hash of the content, 0 if unknown
+    uint32_t ref_count; // number of layers using the texture
+};
 
-    DvzId canvas_id;
 
-    DvzId background_graphics_id;
-    DvzId background_vertex_id;
-    DvzId background_params_id;
 
-    DvzId square_graphics_id;
-    DvzId square_vertex_id;
-    DvzId square_params_id;
+// Spatial chunk of the sphere mesh, a contiguous range in the sorted index buffer.
+struct DChunk
+{
+    uint32_t first_index;
+    uint32_t index_count;
 
-    // NOTE: for now, 1 graphics pipeline per layer to support multiple fixed states and texture
-    // bindings (multiple descriptors per pipeline not yet supported by Datoviz Rendering
-    // Protocol).
-    DvzId sphere_graphics_ids[DSTIM_MAX_LAYERS];
-    DvzId sphere_vertex_id;
-    DvzId sphere_index_id;
+    // Bounding sphere in object space, a negative radius means the chunk is always drawn.
+    vec3 center;
+    float radius;
 
-    // NOTE: 1 texture and sampler per layer (hence, per sphere graphics pipeline).
-    DvzId texture_ids[DSTIM_MAX_LAYERS];
-    DvzId sampler_ids[DSTIM_MAX_LAYERS];
+    // Bounding box of the vertexUV coordinates.
+    vec2 uv_min;
+    vec2 uv_max;
+};
 
-    mat4 model;
 
-    uint32_t sphere_index_count;
 
-    uint32_t screen_count;
-    DScreen screens[DSTIM_MAX_SCREENS];
+// Movie streamed from a raw or NPY file by a reader thread, into a ring of staging buffers. The
+// frame in a ring slot is shown by borrowing the slot's buffer, the slot is reused once the buffer
+// is released.
+struct DMovie
+{
+    FILE* file;
+    pthread_t thread;
+    atomic_bool is_running;
+    atomic_bool is_failed; // the reader thread stopped on a read error
 
-    uint32_t layer_count;
-    DLayer layers[DSTIM_MAX_LAYERS];
-};
+    DvzFormat format;
+    uint32_t width;
+    uint32_t height;
+    DvzSize frame_nbytes;
+    uint64_t frame_count;
+    double fps;
+
+    uint8_t* frames[DSTIM_MOVIE_RING_SIZE];
+    atomic_int_least64_t slot_frames[DSTIM_MOVIE_RING_SIZE]; // frame in each slot, -1 if free
 
+    // Only accessed by the render thread.
+    double start_time;   // present time of the first frame, negative until the movie starts
+    uint64_t next_frame; // first frame neither shown nor dropped yet
+    uint32_t ref_count;  // the layer, and the frames borrowed by the layer
+};
 
 
-/*************************************************************************************************/
-/*  GPU structs                                                                                  */
-/*************************************************************************************************/
 
-struct DStimSquareVertex
+// Keyframes of a layer parameter, evaluated by dstim_update() at the frame's present time.
+struct DTrack
 {
-    vec3 pos;
+    uint32_t layer_idx;
+    DStimTrackParam param;
+    DStimCurve curve;
+
+    uint32_t key_count;
+    double* times; // seconds since the timeline origin, increasing
+    float* values;
+    double period; // loop period, 0 to hold the last value
+
+    uint32_t key_idx; // keyframe before the last evaluated time, where the next search starts
 };
 
 
 
-struct DStimVertex
+// Samples of a layer parameter, uploaded once and evaluated by the shaders.
+struct DCurve
 {
-    vec3 vertexPos;
-    vec2 vertexUV;
+    uint32_t count;
+    float* samples;
+    float rate;
+    float period;
 };
 
 
 
-// NOTE: maxPushConstantsSize needs to be >= 256 on the GPU
-struct DStimPush
+// Threaded mode: the layer parameters that the experiment thread may set.
+struct DLayerState
 {
-    mat4 model;
     mat4 view;
-    mat4 projection;
-
-    vec4 min_color;
-    vec4 max_color;
-
     vec2 tex_offset;
     vec2 tex_size;
-
     float tex_angle;
-};
+    cvec4 min_color;
+    cvec4 max_color;
 
+    DStimLayerKind kind;
+    float spatial_frequency;
+    float phase;
+    float contrast;
+    float sigma;
+    float inner_radius;
+    float outer_radius;
+    float plaid_angle;
+
+    int mask;
+    DStimBlend blend;
+    DStimInterpolation interpolation;
+    bool is_periodic;
+    bool is_clipped;
+    bool is_visible;
 
+    bool is_banked;
+    uint32_t bank_image;
+};
 
-/*************************************************************************************************/
-/*  Utils                                                                                        */
-/*************************************************************************************************/
 
-static void* _cpy(DvzSize size, const void* data)
+
+struct DScreenState
 {
-    if (data == NULL)
-        return NULL;
-    void* data_cpy = malloc(size);
-    memcpy(data_cpy, data, size);
-    return data_cpy;
-}
+    uvec2 offset;
+    uvec2 size;
+    mat4 projection;
+};
 
 
 
-static void* read_file(const char* filename, DvzSize* size)
+// Threaded mode: all the parameters of a frame, published at once by dstim_update().
+struct DState
 {
-    /* The returned pointer must be freed by the caller. */
-
-    void* buffer = NULL;
-    DvzSize length = 0;
-    FILE* f = fopen(filename, "rb");
+    uint32_t layer_count;
+    DLayerState layers[DSTIM_MAX_LAYERS];
 
-    if (!f)
-    {
-        printf("Could not find %s.\n", filename);
-        return NULL;
-    }
-    fseek(f, 0, SEEK_END);
-    length = (DvzSize)ftell(f);
-    if (size != NULL)
-        *size = length;
-    fseek(f, 0, SEEK_SET);
-    // NOTE: for safety, add a zero byte at the end to ensure a text file is
-    // loaded into a 0-terminated string.
-    buffer = (void*)calloc((size_t)length + 1, 1);
-    fread(buffer, 1, (size_t)length, f);
-    fclose(f);
+    uint32_t screen_count;
+    DScreenState screens[DSTIM_MAX_SCREENS];
 
-    return buffer;
-}
+    mat4 model;
+    cvec4 background_color;
+    cvec4 square_color;
+    uint32_t square_rect[4];
+};
 
 
 
-static void set_shaders_glsl(
-    DvzBatch* batch, DvzId graphics_id, const char* vertex_filename, const char* fragment_filename)
+// Layer parameter posted to the command queue. The sequence number tells whether the slot is free
+// for the producer with the same enqueue position (seq == pos) or filled for the consumer
+// (seq == pos + 1).
+struct DCommand
 {
-    // Vertex shader.
-    char* vertex_glsl = read_file(vertex_filename, NULL);
-    DvzRequest req = dvz_create_glsl(batch, DVZ_SHADER_VERTEX, vertex_glsl);
-    FREE(vertex_glsl);
+    atomic_size_t seq;
+    uint32_t layer_idx;
+    DStimTrackParam param;
+    float value;
+};
 
-    // Assign the shader to the graphics pipe.
-    DvzId square_vertex = req.id;
-    dvz_set_shader(batch, graphics_id, square_vertex);
 
-    // Fragment shader.
-    char* fragment_glsl = read_file(fragment_filename, NULL);
-    req = dvz_create_glsl(batch, DVZ_SHADER_FRAGMENT, fragment_glsl);
-    FREE(fragment_glsl);
 
-    // Assign the shader to the graphics pipe.
-    DvzId fragment_id = req.id;
-    dvz_set_shader(batch, graphics_id, fragment_id);
-}
+struct DRelease
+{
+    DStimReleaseCallback release;
+    uint8_t* rgba;
+    void* user_data;
+    uint64_t frame; // first frame the buffer may be released
+};
 
 
 
-static void set_shaders_spv(
-    DvzBatch* batch, DvzId graphics_id, const char* vertex_filename, const char* fragment_filename)
+struct DDeletion
 {
-    // Vertex shader.
-    DvzSize vertex_size = 0;
-    unsigned char* vertex_spv = read_file(vertex_filename, &vertex_size);
-    DvzRequest req = dvz_create_spirv(batch, DVZ_SHADER_VERTEX, vertex_size, vertex_spv);
-    FREE(vertex_spv);
+    DvzId id;
+    bool is_texture; // texture, otherwise pipeline
+    uint64_t frame;  // first frame the object may be deleted
+};
 
-    // Assign the shader to the graphics pipe.
-    DvzId square_vertex = req.id;
-    dvz_set_shader(batch, graphics_id, square_vertex);
 
-    // Fragment shader.
-    DvzSize fragment_size = 0;
-    unsigned char* fragment_spv = read_file(fragment_filename, &fragment_size);
-    req = dvz_create_spirv(batch, DVZ_SHADER_FRAGMENT, fragment_size, fragment_spv);
-    FREE(fragment_spv);
 
-    // Assign the shader to the graphics pipe.
-    DvzId fragment_id = req.id;
-    dvz_set_shader(batch, graphics_id, fragment_id);
-}
+struct DStim
+{
+    DvzApp* app;
+    DvzBatch* batch;
 
+    // Window size.
+    uint32_t width;
+    uint32_t height;
 
+    DvzId canvas_id;
 
-/*************************************************************************************************/
+    DvzId background_graphics_id;
+    DvzId background_vertex_id;
+    DvzId background_params_id;
+
+    DvzId square_graphics_id;
+    DvzId square_vertex_id;
+    DvzId square_params_id;
+
+    // Last values uploaded to the GPU, to skip uploads that would not change anything.
+    cvec4 background_color;
+    cvec4 square_color;
+    uint32_t square_rect[4];
+
+    // Shader modules shared by all sphere pipelines, loaded once.
+    DvzId sphere_vertex_shader_id;
+    DvzId sphere_multiview_vertex_shader_id; // drawing all screens in a single pass
+    DvzId sphere_compact_vertex_shader_id;   // compact vertex format
+    DvzId sphere_multiview_compact_vertex_shader_id;
+    DvzId sphere_fragment_shader_id;
+    DvzId sphere_array_fragment_shader_id; // sampling the texture array
+    DvzId sphere_raycast_vertex_shader_id; // ray-casting the sphere
+    DvzId sphere_raycast_fragment_shader_id;
+    DvzId sphere_raycast_array_fragment_shader_id;
+    DvzId sphere_mipmap_fragment_shader_id; // sampling a mip atlas
+    DvzId sphere_raycast_mipmap_fragment_shader_id;
+
+    DStimRenderMode render_mode;
+    bool has_clip_distance; // device feature required by the multiview rendering
+
+    // NOTE: DRP has no 2D array textures, so the texture array is a 3D texture with one slice per
+    // layer. Each layer texture covers the lower-left part of its slice.
+    DvzId array_id;
+    uvec2 array_size;
+
+    // Texture bank: images uploaded once, with one slice per image, that layers select by index
+    // in their parameters.
+    DvzId bank_id;
+    DvzFormat bank_format;
+    uvec2 bank_size;
+    uint32_t bank_count;
+
+    // NOTE: the texture is bound to the pipeline (multiple descriptors per pipeline not yet
+    // supported by Datoviz Rendering Protocol), so layers only share a pipeline when they have
+    // the same fixed state and show the same texture.
+    uint32_t pipeline_count;
+    DPipeline pipelines[DSTIM_MAX_PIPELINES];
+
+    uint32_t sampler_count;
+    DSampler samplers[DSTIM_MAX_SAMPLERS];
+
+    // Pipeline resolved in the pipeline cache for each layer.
+    DvzId sphere_graphics_ids[DSTIM_MAX_LAYERS];
+    DvzId sphere_vertex_id;
+    DvzId sphere_index_id;
+    DvzSize sphere_vertex_size; // allocated size of the sphere vertex buffer dat
+    DvzSize sphere_index_size;  // allocated size of the sphere index buffer dat
+
+    // Uniform buffers with the DStimParams of all layers and the DStimScreenParams of all screens,
+    // bound to every sphere pipeline.
+    DvzId layer_params_id;
+    DvzId screen_params_id;
+
+    // NOTE: 1 texture per layer, taken from the texture pool.
+    DvzId texture_ids[DSTIM_MAX_LAYERS];
+
+    uint32_t texture_count;
+    DTexture textures[DSTIM_MAX_TEXTURES];
+
+    // 1x1 texture bound to the pipelines of procedural layers, which do not sample it.
+    DvzId dummy_texture_id;
+
+    mat4 model;
+
+    uint32_t sphere_index_count;
+
+    // CPU copy of the sphere mesh, the indices being sorted by chunk. The GPU copy of the
+    // generated sphere uses the compact vertex format.
+    bool is_mesh_compact;
+    uint32_t sphere_vertex_count;
+    DStimVertex* sphere_vertices;
+    DvzIndex* sphere_indices;
+
+    uint32_t chunk_count;
+    DChunk chunks[DSTIM_MAX_CHUNKS];
+
+    uint32_t screen_count;
+    DScreen screens[DSTIM_MAX_SCREENS];
+
+    uint32_t layer_count;
+    DLayer layers[DSTIM_MAX_LAYERS];
+
+    // The command buffer is only recorded again when the draw structure changes (layer shown or
+    // hidden, screen added or moved, model changed, pipeline created). Parameter-only changes go
+    // through the layer and screen params buffers and do not require a new recording.
+    bool is_record_dirty;
+
+    // Number of requests emitted by the last recording, skipped as long as it remains valid.
+    uint32_t record_request_count;
+
+    // Number of sphere indices drawn per frame by the last recording.
+    uint32_t record_index_count;
+
+    // The visible chunks are only computed again when a projection, view, model, or layer
+    // footprint changes.
+    bool is_culling_dirty;
+
+    // Number of calls to dstim_update(), unlike the statistics never reset.
+    uint64_t frame_idx;
+
+    // Time of the last call to dstim_update(), and average interval between calls, to predict
+    // when the frame being prepared will be presented until the refresh period is measured.
+    double update_time;
+    double frame_period;
+
+    // Keyframe tracks, and time of the timeline origin (0 until the first update with tracks).
+    uint32_t track_count;
+    DTrack tracks[DSTIM_MAX_TRACKS];
+    float track_values[DSTIM_MAX_TRACKS];
+    double timeline_start;
+
+    // Sampled curves evaluated on the GPU: the storage buffer is only uploaded again when a curve
+    // changes, otherwise a frame only uploads the timeline time.
+    DvzId curves_id;
+    uint32_t curve_count;
+    uint32_t curve_sample_count;
+    DCurve curves[DSTIM_MAX_LAYERS][DSTIM_CURVE_PARAM_COUNT];
+    bool is_curves_dirty;
+
+    // Bounded lock-free command queue: any number of producer threads, dstim_update() being the
+    // only consumer.
+    DCommand commands[DSTIM_QUEUE_SIZE];
+    atomic_size_t command_head; // next enqueue position, shared by the producers
+    size_t command_tail;        // next dequeue position
+    atomic_uint_least64_t command_drops;
+
+    // Frame log: frames waiting for their presentation timestamp, then in a ring of records
+    // drained by dstim_frames() (single producer, single consumer).
+    uint32_t pending_count;
+    DStimFrame pending[DSTIM_FRAME_LOG_PENDING];
+    DStimFrame* frame_log;
+    atomic_size_t frame_log_head; // written by the updating thread
+    atomic_size_t frame_log_tail; // written by the draining thread
+    double present_time;          // last presentation timestamp seen
+    _Atomic double refresh_period;
+    atomic_uint_least64_t histogram[DSTIM_FRAME_HISTOGRAM_BINS];
+
+    // Threaded mode: the render thread owns the app and the batch. The calls of the experiment
+    // thread go to the shadow, whose state dstim_update() publishes through a triple buffer.
+    // Neither thread ever waits for the other.
+    // NOTE: GLFW processes the window events on the thread that created the app, which is the
+    // render thread: the experiment runs on a new thread.
+    pthread_t app_thread;
+    DStim* shadow;
+    bool is_shadow;
+    pthread_t experiment_thread;
+    DStimExperiment experiment;
+    void* experiment_data;
+    atomic_bool is_rendering;
+    DState states[DSTIM_STATE_COUNT];
+    uint32_t state_back;      // filled by the experiment thread
+    atomic_uint state_middle; // last published, with DSTIM_STATE_FRESH until taken
+    uint32_t state_front;     // taken by the render thread
+    DState render_state;      // last state applied by the render thread
+
+    // Threaded mode: written by the render thread after each frame.
+    _Atomic double frame_time;
+    _Atomic double mouse_x;
+    _Atomic double mouse_y;
+    atomic_int mouse_button;
+    atomic_int key;
+
+    // Tile of the MATLAB array conversion, column-major per channel, allocated once.
+    uint8_t(*ingest_tile)[DSTIM_INGEST_TILE_WIDTH][DSTIM_INGEST_TILE_HEIGHT];
+
+    // Caller's buffers replaced while the renderer may still read them.
+    uint32_t release_count;
+    DRelease releases[DSTIM_MAX_RELEASES];
+
+    // Pipelines and textures evicted while the frames in flight may still use them.
+    uint32_t deletion_count;
+    DDeletion deletions[DSTIM_MAX_DELETIONS];
+
+    DStimStats stats;
+};
+
+
+
+/*************************************************************************************************/
+/*  Utils                                                                                        */
+/*************************************************************************************************/
+
+static void* _cpy(DvzSize size, const void* data)
+{
+    if (data == NULL)
+        return NULL;
+    void* data_cpy = malloc(size);
+    memcpy(data_cpy, data, size);
+    return data_cpy;
+}
+
+
+
+// XXH64 hash: four independent lanes of 8 bytes, so that the main loop pipelines well.
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t _rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static inline uint64_t _read64(const uint8_t* p)
+{
+    uint64_t x = 0;
+    memcpy(&x, p, sizeof(x)); // NOTE: little-endian
+    return x;
+}
+
+static inline uint64_t _xxh64_round(uint64_t acc, uint64_t input)
+{
+    return _rotl64(acc + input * XXH_PRIME64_2, 31) * XXH_PRIME64_1;
+}
+
+static inline uint64_t _xxh64_merge(uint64_t acc, uint64_t val)
+{
+    return (acc ^ _xxh64_round(0, val)) * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static uint64_t _hash(DvzSize size, const uint8_t* data)
+{
+    const uint8_t* p = data;
+    const uint8_t* end = data + size;
+    uint64_t h = 0;
+
+    if (size >= 32)
+    {
+        uint64_t v1 = XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = XXH_PRIME64_2;
+        uint64_t v3 = 0;
+        uint64_t v4 = -XXH_PRIME64_1;
+        for (; p + 32 <= end; p += 32)
+        {
+            v1 = _xxh64_round(v1, _read64(p));
+            v2 = _xxh64_round(v2, _read64(p + 8));
+            v3 = _xxh64_round(v3, _read64(p + 16));
+            v4 = _xxh64_round(v4, _read64(p + 24));
+        }
+        h = _rotl64(v1, 1) + _rotl64(v2, 7) + _rotl64(v3, 12) + _rotl64(v4, 18);
+        h = _xxh64_merge(h, v1);
+        h = _xxh64_merge(h, v2);
+        h = _xxh64_merge(h, v3);
+        h = _xxh64_merge(h, v4);
+    }
+    else
+    {
+        h = XXH_PRIME64_5;
+    }
+    h += size;
+
+    for (; p + 8 <= end; p += 8)
+        h = _rotl64(h ^ _xxh64_round(0, _read64(p)), 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    if (p + 4 <= end)
+    {
+        uint32_t x = 0;
+        memcpy(&x, p, sizeof(x));
+        h = _rotl64(h ^ (x * XXH_PRIME64_1), 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        h = _rotl64(h ^ (*p * XXH_PRIME64_5), 11) * XXH_PRIME64_1;
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+
+
+static void* read_file(const char* filename, DvzSize* size)
+{
+    /* The returned pointer must be freed by the caller. */
+
+    void* buffer = NULL;
+    DvzSize length = 0;
+    FILE* f = fopen(filename, "rb");
+
+    if (!f)
+    {
+        printf("Could not find %s.\n", filename);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    length = (DvzSize)ftell(f);
+    if (size != NULL)
+        *size = length;
+    fseek(f, 0, SEEK_SET);
+    // NOTE: for safety, add a zero byte at the end to ensure a text file is
+    // loaded into a 0-terminated string.
+    buffer = (void*)calloc((size_t)length + 1, 1);
+    fread(buffer, 1, (size_t)length, f);
+    fclose(f);
+
+    return buffer;
+}
+
+
+
+static void set_shaders_glsl(
+    DvzBatch* batch, DvzId graphics_id, const char* vertex_filename, const char* fragment_filename)
+{
+    // Vertex shader.
+    char* vertex_glsl = read_file(vertex_filename, NULL);
+    DvzRequest req = dvz_create_glsl(batch, DVZ_SHADER_VERTEX, vertex_glsl);
+    FREE(vertex_glsl);
+
+    // Assign the shader to the graphics pipe.
+    DvzId square_vertex = req.id;
+    dvz_set_shader(batch, graphics_id, square_vertex);
+
+    // Fragment shader.
+    char* fragment_glsl = read_file(fragment_filename, NULL);
+    req = dvz_create_glsl(batch, DVZ_SHADER_FRAGMENT, fragment_glsl);
+    FREE(fragment_glsl);
+
+    // Assign the shader to the graphics pipe.
+    DvzId fragment_id = req.id;
+    dvz_set_shader(batch, graphics_id, fragment_id);
+}
+
+
+
+static DvzId create_shader_spv(DvzBatch* batch, DvzShaderType type, const char* filename)
+{
+    DvzSize size = 0;
+    unsigned char* spv = read_file(filename, &size);
+    DvzRequest req = dvz_create_spirv(batch, type, size, spv);
+    FREE(spv);
+    return req.id;
+}
+
+
+
+static void set_shaders_spv(
+    DvzBatch* batch, DvzId graphics_id, const char* vertex_filename, const char* fragment_filename)
+{
+    // Vertex shader, assigned to the graphics pipe.
+    DvzId vertex_id = create_shader_spv(batch, DVZ_SHADER_VERTEX, vertex_filename);
+    dvz_set_shader(batch, graphics_id, vertex_id);
+
+    // Fragment shader, assigned to the graphics pipe.
+    DvzId fragment_id = create_shader_spv(batch, DVZ_SHADER_FRAGMENT, fragment_filename);
+    dvz_set_shader(batch, graphics_id, fragment_id);
+}
+
+
+
+/*************************************************************************************************/
 /*  Helpers                                                                                      */
 /*************************************************************************************************/
 
+// Set on the render thread in threaded mode, whose calls go to the DStim itself.
+static _Thread_local bool _is_render_thread;
+
+
+
+static bool is_threaded(DStim* stim)
+{
+    ANN(stim);
+    return stim->shadow != NULL && !_is_render_thread;
+}
+
+
+
+static bool has_clip_distance(void)
+{
+    // NOTE: DRP does not expose the device features. The multiview vertex shader writes
+    // gl_ClipDistance, which requires shaderClipDistance on the device Datoviz picks: it is only
+    // used when every device supports it.
+    VkInstanceCreateInfo info = {.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO};
+    VkInstance instance = VK_NULL_HANDLE;
+    if (vkCreateInstance(&info, NULL, &instance) != VK_SUCCESS)
+        return false;
+
+    uint32_t count = 0;
+    VkPhysicalDevice devices[8] = {0};
+    vkEnumeratePhysicalDevices(instance, &count, NULL);
+    count = MIN(count, 8);
+    vkEnumeratePhysicalDevices(instance, &count, devices);
+
+    bool is_supported = count > 0;
+    VkPhysicalDeviceFeatures features = {0};
+    for (uint32_t i = 0; i < count; i++)
+    {
+        vkGetPhysicalDeviceFeatures(devices[i], &features);
+        is_supported = is_supported && features.shaderClipDistance;
+    }
+
+    vkDestroyInstance(instance, NULL);
+    return is_supported;
+}
+
+
+
+static DvzSize get_texel_size(DvzFormat format)
+{
+    // Layer texture formats, 0 for other formats.
+    switch (format)
+    {
+    case DVZ_FORMAT_R8G8B8A8_UNORM:
+        return 4;
+    case DVZ_FORMAT_R8_UNORM:
+        return 1;
+    case DVZ_FORMAT_R16_UNORM:
+    case DVZ_FORMAT_R16_SFLOAT:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+
+
+static bool is_single_channel(DvzFormat format)
+{
+    return format == DVZ_FORMAT_R8_UNORM || format == DVZ_FORMAT_R16_UNORM ||
+           format == DVZ_FORMAT_R16_SFLOAT;
+}
+
+
+
+static bool check_texture_size(DvzFormat format, uint32_t width, uint32_t height, DvzSize nbytes)
+{
+    DvzSize texel_size = get_texel_size(format);
+    if (texel_size > 0 && nbytes != width * height * texel_size)
+    {
+        log_error(
+            "a %dx%d texture with %d-byte texels must have %d bytes, not %d", width, height,
+            (int)texel_size, (int)(width * height * texel_size), (int)nbytes);
+        return false;
+    }
+    return true;
+}
+
+
+
 static DvzId create_square_pipeline(DvzBatch* batch)
 {
     // Create a custom graphics.
@@ -390,13 +1185,16 @@ static DvzId create_square_pipeline(DvzBatch* batch)
 
 
 
-static DvzId create_sphere_pipeline(DvzBatch* batch)
+static DvzId
+create_sphere_pipeline(DvzBatch* batch, DvzId vertex_id, DvzId fragment_id, bool is_compact)
 {
     // Create a custom graphics.
     DvzRequest req = dvz_create_graphics(batch, DVZ_GRAPHICS_CUSTOM, 0);
     DvzId graphics_id = req.id;
 
-    set_shaders_spv(batch, graphics_id, "shaders/sphere.vert.spv", "shaders/sphere.frag.spv");
+    // Shaders, shared across sphere pipelines.
+    dvz_set_shader(batch, graphics_id, vertex_id);
+    dvz_set_shader(batch, graphics_id, fragment_id);
 
     // Primitive topology.
     dvz_set_primitive(batch, graphics_id, DVZ_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
@@ -410,20 +1208,75 @@ static DvzId create_sphere_pipeline(DvzBatch* batch)
     // Polygon mode.
     dvz_set_polygon(batch, graphics_id, DVZ_POLYGON_MODE_FILL);
 
-    // Vertex binding.
-    dvz_set_vertex(batch, graphics_id, 0, sizeof(DStimVertex), DVZ_VERTEX_INPUT_RATE_VERTEX);
+    if (is_compact)
+    {
+        // Vertex binding.
+        dvz_set_vertex(
+            batch, graphics_id, 0, sizeof(DStimCompactVertex), DVZ_VERTEX_INPUT_RATE_VERTEX);
+
+        // Vertex attrs.
+        dvz_set_attr(
+            batch, graphics_id, 0, 0, //
+            DVZ_FORMAT_R32_UINT, offsetof(DStimCompactVertex, packedUV));
+    }
+    else
+    {
+        // Vertex binding.
+        dvz_set_vertex(batch, graphics_id, 0, sizeof(DStimVertex), DVZ_VERTEX_INPUT_RATE_VERTEX);
 
-    // Vertex attrs.
-    dvz_set_attr(
-        batch, graphics_id, 0, 0, //
-        DVZ_FORMAT_R32G32B32_SFLOAT, offsetof(DStimVertex, vertexPos));
+        // Vertex attrs.
+        dvz_set_attr(
+            batch, graphics_id, 0, 0, //
+            DVZ_FORMAT_R32G32B32_SFLOAT, offsetof(DStimVertex, vertexPos));
+
+        dvz_set_attr(
+            batch, graphics_id, 0, 1, //
+            DVZ_FORMAT_R32G32_SFLOAT, offsetof(DStimVertex, vertexUV));
+    }
+
+    // Slots.
+    dvz_set_slot(batch, graphics_id, 0, DVZ_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+    dvz_set_slot(batch, graphics_id, 1, DVZ_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
+    dvz_set_slot(batch, graphics_id, 2, DVZ_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
+    dvz_set_slot(batch, graphics_id, 3, DVZ_DESCRIPTOR_TYPE_STORAGE_BUFFER);
 
+    // Push constants.
+    dvz_set_push(
+        batch, graphics_id, DVZ_SHADER_VERTEX | DVZ_SHADER_FRAGMENT, 0, sizeof(DStimPush));
+
+    return graphics_id;
+}
+
+
+
+static DvzId create_raycast_pipeline(DvzBatch* batch, DvzId vertex_id, DvzId fragment_id)
+{
+    // Create a custom graphics.
+    DvzRequest req = dvz_create_graphics(batch, DVZ_GRAPHICS_CUSTOM, 0);
+    DvzId graphics_id = req.id;
+
+    // Shaders, shared across ray-casting pipelines.
+    dvz_set_shader(batch, graphics_id, vertex_id);
+    dvz_set_shader(batch, graphics_id, fragment_id);
+
+    // Primitive topology.
+    dvz_set_primitive(batch, graphics_id, DVZ_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
+
+    // Polygon mode.
+    dvz_set_polygon(batch, graphics_id, DVZ_POLYGON_MODE_FILL);
+
+    // Vertex binding: the full-window rectangle of the background, drawn in each screen viewport.
+    dvz_set_vertex(batch, graphics_id, 0, sizeof(DStimSquareVertex), DVZ_VERTEX_INPUT_RATE_VERTEX);
+
+    // Vertex attrs.
     dvz_set_attr(
-        batch, graphics_id, 0, 1, //
-        DVZ_FORMAT_R32G32_SFLOAT, offsetof(DStimVertex, vertexUV));
+        batch, graphics_id, 0, 0, DVZ_FORMAT_R32G32B32_SFLOAT, offsetof(DStimSquareVertex, pos));
 
     // Slots.
     dvz_set_slot(batch, graphics_id, 0, DVZ_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+    dvz_set_slot(batch, graphics_id, 1, DVZ_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
+    dvz_set_slot(batch, graphics_id, 2, DVZ_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
+    dvz_set_slot(batch, graphics_id, 3, DVZ_DESCRIPTOR_TYPE_STORAGE_BUFFER);
 
     // Push constants.
     dvz_set_push(
@@ -534,30 +1387,43 @@ static void create_square(DStim* stim)
 
 
 
-static void create_sphere_vertex_buffer(DStim* stim, uint32_t sphere_vertex_count)
+static void create_sphere_vertex_buffer(DStim* stim, DvzSize size)
 {
     ANN(stim);
+    ASSERT(size > 0);
 
     DvzBatch* batch = stim->batch;
     ANN(batch);
 
-    // Create the vertex buffer dat for the sphere.
-    DvzRequest req = dvz_create_dat(
-        batch, DVZ_BUFFER_TYPE_VERTEX, sphere_vertex_count * sizeof(DStimVertex), 0);
-    stim->sphere_vertex_id = req.id;
+    // Create the vertex buffer dat for the sphere, or resize it if the mesh grows (the pipelines
+    // bound to it remain valid).
+    if (stim->sphere_vertex_id == DVZ_ID_NONE)
+    {
+        DvzRequest req = dvz_create_dat(batch, DVZ_BUFFER_TYPE_VERTEX, size, 0);
+        stim->sphere_vertex_id = req.id;
+    }
+    else if (size > stim->sphere_vertex_size)
+    {
+        dvz_resize_dat(batch, stim->sphere_vertex_id, size);
+    }
+    else
+    {
+        return;
+    }
+    stim->sphere_vertex_size = size;
 }
 
 
 
-static void bind_sphere_vertex_buffer(DStim* stim, uint32_t layer_idx)
+static void bind_sphere_vertex_buffer(DStim* stim, DvzId graphics_id)
 {
     ANN(stim);
-    ASSERT(layer_idx < DSTIM_MAX_LAYERS);
+    ASSERT(graphics_id != DVZ_ID_NONE);
 
     DvzBatch* batch = stim->batch;
     ANN(batch);
 
-    dvz_bind_vertex(batch, stim->sphere_graphics_ids[layer_idx], 0, stim->sphere_vertex_id, 0);
+    dvz_bind_vertex(batch, graphics_id, 0, stim->sphere_vertex_id, 0);
 }
 
 
@@ -569,703 +1435,4656 @@ static void create_sphere_index_buffer(DStim* stim, uint32_t sphere_index_count)
     DvzBatch* batch = stim->batch;
     ANN(batch);
 
-    // Create the vertex buffer dat for the sphere.
-    DvzRequest req =
-        dvz_create_dat(batch, DVZ_BUFFER_TYPE_INDEX, sphere_index_count * sizeof(DvzIndex), 0);
-    stim->sphere_index_id = req.id;
+    DvzSize size = sphere_index_count * sizeof(DvzIndex);
+    ASSERT(size > 0);
+
+    // Create the index buffer dat for the sphere, or resize it if the mesh grows.
+    if (stim->sphere_index_id == DVZ_ID_NONE)
+    {
+        DvzRequest req = dvz_create_dat(batch, DVZ_BUFFER_TYPE_INDEX, size, 0);
+        stim->sphere_index_id = req.id;
+    }
+    else if (size > stim->sphere_index_size)
+    {
+        dvz_resize_dat(batch, stim->sphere_index_id, size);
+    }
+    else
+    {
+        return;
+    }
+    stim->sphere_index_size = size;
 }
 
 
 
-static void bind_sphere_index_buffer(DStim* stim, uint32_t layer_idx)
+static void bind_sphere_index_buffer(DStim* stim, DvzId graphics_id)
 {
     ANN(stim);
-    ASSERT(layer_idx < DSTIM_MAX_LAYERS);
+    ASSERT(graphics_id != DVZ_ID_NONE);
 
     DvzBatch* batch = stim->batch;
     ANN(batch);
 
-    dvz_bind_index(batch, stim->sphere_graphics_ids[layer_idx], stim->sphere_index_id, 0);
+    dvz_bind_index(batch, graphics_id, stim->sphere_index_id, 0);
 }
 
 
 
-static void load_sphere_vertex_data(DStim* stim, uint32_t sphere_vertex_count)
+static uint32_t get_chunk(vec3 pos)
 {
-    // Load vertex data from disk.
-    DvzSize buffer_size = 0;
-    DStimVertex* vertices = read_file("data/vertex", &buffer_size);
-    ASSERT(buffer_size > 0);
-    ASSERT(buffer_size == sphere_vertex_count * sizeof(DStimVertex));
-    dstim_vertices(stim, sphere_vertex_count, vertices);
-    FREE(vertices);
+    float r = glm_vec3_norm(pos);
+    if (r <= 0)
+        return 0;
+
+    // Azimuth and elevation of the direction in [0, 1], with the same convention as vertexUV.
+    float u = atan2f(pos[2], pos[0]) / (2 * M_PI);
+    if (u < 0)
+        u += 1;
+    float v = acosf(glm_clamp(pos[1] / r, -1, 1)) / M_PI;
+
+    uint32_t col = MIN((uint32_t)(u * DSTIM_CHUNK_COLS), DSTIM_CHUNK_COLS - 1);
+    uint32_t row = MIN((uint32_t)(v * DSTIM_CHUNK_ROWS), DSTIM_CHUNK_ROWS - 1);
+    return col * DSTIM_CHUNK_ROWS + row;
 }
 
 
 
-static void load_sphere_index_data(DStim* stim, uint32_t sphere_index_count)
+static void optimize_vertex_cache(uint32_t vertex_count, uint32_t index_count, DvzIndex* indices)
 {
-    DvzSize buffer_size = 0;
-    DvzIndex* indices = read_file("data/index", &buffer_size);
-    ASSERT(buffer_size > 0);
-    ASSERT(buffer_size == sphere_index_count * sizeof(DvzIndex));
-    dstim_indices(stim, sphere_index_count, indices);
-    FREE(indices);
+    ANN(indices);
+    ASSERT(index_count % 3 == 0);
+    if (index_count == 0)
+        return;
+
+    // Tipsify (Sander, Nehab and Barczak, 2007): emit the triangles as fans around vertices
+    // chosen to stay in a FIFO cache of DSTIM_VERTEX_CACHE_SIZE vertices. All indices must be
+    // lower than vertex_count.
+    uint32_t cache_size = DSTIM_VERTEX_CACHE_SIZE;
+
+    // Triangles adjacent to each vertex, and number of those not emitted yet.
+    uint32_t* live = (uint32_t*)calloc(vertex_count, sizeof(uint32_t));
+    uint32_t* offsets = (uint32_t*)calloc(vertex_count + 1, sizeof(uint32_t));
+    uint32_t* adjacency = (uint32_t*)malloc(index_count * sizeof(uint32_t));
+    for (uint32_t i = 0; i < index_count; i++)
+        live[indices[i]]++;
+    for (uint32_t v = 0; v < vertex_count; v++)
+        offsets[v + 1] = offsets[v] + live[v];
+    uint32_t* fill = (uint32_t*)calloc(vertex_count, sizeof(uint32_t));
+    for (uint32_t i = 0; i < index_count; i++)
+        adjacency[offsets[indices[i]] + fill[indices[i]]++] = i / 3;
+    FREE(fill);
+
+    uint32_t* timestamps = (uint32_t*)calloc(vertex_count, sizeof(uint32_t));
+    bool* is_emitted = (bool*)calloc(index_count / 3, sizeof(bool));
+    uint32_t* dead_end = (uint32_t*)malloc(index_count * sizeof(uint32_t));
+    uint32_t* candidates = (uint32_t*)malloc(index_count * sizeof(uint32_t));
+    DvzIndex* output = (DvzIndex*)malloc(index_count * sizeof(DvzIndex));
+    uint32_t dead_end_count = 0, candidate_count = 0, output_count = 0;
+
+    uint32_t time = cache_size + 1;
+    uint32_t cursor = 0;
+    int64_t fan = indices[0];
+    int64_t priority = 0, best = 0;
+    uint32_t t = 0, v = 0;
+    while (fan >= 0)
+    {
+        // Emit the remaining triangles around the fan vertex.
+        candidate_count = 0;
+        for (uint32_t a = offsets[fan]; a < offsets[fan + 1]; a++)
+        {
+            t = adjacency[a];
+            if (is_emitted[t])
+                continue;
+            is_emitted[t] = true;
+            for (uint32_t c = 0; c < 3; c++)
+            {
+                v = indices[3 * t + c];
+                output[output_count++] = v;
+                dead_end[dead_end_count++] = v;
+                candidates[candidate_count++] = v;
+                live[v]--;
+                if (time - timestamps[v] > cache_size)
+                    timestamps[v] = time++;
+            }
+        }
+
+        // Next fan: the oldest candidate that remains in the cache once its fan is emitted.
+        fan = -1;
+        best = -1;
+        for (uint32_t c = 0; c < candidate_count; c++)
+        {
+            v = candidates[c];
+            if (live[v] == 0)
+                continue;
+            priority = 0;
+            if (time - timestamps[v] + 2 * live[v] <= cache_size)
+                priority = time - timestamps[v];
+            if (priority > best)
+            {
+                best = priority;
+                fan = v;
+            }
+        }
+
+        // Dead end: a recently used vertex with remaining triangles, or the next one in order.
+        while (fan < 0 && dead_end_count > 0)
+        {
+            v = dead_end[--dead_end_count];
+            if (live[v] > 0)
+                fan = v;
+        }
+        for (; fan < 0 && cursor < vertex_count; cursor++)
+        {
+            if (live[cursor] > 0)
+                fan = cursor;
+        }
+    }
+    ASSERT(output_count == index_count);
+    memcpy(indices, output, index_count * sizeof(DvzIndex));
+
+    FREE(live);
+    FREE(offsets);
+    FREE(adjacency);
+    FREE(timestamps);
+    FREE(is_emitted);
+    FREE(dead_end);
+    FREE(candidates);
+    FREE(output);
 }
 
 
 
-static void
-create_texture(DStim* stim, uint32_t layer_idx, DvzFormat format, uint32_t width, uint32_t height)
+static void build_chunks(DStim* stim)
 {
     ANN(stim);
-    GET_LAYER
-
-    ASSERT(width > 0);
-    ASSERT(height > 0);
+    ANN(stim->sphere_indices);
+
+    uint32_t index_count = stim->sphere_index_count;
+    uint32_t triangle_count = index_count / 3;
+    ASSERT(index_count % 3 == 0);
+
+    DvzIndex* indices = stim->sphere_indices;
+    DStimVertex* vertices = stim->sphere_vertices;
+    uint32_t vertex_count = vertices != NULL ? stim->sphere_vertex_count : 0;
+    uint32_t unbounded = DSTIM_MAX_CHUNKS - 1;
+
+    // Assign each triangle to the chunk containing its centroid. Triangles referring to
+    // out-of-range vertices cannot be bounded and go to the last chunk.
+    uint32_t* triangle_chunks = (uint32_t*)calloc(triangle_count, sizeof(uint32_t));
+    uint32_t counts[DSTIM_MAX_CHUNKS] = {0};
+    vec3 centroid = {0};
+    for (uint32_t t = 0; t < triangle_count; t++)
+    {
+        DvzIndex* tri = &indices[3 * t];
+        uint32_t chunk = unbounded;
+        if (tri[0] < vertex_count && tri[1] < vertex_count && tri[2] < vertex_count)
+        {
+            glm_vec3_add(vertices[tri[0]].vertexPos, vertices[tri[1]].vertexPos, centroid);
+            glm_vec3_add(centroid, vertices[tri[2]].vertexPos, centroid);
+            chunk = get_chunk(centroid);
+        }
+        triangle_chunks[t] = chunk;
+        counts[chunk]++;
+    }
 
-    DvzBatch* batch = stim->batch;
-    ANN(batch);
+    // Each chunk is a contiguous range in the sorted index buffer.
+    uint32_t offsets[DSTIM_MAX_CHUNKS] = {0};
+    uint32_t first_index = 0;
+    for (uint32_t c = 0; c < DSTIM_MAX_CHUNKS; c++)
+    {
+        stim->chunks[c].first_index = first_index;
+        stim->chunks[c].index_count = 3 * counts[c];
+        offsets[c] = first_index;
+        first_index += 3 * counts[c];
+    }
+    stim->chunk_count = DSTIM_MAX_CHUNKS;
 
-    // Texture.
-    DvzRequest req = dvz_create_tex(batch, 2, format, (uvec3){width, height, 1}, 0);
-    stim->texture_ids[layer_idx] = req.id;
-}
+    DvzIndex* sorted = (DvzIndex*)malloc(index_count * sizeof(DvzIndex));
+    for (uint32_t t = 0; t < triangle_count; t++)
+    {
+        memcpy(&sorted[offsets[triangle_chunks[t]]], &indices[3 * t], 3 * sizeof(DvzIndex));
+        offsets[triangle_chunks[t]] += 3;
+    }
+    FREE(triangle_chunks);
 
+    // Order the triangles of each chunk for the post-transform vertex cache.
+    for (uint32_t c = 0; c < unbounded; c++)
+    {
+        optimize_vertex_cache(
+            vertex_count, stim->chunks[c].index_count, &sorted[stim->chunks[c].first_index]);
+    }
 
+    // Bounding sphere of each chunk around the mean of its vertices, and bounding UV box.
+    DChunk* chunk = NULL;
+    DStimVertex* vertex = NULL;
+    for (uint32_t c = 0; c < unbounded; c++)
+    {
+        chunk = &stim->chunks[c];
+        glm_vec3_zero(chunk->center);
+        chunk->radius = 0;
+        chunk->uv_min[0] = chunk->uv_min[1] = +INFINITY;
+        chunk->uv_max[0] = chunk->uv_max[1] = -INFINITY;
+        if (chunk->index_count == 0)
+            continue;
+
+        for (uint32_t i = 0; i < chunk->index_count; i++)
+        {
+            vertex = &vertices[sorted[chunk->first_index + i]];
+            glm_vec3_add(chunk->center, vertex->vertexPos, chunk->center);
+            chunk->uv_min[0] = MIN(chunk->uv_min[0], vertex->vertexUV[0]);
+            chunk->uv_min[1] = MIN(chunk->uv_min[1], vertex->vertexUV[1]);
+            chunk->uv_max[0] = MAX(chunk->uv_max[0], vertex->vertexUV[0]);
+            chunk->uv_max[1] = MAX(chunk->uv_max[1], vertex->vertexUV[1]);
+        }
+        glm_vec3_scale(chunk->center, 1.0 / chunk->index_count, chunk->center);
 
-static void create_sampler(
-    DStim* stim, uint32_t layer_idx, DvzFilter filter, DvzSamplerAddressMode address_mode)
-{
-    ANN(stim);
-    ASSERT(layer_idx < DSTIM_MAX_LAYERS);
+        for (uint32_t i = 0; i < chunk->index_count; i++)
+        {
+            vertex = &vertices[sorted[chunk->first_index + i]];
+            chunk->radius =
+                MAX(chunk->radius, glm_vec3_distance(chunk->center, vertex->vertexPos));
+        }
+    }
+    stim->chunks[unbounded].radius = -1;
+    if (stim->chunks[unbounded].index_count > 0)
+        log_warn(
+            "%d sphere triangles refer to missing vertices and cannot be culled",
+            stim->chunks[unbounded].index_count / 3);
 
-    DvzBatch* batch = stim->batch;
-    ANN(batch);
+    FREE(stim->sphere_indices);
+    stim->sphere_indices = sorted;
 
-    DvzRequest req = dvz_create_sampler(batch, filter, address_mode);
-    stim->sampler_ids[layer_idx] = req.id;
+    TOUCH_CULLING
+    TOUCH_RECORD
 }
 
 
 
-static void bind_texture(DStim* stim, uint32_t layer_idx)
+static void upload_sphere_indices(DStim* stim)
 {
     ANN(stim);
-    ASSERT(layer_idx < DSTIM_MAX_LAYERS);
-
-    DvzBatch* batch = stim->batch;
-    ANN(batch);
-
-    DvzId tex_id = stim->texture_ids[layer_idx];
-    ASSERT(tex_id != DVZ_ID_NONE);
+    ANN(stim->sphere_indices);
+    ASSERT(stim->sphere_index_id != DVZ_ID_NONE);
 
-    dvz_bind_tex(
-        batch, stim->sphere_graphics_ids[layer_idx], 0, tex_id, stim->sampler_ids[layer_idx],
-        (uvec3){0, 0, 0});
+    DvzSize buffer_size = stim->sphere_index_count * sizeof(DvzIndex);
+    ASSERT(buffer_size > 0);
+    dvz_upload_dat(stim->batch, stim->sphere_index_id, 0, buffer_size, stim->sphere_indices, 0);
 }
 
 
 
-static void upload_texture(DStim* stim, uint32_t layer_idx)
+static void
+set_sphere_vertices(DStim* stim, uint32_t vertex_count, DStimVertex* vertices, bool is_compact)
 {
     ANN(stim);
-    GET_LAYER
+    ASSERT(vertex_count > 0);
+    ANN(vertices);
 
     DvzBatch* batch = stim->batch;
     ANN(batch);
 
-    DvzId tex_id = stim->texture_ids[layer_idx];
-    ASSERT(tex_id != DVZ_ID_NONE);
+    DvzSize buffer_size = vertex_count * sizeof(DStimVertex);
+    ASSERT(buffer_size > 0);
 
-    uint32_t width = layer->tex_width;
-    uint32_t height = layer->tex_height;
-    DvzSize tex_nbytes = layer->tex_nbytes;
-    uint8_t* rgba = layer->rgba;
+    if (is_compact)
+    {
+        // Only upload the vertexUV, as two unorm16 (the vertices must be on the unit sphere).
+        DvzSize compact_size = vertex_count * sizeof(DStimCompactVertex);
+        DStimCompactVertex* compact = (DStimCompactVertex*)malloc(compact_size);
+        uint32_t u = 0, v = 0;
+        for (uint32_t i = 0; i < vertex_count; i++)
+        {
+            u = (uint32_t)roundf(glm_clamp(vertices[i].vertexUV[0], 0, 1) * 65535);
+            v = (uint32_t)roundf(glm_clamp(vertices[i].vertexUV[1], 0, 1) * 65535);
+            compact[i].packedUV = u | (v << 16);
+        }
+        create_sphere_vertex_buffer(stim, compact_size);
+        dvz_upload_dat(batch, stim->sphere_vertex_id, 0, compact_size, compact, 0);
+        FREE(compact);
+    }
+    else
+    {
+        create_sphere_vertex_buffer(stim, buffer_size);
+        dvz_upload_dat(batch, stim->sphere_vertex_id, 0, buffer_size, vertices, 0);
+    }
 
-    ASSERT(width > 0);
-    ASSERT(height > 0);
-    ASSERT(tex_nbytes > 0);
-    ANN(rgba);
+    // The vertex format is part of the pipelines: resolve them again if it changes.
+    if (stim->is_mesh_compact != is_compact)
+    {
+        stim->is_mesh_compact = is_compact;
+        for (uint32_t layer_idx = 0; layer_idx < stim->layer_count; layer_idx++)
+        {
+            stim->layers[layer_idx].is_state_dirty = true;
+        }
+    }
 
-    dvz_upload_tex(
-        stim->batch, tex_id, (uvec3){0, 0, 0}, (uvec3){width, height, 1}, tex_nbytes, rgba, 0);
+    // Keep a copy of the vertices to bound the chunks of the sphere mesh.
+    if (stim->sphere_vertices != NULL)
+    {
+        FREE(stim->sphere_vertices);
+    }
+    stim->sphere_vertices = _cpy(buffer_size, vertices);
+    stim->sphere_vertex_count = vertex_count;
+
+    // The chunks need to be computed again with the new vertices.
+    if (stim->sphere_indices != NULL)
+    {
+        build_chunks(stim);
+        upload_sphere_indices(stim);
+    }
 }
 
 
 
-static void set_blend(DStim* stim, uint32_t layer_idx)
+static void create_layer_params_buffer(DStim* stim)
 {
     ANN(stim);
-    GET_LAYER
 
     DvzBatch* batch = stim->batch;
     ANN(batch);
 
-    DvzBlendType blend = DVZ_BLEND_DISABLE;
-
-    if (layer->blend == DSTIM_BLEND_DST)
-    {
-        blend = DVZ_BLEND_DESTINATION;
-    }
-
-    dvz_set_blend(batch, stim->sphere_graphics_ids[layer_idx], blend);
+    // Create the uniform buffer dat with the parameters of all layers.
+    DvzRequest req = dvz_create_dat(
+        batch, DVZ_BUFFER_TYPE_UNIFORM, DSTIM_MAX_LAYERS * sizeof(DStimParams),
+        DVZ_DAT_FLAGS_PERSISTENT_STAGING);
+    stim->layer_params_id = req.id;
 }
 
 
 
-static void set_mask(DStim* stim, uint32_t layer_idx)
+static void bind_layer_params_buffer(DStim* stim, DvzId graphics_id)
 {
     ANN(stim);
-    GET_LAYER
+    ASSERT(graphics_id != DVZ_ID_NONE);
 
     DvzBatch* batch = stim->batch;
     ANN(batch);
 
-    dvz_set_mask(batch, stim->sphere_graphics_ids[layer_idx], layer->mask);
+    dvz_bind_dat(batch, graphics_id, 1, stim->layer_params_id, 0);
 }
 
 
 
-static void prepare_sphere_pipeline(DStim* stim, uint32_t layer_idx)
+static void create_screen_params_buffer(DStim* stim)
 {
     ANN(stim);
-    GET_LAYER
 
     DvzBatch* batch = stim->batch;
     ANN(batch);
 
-    stim->sphere_graphics_ids[layer_idx] = create_sphere_pipeline(batch);
-
-    // Bind buffers to the new pipeline.
-    bind_sphere_vertex_buffer(stim, layer_idx);
-    bind_sphere_index_buffer(stim, layer_idx);
-
-    // Create texture.
-    DvzFormat format = layer->format;
-    uint32_t width = layer->tex_width;
-    uint32_t height = layer->tex_height;
-
-    // NOTE TODO: cannot change texture size after layer creation. Need to emit texture resize
-    // request.
-    create_texture(stim, layer_idx, format, width, height);
-
-    // Create sampler.
-    DvzFilter filter = layer->interpolation == DSTIM_INTERPOLATION_NEAREST ? DVZ_FILTER_NEAREST
-                                                                           : DVZ_FILTER_LINEAR;
-
-    DvzSamplerAddressMode address_mode = layer->is_periodic
-                                             ? DVZ_SAMPLER_ADDRESS_MODE_REPEAT
-                                             : DVZ_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
-
-    create_sampler(stim, layer_idx, filter, address_mode);
-
-    // Bind the texture and sampler to the layer's pipeline.
-    bind_texture(stim, layer_idx);
-
-    // NOTE: address the case where these parameters change afterwards.
-    set_blend(stim, layer_idx);
-    set_mask(stim, layer_idx);
+    // Create the uniform buffer dat with the parameters of all screens.
+    DvzRequest req = dvz_create_dat(
+        batch, DVZ_BUFFER_TYPE_UNIFORM, DSTIM_MAX_SCREENS * sizeof(DStimScreenParams),
+        DVZ_DAT_FLAGS_PERSISTENT_STAGING);
+    stim->screen_params_id = req.id;
 }
 
 
 
-static void push_sphere_pipeline(DStim* stim, uint32_t layer_idx, DStimPush* push)
+static void bind_screen_params_buffer(DStim* stim, DvzId graphics_id)
 {
     ANN(stim);
-    GET_LAYER
+    ASSERT(graphics_id != DVZ_ID_NONE);
 
     DvzBatch* batch = stim->batch;
     ANN(batch);
 
-    // Send the push constant to the command buffer.
-    dvz_record_push(
-        batch, stim->canvas_id, stim->sphere_graphics_ids[layer_idx],
-        DVZ_SHADER_VERTEX | DVZ_SHADER_FRAGMENT, 0, sizeof(DStimPush), push);
+    dvz_bind_dat(batch, graphics_id, 2, stim->screen_params_id, 0);
 }
 
 
 
-static void draw_sphere_pipeline(DStim* stim, uint32_t layer_idx)
+static void create_curves_buffer(DStim* stim)
 {
     ANN(stim);
-    GET_LAYER
 
     DvzBatch* batch = stim->batch;
     ANN(batch);
 
-    // Sphere.
-    dvz_record_draw_indexed(
-        batch, stim->canvas_id, stim->sphere_graphics_ids[layer_idx], 0, 0,
-        stim->sphere_index_count, 0, 1);
+    // Create the storage buffer dat with the curves of all layers.
+    DvzSize size = sizeof(DStimCurvesHeader) +
+                   DSTIM_MAX_LAYERS * DSTIM_CURVE_PARAM_COUNT * sizeof(DStimCurveParams) +
+                   DSTIM_MAX_CURVE_SAMPLES * sizeof(float);
+    DvzRequest req =
+        dvz_create_dat(batch, DVZ_BUFFER_TYPE_STORAGE, size, DVZ_DAT_FLAGS_PERSISTENT_STAGING);
+    stim->curves_id = req.id;
 }
 
 
 
-static void fill_push(DStim* stim, uint32_t layer_idx, mat4 projection, DStimPush* push)
+static void bind_curves_buffer(DStim* stim, DvzId graphics_id)
 {
     ANN(stim);
-    ANN(push);
-    GET_LAYER
+    ASSERT(graphics_id != DVZ_ID_NONE);
 
     DvzBatch* batch = stim->batch;
     ANN(batch);
 
-    // Per-screen projection matrix.
-    glm_mat4_copy(projection, push->projection);
-
-    // Per-layer view matrix.
-    glm_mat4_copy(layer->view, push->view);
-
-    // Push constants parameters.
-    push->min_color[0] = layer->min_color[0] / 255.0;
-    push->min_color[1] = layer->min_color[1] / 255.0;
-    push->min_color[2] = layer->min_color[2] / 255.0;
-    push->min_color[3] = layer->min_color[3] / 255.0;
-
-    push->max_color[0] = layer->max_color[0] / 255.0;
-    push->max_color[1] = layer->max_color[1] / 255.0;
-    push->max_color[2] = layer->max_color[2] / 255.0;
-    push->max_color[3] = layer->max_color[3] / 255.0;
+    dvz_bind_dat(batch, graphics_id, 3, stim->curves_id, 0);
+}
 
-    push->tex_offset[0] = layer->tex_offset[0];
-    push->tex_offset[1] = layer->tex_offset[1];
 
-    push->tex_size[0] = layer->tex_size[0];
-    push->tex_size[1] = layer->tex_size[1];
 
-    push->tex_angle = layer->tex_angle;
+// Empty command queue: the slot i is free for the producer with the enqueue position i.
+static void init_commands(DStim* stim)
+{
+    ANN(stim);
+    for (size_t i = 0; i < DSTIM_QUEUE_SIZE; i++)
+        atomic_init(&stim->commands[i].seq, i);
+    atomic_init(&stim->command_head, 0);
+    stim->command_tail = 0;
 }
 
 
 
-/*************************************************************************************************/
-/*  DStim functions                                                                              */
-/*************************************************************************************************/
-
-DStim* dstim_init(uint32_t width, uint32_t height)
+static void generate_sphere(
+    uint32_t tessellation, uint32_t* vertex_count, DStimVertex** vertices, uint32_t* index_count,
+    DvzIndex** indices)
 {
-    if (width == 0)
-    {
-        log_error("width cannot be zero");
-        return NULL;
-    }
-    if (height == 0)
+    ASSERT(tessellation > 0);
+    ANN(vertex_count);
+    ANN(vertices);
+    ANN(index_count);
+    ANN(indices);
+
+    // UV sphere, column-major (one column of row_count vertices per longitude, from the south to
+    // the north pole), with the vertexUV convention expected by the vertex shader: u in [0, 1]
+    // around the y axis, v in [0, 1] from the north to the south pole.
+    uint32_t rows = tessellation;
+    uint32_t cols = 2 * tessellation;
+    uint32_t row_count = rows + 1;
+    uint32_t col_count = cols + 1;
+
+    *vertex_count = col_count * row_count;
+    *vertices = (DStimVertex*)calloc(*vertex_count, sizeof(DStimVertex));
+    DStimVertex* vertex = NULL;
+    float u = 0, v = 0;
+    for (uint32_t i = 0; i < col_count; i++)
     {
-        log_error("height cannot be zero");
-        return NULL;
+        u = i / (float)cols;
+        for (uint32_t j = 0; j < row_count; j++)
+        {
+            v = 1 - j / (float)rows;
+            vertex = &(*vertices)[i * row_count + j];
+            vertex->vertexPos[0] = sin(M_PI * v) * cos(2 * M_PI * u);
+            vertex->vertexPos[1] = cos(M_PI * v);
+            vertex->vertexPos[2] = sin(M_PI * v) * sin(2 * M_PI * u);
+            vertex->vertexUV[0] = u;
+            vertex->vertexUV[1] = v;
+        }
     }
 
-    DStim* stim = (DStim*)calloc(1, sizeof(DStim));
-    stim->width = width;
-    stim->height = height;
-    for (uint32_t i = 0; i < DSTIM_MAX_LAYERS; i++)
+    // Two triangles per quad.
+    *index_count = 6 * cols * rows;
+    *indices = (DvzIndex*)calloc(*index_count, sizeof(DvzIndex));
+    DvzIndex* index = *indices;
+    uint32_t a = 0, b = 0;
+    for (uint32_t i = 0; i < cols; i++)
     {
-        stim->layers[i].is_blank = true;
+        for (uint32_t j = 0; j < rows; j++)
+        {
+            a = i * row_count + j; // current column
+            b = a + row_count;     // next column
+
+            *index++ = a;
+            *index++ = b + 1;
+            *index++ = b;
+
+            *index++ = a;
+            *index++ = a + 1;
+            *index++ = b + 1;
+        }
     }
+}
 
-    // App.
-    // --------------------------------------------------------------------------------------------
 
-    DvzApp* app = dvz_app(0);
-    DvzBatch* batch = dvz_app_batch(app);
 
-    stim->app = app;
-    stim->batch = batch;
+static void delete_later(DStim* stim, DvzId id, bool is_texture)
+{
+    ANN(stim);
 
-    DvzRequest req = {0};
+    // The command buffer recorded for the previous frames may still bind the object: it is only
+    // deleted once these frames are no longer in flight.
+    ASSERT(stim->deletion_count < DSTIM_MAX_DELETIONS);
+    stim->deletions[stim->deletion_count++] =
+        (DDeletion){id, is_texture, stim->frame_idx + DSTIM_FRAMES_IN_FLIGHT};
+}
 
 
-    // Background.
-    // --------------------------------------------------------------------------------------------
 
-    create_background(stim);
-    upload_rectangle(batch, stim->background_vertex_id, (vec2){-1, -1}, (vec2){+2, +2});
-    dstim_background(stim, DSTIM_DEFAULT_BACKGROUND);
+static void process_deletions(DStim* stim)
+{
+    ANN(stim);
 
+    uint32_t i = 0;
+    DDeletion* d = NULL;
+    while (i < stim->deletion_count)
+    {
+        d = &stim->deletions[i];
+        if (d->frame <= stim->frame_idx)
+        {
+            if (d->is_texture)
+                dvz_delete_tex(stim->batch, d->id);
+            else
+                dvz_delete_graphics(stim->batch, d->id);
+            stim->deletions[i] = stim->deletions[--stim->deletion_count];
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
 
-    // Square.
-    // --------------------------------------------------------------------------------------------
 
-    create_square(stim);
-    uint32_t sw = DSTIM_DEFAULT_SQUARE_WIDTH;
-    uint32_t sh = DSTIM_DEFAULT_SQUARE_HEIGHT;
-    dstim_square_pos(stim, width - sw, height - sh, sw, sh);
-    dstim_square_color(stim, DSTIM_DEFAULT_SQUARE_COLOR);
 
+static void forget_texture(DStim* stim, DvzId texture_id)
+{
+    ANN(stim);
 
-    // Sphere.
-    // --------------------------------------------------------------------------------------------
+    // Delete the cached pipelines bound to a texture that is about to be deleted.
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < stim->pipeline_count; i++)
+    {
+        if (stim->pipelines[i].texture_id == texture_id)
+        {
+            delete_later(stim, stim->pipelines[i].graphics_id, false);
+            continue;
+        }
+        stim->pipelines[count++] = stim->pipelines[i];
+    }
+    stim->pipeline_count = count;
+}
 
-    uint32_t sphere_vertex_count = 20706;
 
-    // Create the vertex buffer dat for the sphere.
-    create_sphere_vertex_buffer(stim, sphere_vertex_count);
-    load_sphere_vertex_data(stim, sphere_vertex_count); // load from disk
 
-    // Create the index buffer dat for the sphere.// load from disk
-    stim->sphere_index_count = 124236;
-    create_sphere_index_buffer(stim, stim->sphere_index_count);
-    load_sphere_index_data(stim, stim->sphere_index_count);
+static DvzId acquire_texture(
+    DStim* stim, DvzFormat format, uint32_t width, uint32_t height, uint64_t hash,
+    bool* has_content)
+{
+    ANN(stim);
+    ANN(has_content);
+
+    ASSERT(width > 0);
+    ASSERT(height > 0);
 
+    DvzBatch* batch = stim->batch;
+    ANN(batch);
 
-    // Canvas.
-    // --------------------------------------------------------------------------------------------
+    // Share a texture that already holds the same content, used or not.
+    DTexture* texture = NULL;
+    for (uint32_t i = 0; i < stim->texture_count && hash != 0; i++)
+    {
+        texture = &stim->textures[i];
+        if (texture->hash == hash && texture->format == format && texture->width == width &&
+            texture->height == height)
+        {
+            texture->ref_count++;
+            *has_content = true;
+            return texture->tex_id;
+        }
+    }
+    *has_content = false;
 
-    req = dvz_create_canvas(batch, width, height, DVZ_DEFAULT_CLEAR_COLOR, 0);
-    stim->canvas_id = req.id;
+    // Otherwise, recycle an unused texture with the same format and size.
+    for (uint32_t i = 0; i < stim->texture_count; i++)
+    {
+        texture = &stim->textures[i];
+        if (texture->ref_count == 0 && texture->format == format && texture->width == width &&
+            texture->height == height)
+        {
+            texture->hash = hash;
+            texture->ref_count = 1;
+            return texture->tex_id;
+        }
+    }
 
+    // Otherwise, create a new texture, in place of an unused one if the pool is full.
+    texture = NULL;
+    if (stim->texture_count < DSTIM_MAX_TEXTURES)
+    {
+        texture = &stim->textures[stim->texture_count++];
+    }
+    else
+    {
+        for (uint32_t i = 0; i < stim->texture_count; i++)
+        {
+            if (stim->textures[i].ref_count == 0)
+            {
+                texture = &stim->textures[i];
+                forget_texture(stim, texture->tex_id);
+                delete_later(stim, texture->tex_id, true);
+                break;
+            }
+        }
+    }
+    ANN(texture); // NOTE: at most one texture used per layer
 
-    return stim;
+    log_debug("create texture %dx%d", width, height);
+    DvzRequest req = dvz_create_tex(batch, 2, format, (uvec3){width, height, 1}, 0);
+    *texture = (DTexture){req.id, format, width, height, hash, 1};
+    return texture->tex_id;
 }
 
 
 
-void dstim_background(DStim* stim, uint8_t red, uint8_t green, uint8_t blue, uint8_t alpha)
+static void release_texture_id(DStim* stim, DvzId tex_id)
 {
     ANN(stim);
-    rectangle_color(stim->batch, stim->background_params_id, red, green, blue, alpha);
+
+    // Keep the texture, its content, and its cached pipelines, for the next layer with the same
+    // format and size.
+    for (uint32_t i = 0; i < stim->texture_count; i++)
+    {
+        if (stim->textures[i].tex_id == tex_id)
+        {
+            ASSERT(stim->textures[i].ref_count > 0);
+            stim->textures[i].ref_count--;
+            return;
+        }
+    }
 }
 
 
 
-void dstim_vertices(DStim* stim, uint32_t vertex_count, DStimVertex* vertices)
+static DvzId get_sampler(DStim* stim, DvzFilter filter, DvzSamplerAddressMode address_mode)
 {
     ANN(stim);
-    ASSERT(vertex_count > 0);
-    ANN(vertices);
 
-    DvzSize buffer_size = vertex_count * sizeof(DStimVertex);
-    ASSERT(buffer_size > 0);
-    ASSERT(stim->sphere_vertex_id != DVZ_ID_NONE);
-    DvzRequest req =
-        dvz_upload_dat(stim->batch, stim->sphere_vertex_id, 0, buffer_size, vertices, 0);
+    DvzBatch* batch = stim->batch;
+    ANN(batch);
+
+    // Look up the sampler cache.
+    DSampler* sampler = NULL;
+    for (uint32_t i = 0; i < stim->sampler_count; i++)
+    {
+        sampler = &stim->samplers[i];
+        if (sampler->filter == filter && sampler->address_mode == address_mode)
+            return sampler->sampler_id;
+    }
+
+    // Create a new sampler.
+    ASSERT(stim->sampler_count < DSTIM_MAX_SAMPLERS);
+    sampler = &stim->samplers[stim->sampler_count++];
+    sampler->filter = filter;
+    sampler->address_mode = address_mode;
+
+    DvzRequest req = dvz_create_sampler(batch, filter, address_mode);
+    sampler->sampler_id = req.id;
+    return sampler->sampler_id;
 }
 
 
 
-void dstim_indices(DStim* stim, uint32_t index_count, uint32_t* indices)
+static void bind_texture(DStim* stim, DvzId graphics_id, DvzId tex_id, DvzId sampler_id)
 {
     ANN(stim);
-    ASSERT(index_count > 0);
-    ANN(indices);
+    ASSERT(graphics_id != DVZ_ID_NONE);
+    ASSERT(tex_id != DVZ_ID_NONE);
+    ASSERT(sampler_id != DVZ_ID_NONE);
 
-    DvzSize buffer_size = index_count * sizeof(DvzIndex);
-    ASSERT(buffer_size > 0);
-    ASSERT(stim->sphere_index_id != DVZ_ID_NONE);
-    DvzRequest req =
-        dvz_upload_dat(stim->batch, stim->sphere_index_id, 0, buffer_size, indices, 0);
+    DvzBatch* batch = stim->batch;
+    ANN(batch);
+
+    dvz_bind_tex(batch, graphics_id, 0, tex_id, sampler_id, (uvec3){0, 0, 0});
 }
 
 
 
-void dstim_square_pos(DStim* stim, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+static void mark_uploaded(DStim* stim, DLayer* layer)
 {
     ANN(stim);
+    ANN(layer);
+
+    // NOTE: the texture data is uploaded without copy, so the renderer reads it until the batch
+    // has been processed.
+    layer->is_uploaded = true;
+    layer->upload_frame = stim->frame_idx;
+    if (!layer->is_borrowed)
+        layer->staging_free[layer->staging_idx] = stim->frame_idx + DSTIM_FRAMES_IN_FLIGHT;
+}
 
-    // from pixels to NDC
-    float xf = -1 + 2.0 * (float)x / (float)stim->width;
-    float yf = -1 + 2.0 * (float)y / (float)stim->height;
 
-    float wf = 2.0 * (float)w / (float)stim->width;
-    float hf = 2.0 * (float)h / (float)stim->height;
 
-    upload_rectangle(stim->batch, stim->square_vertex_id, (vec2){xf, yf}, (vec2){wf, hf});
+static void release_texture(DStim* stim, DLayer* layer)
+{
+    ANN(stim);
+    ANN(layer);
+
+    // Staging buffers are kept and reused.
+    if (!layer->is_borrowed)
+        return;
+
+    // A caller's buffer is released right away if it has never been uploaded, otherwise once the
+    // renderer no longer reads it.
+    if (layer->release != NULL)
+    {
+        if (!layer->is_uploaded)
+        {
+            layer->release(layer->rgba, layer->release_data);
+        }
+        else
+        {
+            ASSERT(stim->release_count < DSTIM_MAX_RELEASES);
+            stim->releases[stim->release_count++] = (DRelease){
+                layer->release, layer->rgba, layer->release_data,
+                layer->upload_frame + DSTIM_FRAMES_IN_FLIGHT};
+        }
+    }
+
+    layer->rgba = NULL;
+    layer->is_borrowed = false;
+    layer->release = NULL;
+    layer->release_data = NULL;
+}
+
+
+
+static void process_releases(DStim* stim, bool force)
+{
+    ANN(stim);
+
+    uint32_t i = 0;
+    DRelease* r = NULL;
+    while (i < stim->release_count)
+    {
+        r = &stim->releases[i];
+        if (force || r->frame <= stim->frame_idx)
+        {
+            r->release(r->rgba, r->user_data);
+            stim->releases[i] = stim->releases[--stim->release_count];
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
+
+
+static uint8_t* get_staging(DStim* stim, DLayer* layer, DvzSize nbytes)
+{
+    ANN(stim);
+    ANN(layer);
+    ASSERT(nbytes > 0);
+
+    // Find a staging buffer that the renderer no longer reads, starting with the current one.
+    // NOTE: a layer is uploaded at most once per frame, so one of the buffers is always free.
+    uint32_t idx = DSTIM_FRAMES_IN_FLIGHT;
+    for (uint32_t i = 0; i < DSTIM_FRAMES_IN_FLIGHT; i++)
+    {
+        uint32_t j = (layer->staging_idx + i) % DSTIM_FRAMES_IN_FLIGHT;
+        if (layer->staging_free[j] <= stim->frame_idx)
+        {
+            idx = j;
+            break;
+        }
+    }
+    ASSERT(idx < DSTIM_FRAMES_IN_FLIGHT);
+
+    // Only grow the buffer, so that steady-state texture changes do not allocate.
+    if (nbytes > layer->staging_nbytes[idx])
+    {
+        layer->staging[idx] = (uint8_t*)realloc(layer->staging[idx], nbytes);
+        layer->staging_nbytes[idx] = nbytes;
+    }
+    ANN(layer->staging[idx]);
+
+    layer->staging_idx = idx;
+    return layer->staging[idx];
+}
+
+
+
+static void borrow_texture(
+    DStim* stim, uint32_t layer_idx, DvzFormat format, //
+    uint32_t width, uint32_t height, DvzSize tex_nbytes, uint8_t* rgba,
+    DStimReleaseCallback release, void* user_data)
+{
+    ANN(stim);
+
+    ASSERT(tex_nbytes > 0);
+    ASSERT(width > 0);
+    ASSERT(height > 0);
+    ANN(rgba);
+
+    GET_LAYER
+    TOUCH_LAYER_TEXTURE
+    TOUCH_CULLING
+
+    layer->format = format;
+    layer->tex_width = width;
+    layer->tex_height = height;
+    layer->tex_nbytes = tex_nbytes;
+
+    // Use the caller's buffer without copy.
+    if (layer->is_banked)
+    {
+        layer->is_banked = false;
+        TOUCH_LAYER
+        TOUCH_LAYER_STATE
+    }
+    release_texture(stim, layer);
+    layer->rgba = rgba;
+    layer->tex_hash = 0;
+    layer->is_borrowed = true;
+    layer->release = release;
+    layer->release_data = user_data;
+    layer->is_uploaded = false;
+}
+
+
+
+static void copy_on_write(DStim* stim, DLayer* layer)
+{
+    ANN(stim);
+    ANN(layer);
+    ANN(layer->rgba);
+
+    // The texture data may be written in place if it is in a staging buffer that the renderer no
+    // longer reads. A caller's buffer (or a movie frame) is never written.
+    if (!layer->is_borrowed && layer->staging_free[layer->staging_idx] <= stim->frame_idx)
+        return;
+
+    // Otherwise, copy it to a free staging buffer, and release the caller's buffer. The texture
+    // on the GPU is unchanged, so the layer stays uploaded.
+    uint8_t* rgba = get_staging(stim, layer, layer->tex_nbytes);
+    ASSERT(rgba != layer->rgba);
+    memcpy(rgba, layer->rgba, layer->tex_nbytes);
+    release_texture(stim, layer);
+    layer->rgba = rgba;
+}
+
+
+
+static void upload_texture_region(DStim* stim, uint32_t layer_idx)
+{
+    ANN(stim);
+    GET_LAYER
+
+    DvzBatch* batch = stim->batch;
+    ANN(batch);
+
+    ASSERT(layer->has_dirty_region);
+    ANN(layer->rgba);
+
+    uint32_t x = layer->dirty_region[0];
+    uint32_t y = layer->dirty_region[1];
+    uint32_t w = layer->dirty_region[2] - x;
+    uint32_t h = layer->dirty_region[3] - y;
+    ASSERT(w > 0);
+    ASSERT(h > 0);
+
+    // Gather the region's rows from the layer's texture copy.
+    DvzSize texel_size = layer->tex_nbytes / (layer->tex_width * layer->tex_height);
+    DvzSize row_size = w * texel_size;
+    DvzSize nbytes = h * row_size;
+    if (nbytes > layer->region_nbytes)
+    {
+        layer->region = (uint8_t*)realloc(layer->region, nbytes);
+        layer->region_nbytes = nbytes;
+    }
+    for (uint32_t i = 0; i < h; i++)
+    {
+        memcpy(
+            &layer->region[i * row_size],
+            &layer->rgba[((y + i) * layer->tex_width + x) * texel_size], row_size);
+    }
+
+    // Upload it in the layer's texture, or in the layer's slice of the texture array.
+    if (layer->is_in_array)
+    {
+        dvz_upload_tex(
+            batch, stim->array_id, (uvec3){x, y, layer_idx}, (uvec3){w, h, 1}, nbytes,
+            layer->region, 0);
+    }
+    else
+    {
+        dvz_upload_tex(
+            batch, stim->texture_ids[layer_idx], (uvec3){x, y, 0}, (uvec3){w, h, 1}, nbytes,
+            layer->region, 0);
+    }
+}
+
+
+
+static uint32_t get_mip_levels(DLayer* layer)
+{
+    ANN(layer);
+
+    // Trilinear layers with unsigned normalized channels get a mip chain, down to 1x1.
+    if (layer->interpolation != DSTIM_INTERPOLATION_TRILINEAR || layer->is_banked ||
+        layer->rgba == NULL)
+        return 0;
+    if (layer->format != DVZ_FORMAT_R8G8B8A8_UNORM && layer->format != DVZ_FORMAT_R8_UNORM &&
+        layer->format != DVZ_FORMAT_R16_UNORM)
+        return 0;
+    return 1 + (uint32_t)floor(log2(MAX(layer->tex_width, layer->tex_height)));
+}
+
+
+
+static void get_texture_size(DLayer* layer, uint32_t* width, uint32_t* height)
+{
+    ANN(layer);
+    ANN(width);
+    ANN(height);
+
+    // NOTE: DRP has no mip levels, so the mip chain is packed in a mip atlas: the base level on
+    // the left, and the smaller levels stacked on its right. Must match mipRect() in sphere.frag.
+    *width = layer->tex_width;
+    *height = layer->tex_height;
+    uint32_t levels = get_mip_levels(layer);
+    if (levels <= 1)
+        return;
+
+    uint32_t h = layer->tex_height;
+    uint32_t column = 0;
+    for (uint32_t level = 1; level < levels; level++)
+    {
+        h = MAX(h / 2, 1);
+        column += h;
+    }
+    *width += MAX(layer->tex_width / 2, 1);
+    *height = MAX(*height, column);
+}
+
+
+
+static uint32_t get_mip_taps(uint32_t size, uint32_t idx, uint32_t* taps, float* weights)
+{
+    ANN(taps);
+    ANN(weights);
+
+    // Taps and weights of texel idx of the next level along a dimension of the given size: a
+    // 2-tap box for even sizes, and for odd sizes 2n + 1 a 3-tap filter covering (2n + 1) / n
+    // texels, so that every texel contributes.
+    if (size == 1)
+    {
+        taps[0] = 0;
+        weights[0] = 1;
+        return 1;
+    }
+    taps[0] = 2 * idx;
+    taps[1] = 2 * idx + 1;
+    if (size % 2 == 0)
+    {
+        weights[0] = weights[1] = .5f;
+        return 2;
+    }
+    uint32_t n = size / 2;
+    taps[2] = 2 * idx + 2;
+    weights[0] = (float)(n - idx) / size;
+    weights[1] = (float)n / size;
+    weights[2] = (float)(idx + 1) / size;
+    return 3;
+}
+
+
+
+static DvzSize build_mip_atlas(DLayer* layer)
+{
+    ANN(layer);
+    ANN(layer->rgba);
+
+    uint32_t levels = get_mip_levels(layer);
+    ASSERT(levels > 0);
+
+    uint32_t width = 0;
+    uint32_t height = 0;
+    get_texture_size(layer, &width, &height);
+
+    DvzSize texel_size = layer->tex_nbytes / (layer->tex_width * layer->tex_height);
+    DvzSize stride = width * texel_size;
+    DvzSize nbytes = height * stride;
+    if (nbytes > layer->mips_nbytes)
+    {
+        layer->mips = (uint8_t*)realloc(layer->mips, nbytes);
+        layer->mips_nbytes = nbytes;
+    }
+    uint8_t* mips = layer->mips;
+    memset(mips, 0, nbytes);
+
+    // Base level.
+    for (uint32_t y = 0; y < layer->tex_height; y++)
+    {
+        memcpy(
+            &mips[y * stride], &layer->rgba[y * layer->tex_width * texel_size],
+            layer->tex_width * texel_size);
+    }
+
+    // Each level is a box filter of the previous one, separable, and with 3 taps along the odd
+    // dimensions so that their last row or column is folded in.
+    bool is_16bit = layer->format == DVZ_FORMAT_R16_UNORM;
+    uint32_t channel_count = is_16bit ? 1 : texel_size;
+    uint8_t* m8 = mips;
+    uint16_t* m16 = (uint16_t*)mips;
+    uint32_t tx[3] = {0}, ty[3] = {0}; // taps in the previous level
+    float wx[3] = {0}, wy[3] = {0};    // weights of the taps
+    uint32_t sx = 0, sy = 0, sw = layer->tex_width, sh = layer->tex_height; // previous level
+    uint32_t dx = layer->tex_width, dy = 0;
+    for (uint32_t level = 1; level < levels; level++)
+    {
+        uint32_t dw = MAX(sw / 2, 1);
+        uint32_t dh = MAX(sh / 2, 1);
+        for (uint32_t y = 0; y < dh; y++)
+        {
+            uint32_t ny = get_mip_taps(sh, y, ty, wy);
+            for (uint32_t x = 0; x < dw; x++)
+            {
+                uint32_t nx = get_mip_taps(sw, x, tx, wx);
+                uint32_t e = ((dy + y) * width + dx + x) * channel_count;
+                for (uint32_t k = 0; k < channel_count; k++)
+                {
+                    float value = 0;
+                    for (uint32_t j = 0; j < ny; j++)
+                    {
+                        for (uint32_t i = 0; i < nx; i++)
+                        {
+                            uint32_t t = ((sy + ty[j]) * width + sx + tx[i]) * channel_count + k;
+                            value += wy[j] * wx[i] * (is_16bit ? m16[t] : m8[t]);
+                        }
+                    }
+                    if (is_16bit)
+                        m16[e + k] = (uint16_t)(value + .5f);
+                    else
+                        m8[e + k] = (uint8_t)(value + .5f);
+                }
+            }
+        }
+        sx = dx;
+        sy = dy;
+        sw = dw;
+        sh = dh;
+        dy += dh;
+    }
+
+    return nbytes;
+}
+
+
+
+static void upload_texture(DStim* stim, uint32_t layer_idx)
+{
+    ANN(stim);
+    GET_LAYER
+
+    DvzBatch* batch = stim->batch;
+    ANN(batch);
+
+    DvzId tex_id = stim->texture_ids[layer_idx];
+    ASSERT(tex_id != DVZ_ID_NONE);
+
+    uint32_t width = layer->tex_width;
+    uint32_t height = layer->tex_height;
+    DvzSize tex_nbytes = layer->tex_nbytes;
+    uint8_t* rgba = layer->rgba;
+
+    ASSERT(width > 0);
+    ASSERT(height > 0);
+    ASSERT(tex_nbytes > 0);
+    ANN(rgba);
+
+    // Trilinear layers: upload the whole mip atlas, copied in the request as it is reused.
+    if (get_mip_levels(layer) > 0)
+    {
+        tex_nbytes = build_mip_atlas(layer);
+        get_texture_size(layer, &width, &height);
+        dvz_upload_tex(
+            stim->batch, tex_id, (uvec3){0, 0, 0}, (uvec3){width, height, 1}, tex_nbytes,
+            layer->mips, 0);
+        mark_uploaded(stim, layer);
+        return;
+    }
+
+    dvz_upload_tex(
+        stim->batch, tex_id, (uvec3){0, 0, 0}, (uvec3){width, height, 1}, tex_nbytes, rgba,
+        DVZ_UPLOAD_FLAGS_NOCOPY);
+    mark_uploaded(stim, layer);
+}
+
+
+
+static DvzBlendType get_blend(DStimBlend blend)
+{
+    switch (blend)
+    {
+    case DSTIM_BLEND_DST:
+        return DVZ_BLEND_DESTINATION;
+    default:
+        return DVZ_BLEND_DISABLE;
+    }
+}
+
+
+
+static DvzId create_pipeline(DStim* stim, DPipeline* key)
+{
+    ANN(stim);
+    ANN(key);
+
+    DvzBatch* batch = stim->batch;
+    ANN(batch);
+
+    DvzId graphics_id = DVZ_ID_NONE;
+    if (key->is_raycast)
+    {
+        // The ray-casting pipeline draws the background rectangle, without the sphere mesh.
+        graphics_id = create_raycast_pipeline(batch, key->vertex_id, key->fragment_id);
+        dvz_bind_vertex(batch, graphics_id, 0, stim->background_vertex_id, 0);
+    }
+    else
+    {
+        graphics_id =
+            create_sphere_pipeline(batch, key->vertex_id, key->fragment_id, key->is_compact);
+        bind_sphere_vertex_buffer(stim, graphics_id);
+        bind_sphere_index_buffer(stim, graphics_id);
+    }
+
+    // Bind buffers to the new pipeline.
+    bind_layer_params_buffer(stim, graphics_id);
+    bind_screen_params_buffer(stim, graphics_id);
+    bind_curves_buffer(stim, graphics_id);
+
+    // Bind the texture and sampler to the pipeline.
+    bind_texture(stim, graphics_id, key->texture_id, key->sampler_id);
+
+    // Fixed state.
+    dvz_set_blend(batch, graphics_id, key->blend);
+    dvz_set_mask(batch, graphics_id, key->mask);
+
+    return graphics_id;
+}
+
+
+
+static bool is_pipeline_used(DStim* stim, DvzId graphics_id)
+{
+    ANN(stim);
+    for (uint32_t layer_idx = 0; layer_idx < stim->layer_count; layer_idx++)
+    {
+        if (stim->sphere_graphics_ids[layer_idx] == graphics_id)
+            return true;
+    }
+    return false;
+}
+
+
+
+static DvzId get_pipeline(DStim* stim, DPipeline* key)
+{
+    ANN(stim);
+    ANN(key);
+
+    // Look up the pipeline cache.
+    DPipeline* pipeline = NULL;
+    for (uint32_t i = 0; i < stim->pipeline_count; i++)
+    {
+        pipeline = &stim->pipelines[i];
+        if (pipeline->blend == key->blend && pipeline->mask == key->mask &&
+            pipeline->vertex_id == key->vertex_id && pipeline->fragment_id == key->fragment_id &&
+            pipeline->sampler_id == key->sampler_id && pipeline->texture_id == key->texture_id &&
+            pipeline->is_compact == key->is_compact && pipeline->is_raycast == key->is_raycast)
+            return pipeline->graphics_id;
+    }
+
+    // Find a free entry, or evict a pipeline that is no longer used by any layer.
+    pipeline = NULL;
+    if (stim->pipeline_count < DSTIM_MAX_PIPELINES)
+    {
+        pipeline = &stim->pipelines[stim->pipeline_count++];
+    }
+    else
+    {
+        for (uint32_t i = 0; i < stim->pipeline_count; i++)
+        {
+            if (!is_pipeline_used(stim, stim->pipelines[i].graphics_id))
+            {
+                pipeline = &stim->pipelines[i];
+                log_debug("evict pipeline %d from the pipeline cache", i);
+                delete_later(stim, pipeline->graphics_id, false);
+                break;
+            }
+        }
+    }
+    ANN(pipeline);
+
+    *pipeline = *key;
+    pipeline->graphics_id = create_pipeline(stim, key);
+
+    return pipeline->graphics_id;
+}
+
+
+
+static void prepare_layer(DStim* stim, uint32_t layer_idx)
+{
+    ANN(stim);
+    GET_LAYER
+
+    // Layers in the texture array or the texture bank do not need their own texture.
+    bool is_needed = layer->rgba != NULL && !layer->is_in_array && !layer->is_banked;
+    DvzId tex_id = stim->texture_ids[layer_idx];
+    if (tex_id == DVZ_ID_NONE && !is_needed)
+        return;
+
+    // Keep the current texture if it has the layer's format and size.
+    uint32_t width = 0;
+    uint32_t height = 0;
+    get_texture_size(layer, &width, &height);
+    DTexture* texture = NULL;
+    for (uint32_t i = 0; i < stim->texture_count && tex_id != DVZ_ID_NONE; i++)
+    {
+        if (stim->textures[i].tex_id == tex_id)
+            texture = &stim->textures[i];
+    }
+    // NOTE: a texture shared with other layers is only kept while the layer shows the same
+    // content, otherwise the layer's upload would change the other layers. A texture of its own
+    // is uploaded again, unless another texture already holds the content: it is then shared.
+    if (is_needed && texture != NULL && texture->format == layer->format &&
+        texture->width == width && texture->height == height)
+    {
+        if (layer->tex_hash != 0 && texture->hash == layer->tex_hash)
+            return;
+
+        bool is_held = false;
+        for (uint32_t i = 0; i < stim->texture_count && layer->tex_hash != 0; i++)
+        {
+            DTexture* other = &stim->textures[i];
+            is_held |= other->hash == layer->tex_hash && other->format == layer->format &&
+                       other->width == width && other->height == height;
+        }
+        if (texture->ref_count == 1 && !is_held)
+        {
+            texture->hash = layer->tex_hash;
+            return;
+        }
+    }
+
+    // Otherwise, give it back to the texture pool and take one that fits.
+    log_debug("layer %d: prepare layer", layer_idx);
+    if (tex_id != DVZ_ID_NONE)
+        release_texture_id(stim, tex_id);
+    stim->texture_ids[layer_idx] = DVZ_ID_NONE;
+    if (is_needed)
+    {
+        bool has_content = false;
+        stim->texture_ids[layer_idx] =
+            acquire_texture(stim, layer->format, width, height, layer->tex_hash, &has_content);
+
+        // Skip the upload if the texture already holds the layer's content.
+        if (has_content)
+        {
+            stim->stats.texture_hit_count++;
+            layer->is_texture_dirty = false;
+            layer->has_dirty_region = false;
+        }
+        else
+        {
+            TOUCH_LAYER_TEXTURE
+        }
+    }
+    TOUCH_LAYER_STATE
+}
+
+
+
+static DvzId get_dummy_texture(DStim* stim)
+{
+    ANN(stim);
+    if (stim->dummy_texture_id == DVZ_ID_NONE)
+    {
+        DvzRequest req =
+            dvz_create_tex(stim->batch, 2, DVZ_FORMAT_R8G8B8A8_UNORM, (uvec3){1, 1, 1}, 0);
+        stim->dummy_texture_id = req.id;
+    }
+    return stim->dummy_texture_id;
+}
+
+
+
+static void resolve_pipeline(DStim* stim, uint32_t layer_idx)
+{
+    ANN(stim);
+    GET_LAYER
+
+    DvzFilter filter = layer->interpolation == DSTIM_INTERPOLATION_NEAREST ? DVZ_FILTER_NEAREST
+                                                                           : DVZ_FILTER_LINEAR;
+
+    DvzSamplerAddressMode address_mode = layer->is_periodic
+                                             ? DVZ_SAMPLER_ADDRESS_MODE_REPEAT
+                                             : DVZ_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+
+    DPipeline key = {
+        .blend = get_blend(layer->blend),
+        .mask = layer->mask,
+        .vertex_id = stim->sphere_vertex_shader_id,
+        .fragment_id = stim->sphere_fragment_shader_id,
+        .texture_id = stim->texture_ids[layer_idx],
+        .is_compact = stim->is_mesh_compact,
+    };
+
+    // In multiview rendering, every draw covers all screens.
+    if (stim->render_mode == DSTIM_RENDER_MULTIVIEW)
+    {
+        key.vertex_id = key.is_compact ? stim->sphere_multiview_compact_vertex_shader_id
+                                       : stim->sphere_multiview_vertex_shader_id;
+    }
+    else if (key.is_compact)
+    {
+        key.vertex_id = stim->sphere_compact_vertex_shader_id;
+    }
+
+    // In ray-casting rendering, the fragment shader finds the sphere point seen by each pixel.
+    if (stim->render_mode == DSTIM_RENDER_RAYCAST)
+    {
+        key.is_raycast = true;
+        key.is_compact = false;
+        key.vertex_id = stim->sphere_raycast_vertex_shader_id;
+        key.fragment_id = stim->sphere_raycast_fragment_shader_id;
+    }
+
+    // Layers in the texture array wrap and clamp their texture coordinates in the shader.
+    if (layer->is_in_array)
+    {
+        address_mode = DVZ_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        key.fragment_id = key.is_raycast ? stim->sphere_raycast_array_fragment_shader_id
+                                         : stim->sphere_array_fragment_shader_id;
+        key.texture_id = stim->array_id;
+    }
+
+    // Trilinear layers sample their mip atlas, and wrap and clamp their texture coordinates in the
+    // shader.
+    if (get_mip_levels(layer) > 0)
+    {
+        address_mode = DVZ_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        key.fragment_id = key.is_raycast ? stim->sphere_raycast_mipmap_fragment_shader_id
+                                         : stim->sphere_mipmap_fragment_shader_id;
+    }
+
+    // Banked layers sample their image's slice in the texture bank.
+    if (layer->is_banked)
+    {
+        address_mode = DVZ_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        key.fragment_id = key.is_raycast ? stim->sphere_raycast_array_fragment_shader_id
+                                         : stim->sphere_array_fragment_shader_id;
+        key.texture_id = stim->bank_id;
+    }
+
+    // Procedural layers share the same dummy texture and sampler, hence the same pipelines. The
+    // dummy texture also stands for a texture that has not been set yet.
+    if (layer->kind != DSTIM_LAYER_TEXTURE || key.texture_id == DVZ_ID_NONE)
+    {
+        filter = DVZ_FILTER_NEAREST;
+        address_mode = DVZ_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        key.texture_id = get_dummy_texture(stim);
+    }
+
+    key.sampler_id = get_sampler(stim, filter, address_mode);
+    DvzId graphics_id = get_pipeline(stim, &key);
+
+    // The recorded commands refer to the pipeline: record again if the layer's pipeline changes.
+    if (stim->sphere_graphics_ids[layer_idx] != graphics_id)
+    {
+        stim->sphere_graphics_ids[layer_idx] = graphics_id;
+        TOUCH_RECORD
+    }
+}
+
+
+
+static bool is_array_compatible(DLayer* layer)
+{
+    ANN(layer);
+    return layer->kind == DSTIM_LAYER_TEXTURE && layer->format == DVZ_FORMAT_R8G8B8A8_UNORM &&
+           layer->rgba != NULL && !layer->is_banked &&
+           layer->interpolation != DSTIM_INTERPOLATION_TRILINEAR &&
+           layer->tex_width <= DSTIM_TEXTURE_ARRAY_MAX_SIZE &&
+           layer->tex_height <= DSTIM_TEXTURE_ARRAY_MAX_SIZE;
+}
+
+
+
+static void update_array(DStim* stim)
+{
+    ANN(stim);
+
+    DvzBatch* batch = stim->batch;
+    ANN(batch);
+
+    DLayer* layer = NULL;
+    uint32_t width = 0;
+    uint32_t height = 0;
+
+    // Decide which layers live in the texture array, and the slice size needed to hold them.
+    for (uint32_t layer_idx = 0; layer_idx < stim->layer_count; layer_idx++)
+    {
+        layer = &stim->layers[layer_idx];
+        bool is_in_array = stim->render_mode != DSTIM_RENDER_MESH && is_array_compatible(layer);
+
+        // Moving in or out of the array changes the texture, the pipeline, and the parameters.
+        if (layer->is_in_array != is_in_array)
+        {
+            layer->is_in_array = is_in_array;
+            TOUCH_LAYER
+            TOUCH_LAYER_TEXTURE
+            TOUCH_LAYER_STATE
+        }
+
+        if (is_in_array)
+        {
+            width = MAX(width, layer->tex_width);
+            height = MAX(height, layer->tex_height);
+        }
+    }
+
+    // The texture array only grows.
+    if (width <= stim->array_size[0] && height <= stim->array_size[1])
+        return;
+    width = MAX(width, stim->array_size[0]);
+    height = MAX(height, stim->array_size[1]);
+
+    if (stim->array_id != DVZ_ID_NONE)
+    {
+        forget_texture(stim, stim->array_id);
+        delete_later(stim, stim->array_id, true);
+    }
+
+    log_debug("create texture array %dx%dx%d", width, height, DSTIM_MAX_LAYERS);
+    DvzRequest req = dvz_create_tex(
+        batch, 3, DVZ_FORMAT_R8G8B8A8_UNORM, (uvec3){width, height, DSTIM_MAX_LAYERS}, 0);
+    stim->array_id = req.id;
+    stim->array_size[0] = width;
+    stim->array_size[1] = height;
+
+    // All layers in the array need to be uploaded again, with new pipelines and texture scales.
+    for (uint32_t layer_idx = 0; layer_idx < stim->layer_count; layer_idx++)
+    {
+        layer = &stim->layers[layer_idx];
+        if (layer->is_in_array)
+        {
+            TOUCH_LAYER
+            TOUCH_LAYER_TEXTURE
+            TOUCH_LAYER_STATE
+        }
+    }
+}
+
+
+
+static void upload_array_texture(DStim* stim, uint32_t layer_idx)
+{
+    ANN(stim);
+    GET_LAYER
+
+    DvzBatch* batch = stim->batch;
+    ANN(batch);
+
+    ASSERT(layer->is_in_array);
+    ASSERT(stim->array_id != DVZ_ID_NONE);
+    ASSERT(layer->tex_width <= stim->array_size[0]);
+    ASSERT(layer->tex_height <= stim->array_size[1]);
+    ANN(layer->rgba);
+
+    // Upload the layer texture in the lower-left part of the layer's slice.
+    dvz_upload_tex(
+        batch, stim->array_id, (uvec3){0, 0, layer_idx},
+        (uvec3){layer->tex_width, layer->tex_height, 1}, layer->tex_nbytes, layer->rgba,
+        DVZ_UPLOAD_FLAGS_NOCOPY);
+    mark_uploaded(stim, layer);
+}
+
+
+
+static void push_sphere_pipeline(DStim* stim, uint32_t layer_idx, DStimPush* push)
+{
+    ANN(stim);
+    GET_LAYER
+
+    DvzBatch* batch = stim->batch;
+    ANN(batch);
+
+    // Send the push constant to the command buffer.
+    dvz_record_push(
+        batch, stim->canvas_id, stim->sphere_graphics_ids[layer_idx],
+        DVZ_SHADER_VERTEX | DVZ_SHADER_FRAGMENT, 0, sizeof(DStimPush), push);
+}
+
+
+
+static bool is_chunk_visible(DChunk* chunk, vec4 planes[6])
+{
+    ANN(chunk);
+
+    // Unbounded and empty chunks are always visible (empty ones merge the ranges around them).
+    if (chunk->radius < 0 || chunk->index_count == 0)
+        return true;
+
+    // NOTE: a degenerate frustum (e.g. projection not set yet) gives NaN distances, the chunk
+    // then remains visible.
+    for (uint32_t i = 0; i < 6; i++)
+    {
+        if (glm_vec3_dot(planes[i], chunk->center) + planes[i][3] < -chunk->radius)
+            return false;
+    }
+    return true;
+}
+
+
+
+static void get_footprint_chunks(DStim* stim, uint32_t layer_idx, uint64_t* footprint)
+{
+    ANN(stim);
+    ANN(footprint);
+    GET_LAYER
+
+    // NOTE: the footprint of a layer moved by curves changes on the GPU, the layer is not clipped.
+    uint32_t moving = (1u << DSTIM_TRACK_OFFSET_X) | (1u << DSTIM_TRACK_OFFSET_Y) |
+                      (1u << DSTIM_TRACK_ANGLE) | (1u << DSTIM_TRACK_SIZE_X) |
+                      (1u << DSTIM_TRACK_SIZE_Y);
+
+    memset(footprint, 0xff, DSTIM_CHUNK_WORDS * sizeof(uint64_t));
+    if (!layer->is_clipped || layer->is_periodic || layer->kind != DSTIM_LAYER_TEXTURE ||
+        (layer->curve_mask & moving) != 0)
+        return;
+
+    // Inverse of the vertex shader's UV transform, from the texture square (padded by half a
+    // texel for linear filtering) to the mesh's vertexUV space.
+    float sx = layer->tex_size[0] != 0 ? layer->tex_size[0] : 1e-10;
+    float sy = layer->tex_size[1] != 0 ? layer->tex_size[1] : 1e-10;
+    uint32_t width = layer->is_banked ? stim->bank_size[0] : layer->tex_width;
+    uint32_t height = layer->is_banked ? stim->bank_size[1] : layer->tex_height;
+    float px = width > 0 ? .5 / width : 0;
+    float py = height > 0 ? .5 / height : 0;
+    float c = cos(layer->tex_angle * M_PI / 180);
+    float s = sin(layer->tex_angle * M_PI / 180);
+
+    vec2 uv_min = {+INFINITY, +INFINITY};
+    vec2 uv_max = {-INFINITY, -INFINITY};
+    float x = 0, y = 0, u = 0, v = 0;
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        x = (i & 1) ? 1 + px : -px;
+        y = (i & 2) ? 1 + py : -py;
+
+        x = (x - .5 + layer->tex_offset[0] / sx) * sx / 180;
+        y = (y - .5 + layer->tex_offset[1] / sy) * sy / 180;
+        u = (c * x + s * y) / 2 + .5;
+        v = (-s * x + c * y) + .5;
+
+        uv_min[0] = MIN(uv_min[0], u);
+        uv_min[1] = MIN(uv_min[1], v);
+        uv_max[0] = MAX(uv_max[0], u);
+        uv_max[1] = MAX(uv_max[1], v);
+    }
+
+    // NOTE: the texture coordinates only depend on the mesh's vertexUV, not on the view matrix,
+    // which is taken into account by the frustum culling.
+    DChunk* chunk = NULL;
+    for (uint32_t i = 0; i < stim->chunk_count; i++)
+    {
+        chunk = &stim->chunks[i];
+        if (chunk->radius < 0 || chunk->index_count == 0)
+            continue;
+        if (chunk->uv_max[0] < uv_min[0] || chunk->uv_min[0] > uv_max[0] ||
+            chunk->uv_max[1] < uv_min[1] || chunk->uv_min[1] > uv_max[1])
+            footprint[i / 64] &= ~(1ull << (i % 64));
+    }
+}
+
+
+
+static void update_culling(DStim* stim)
+{
+    ANN(stim);
+
+    DScreen* screen = NULL;
+    DLayer* layer = NULL;
+    mat4 pv = {0};
+    mat4 mvp = {0};
+    vec4 planes[6] = {0};
+    uint64_t visible[DSTIM_CHUNK_WORDS] = {0};
+    uint64_t footprints[DSTIM_MAX_LAYERS][DSTIM_CHUNK_WORDS] = {0};
+
+    // Chunks covered by the texture of each layer.
+    for (uint32_t layer_idx = 0; layer_idx < stim->layer_count; layer_idx++)
+        get_footprint_chunks(stim, layer_idx, footprints[layer_idx]);
+
+    for (uint32_t screen_idx = 0; screen_idx < stim->screen_count; screen_idx++)
+    {
+        screen = &stim->screens[screen_idx];
+        for (uint32_t layer_idx = 0; layer_idx < stim->layer_count; layer_idx++)
+        {
+            layer = &stim->layers[layer_idx];
+
+            // Frustum planes in the sphere's object space, same transform as the vertex shader.
+            glm_mat4_mul(screen->projection, layer->view, pv);
+            glm_mat4_mul(pv, stim->model, mvp);
+            glm_frustum_planes(mvp, planes);
+
+            memset(visible, 0, sizeof(visible));
+            for (uint32_t c = 0; c < stim->chunk_count; c++)
+            {
+                if (is_chunk_visible(&stim->chunks[c], planes))
+                    visible[c / 64] |= 1ull << (c % 64);
+            }
+            for (uint32_t w = 0; w < DSTIM_CHUNK_WORDS; w++)
+                visible[w] &= footprints[layer_idx][w];
+
+            // The command buffer only needs to be recorded again if the visible chunks change.
+            if (memcmp(visible, screen->visible_chunks[layer_idx], sizeof(visible)) != 0)
+            {
+                memcpy(screen->visible_chunks[layer_idx], visible, sizeof(visible));
+                TOUCH_RECORD
+            }
+        }
+    }
+}
+
+
+
+static void get_visible_chunks(
+    DStim* stim, uint32_t layer_idx, uint32_t layer_count, uint32_t screen_idx,
+    uint32_t screen_count, uint64_t* visible)
+{
+    ANN(stim);
+    ANN(visible);
+    ASSERT(layer_idx + layer_count <= DSTIM_MAX_LAYERS);
+    ASSERT(screen_idx + screen_count <= DSTIM_MAX_SCREENS);
+
+    // Union of the chunks visible by the layers and screens drawn by a single draw call.
+    memset(visible, 0, DSTIM_CHUNK_WORDS * sizeof(uint64_t));
+    for (uint32_t i = screen_idx; i < screen_idx + screen_count; i++)
+        for (uint32_t j = layer_idx; j < layer_idx + layer_count; j++)
+            for (uint32_t w = 0; w < DSTIM_CHUNK_WORDS; w++)
+                visible[w] |= stim->screens[i].visible_chunks[j][w];
+}
+
+
+
+static void draw_sphere_pipeline(
+    DStim* stim, uint32_t layer_idx, uint32_t instance_count, uint64_t* visible)
+{
+    ANN(stim);
+    ANN(visible);
+    GET_LAYER
+
+    DvzBatch* batch = stim->batch;
+    ANN(batch);
+
+    // Ray-casting: the screen rectangle, one instance per layer starting at layer_idx.
+    if (stim->render_mode == DSTIM_RENDER_RAYCAST)
+    {
+        dvz_record_draw(
+            batch, stim->canvas_id, stim->sphere_graphics_ids[layer_idx], 0, SQUARE_VERTEX_COUNT,
+            0, instance_count);
+        return;
+    }
+
+    // Sphere, one instance per layer starting at layer_idx. Consecutive visible chunks are
+    // contiguous in the index buffer and are drawn with a single index range.
+    uint32_t first_index = 0;
+    uint32_t index_count = 0;
+    DChunk* chunk = NULL;
+    for (uint32_t c = 0; c <= stim->chunk_count; c++)
+    {
+        if (c < stim->chunk_count && (visible[c / 64] >> (c % 64)) & 1)
+        {
+            chunk = &stim->chunks[c];
+            if (index_count == 0)
+                first_index = chunk->first_index;
+            index_count += chunk->index_count;
+            continue;
+        }
+        if (index_count == 0)
+            continue;
+
+        dvz_record_draw_indexed(
+            batch, stim->canvas_id, stim->sphere_graphics_ids[layer_idx], first_index, 0,
+            index_count, 0, instance_count);
+        stim->record_index_count += index_count * instance_count;
+        index_count = 0;
+    }
+}
+
+
+
+static void fill_push(
+    DStim* stim, uint32_t layer_idx, uint32_t layer_count, uint32_t screen_idx, DStimPush* push)
+{
+    ANN(stim);
+    ANN(push);
+    ASSERT(layer_idx + layer_count <= DSTIM_MAX_LAYERS);
+    ASSERT(screen_idx < DSTIM_MAX_SCREENS);
+    ASSERT(layer_count > 0);
+
+    // Global model matrix.
+    glm_mat4_copy(stim->model, push->model);
+
+    // Indices of the layers' and screen's parameters in the params buffers.
+    push->layer_idx = layer_idx;
+    push->layer_count = layer_count;
+    push->screen_idx = screen_idx;
+}
+
+
+
+static void fill_params(DStim* stim, uint32_t layer_idx, DStimParams* params)
+{
+    ANN(stim);
+    ANN(params);
+    GET_LAYER
+
+    // Per-layer view matrix.
+    glm_mat4_copy(layer->view, params->view);
+
+    // Layer parameters.
+    params->min_color[0] = layer->min_color[0] / 255.0;
+    params->min_color[1] = layer->min_color[1] / 255.0;
+    params->min_color[2] = layer->min_color[2] / 255.0;
+    params->min_color[3] = layer->min_color[3] / 255.0;
+
+    params->max_color[0] = layer->max_color[0] / 255.0;
+    params->max_color[1] = layer->max_color[1] / 255.0;
+    params->max_color[2] = layer->max_color[2] / 255.0;
+    params->max_color[3] = layer->max_color[3] / 255.0;
+
+    params->tex_offset[0] = layer->tex_offset[0];
+    params->tex_offset[1] = layer->tex_offset[1];
+
+    params->tex_size[0] = layer->tex_size[0];
+    params->tex_size[1] = layer->tex_size[1];
+
+    params->tex_angle = layer->tex_angle;
+
+    // Part of the texture array slice covered by the layer texture.
+    params->tex_scale[0] = 1;
+    params->tex_scale[1] = 1;
+    if (layer->is_in_array)
+    {
+        ASSERT(stim->array_size[0] > 0);
+        ASSERT(stim->array_size[1] > 0);
+        params->tex_scale[0] = layer->tex_width / (float)stim->array_size[0];
+        params->tex_scale[1] = layer->tex_height / (float)stim->array_size[1];
+    }
+    params->tex_slice = (layer_idx + .5) / DSTIM_MAX_LAYERS;
+    if (layer->is_banked)
+    {
+        ASSERT(stim->bank_count > 0);
+        params->tex_slice = (layer->bank_image + .5) / stim->bank_count;
+    }
+
+    params->flags = layer->is_periodic ? DSTIM_LAYER_FLAG_PERIODIC : 0;
+
+    // Single-channel textures: the shader replicates the channel before the color mapping.
+    if (is_single_channel(layer->is_banked ? stim->bank_format : layer->format))
+        params->flags |= DSTIM_LAYER_FLAG_SINGLE_CHANNEL;
+
+    // Layers animated by curves: the shaders look the curves up, the others skip them.
+    if (layer->curve_mask != 0)
+        params->flags |= DSTIM_LAYER_FLAG_ANIMATED;
+
+    // Procedural patterns.
+    params->kind = layer->kind;
+    params->spatial_frequency = layer->spatial_frequency;
+    params->phase = layer->phase;
+    params->contrast = layer->contrast;
+    params->sigma = layer->sigma;
+    params->inner_radius = layer->inner_radius;
+    params->outer_radius = layer->outer_radius;
+    params->plaid_angle = layer->plaid_angle;
+
+    // Mip atlas.
+    params->mip_levels = get_mip_levels(layer);
+    params->mip_size[0] = layer->tex_width;
+    params->mip_size[1] = layer->tex_height;
+}
+
+
+
+static void upload_params(DStim* stim, uint32_t layer_idx)
+{
+    ANN(stim);
+    ASSERT(layer_idx < DSTIM_MAX_LAYERS);
+
+    DvzBatch* batch = stim->batch;
+    ANN(batch);
+
+    ASSERT(stim->layer_params_id != DVZ_ID_NONE);
+
+    DLayer* layer = &stim->layers[layer_idx];
+
+    DStimParams params = {0};
+    fill_params(stim, layer_idx, &params);
+
+    // Diff with the parameters already on the GPU: skip the upload if nothing changed.
+    if (layer->has_gpu_params && memcmp(&params, &layer->gpu_params, sizeof(DStimParams)) == 0)
+    {
+        stim->stats.skipped_count++;
+        return;
+    }
+    layer->gpu_params = params;
+    layer->has_gpu_params = true;
+
+    // Only update the layer's slot in the layer params buffer.
+    dvz_upload_dat(
+        batch, stim->layer_params_id, layer_idx * sizeof(DStimParams), sizeof(DStimParams),
+        &params, 0);
+}
+
+
+
+static void fill_screen_params(DStim* stim, uint32_t screen_idx, DStimScreenParams* params)
+{
+    ANN(stim);
+    ANN(params);
+    ASSERT(screen_idx < DSTIM_MAX_SCREENS);
+
+    DScreen* screen = &stim->screens[screen_idx];
+
+    // Per-screen projection matrix.
+    glm_mat4_copy(screen->projection, params->projection);
+
+    // From the screen's NDC to its part of the window's NDC (y goes down in Vulkan).
+    float w = stim->width;
+    float h = stim->height;
+    params->ndc_transform[0] = screen->size[0] / w;
+    params->ndc_transform[1] = screen->size[1] / h;
+    params->ndc_transform[2] = (2 * screen->offset[0] + screen->size[0]) / w - 1;
+    params->ndc_transform[3] = (2 * screen->offset[1] + screen->size[1]) / h - 1;
+}
+
+
+
+static void upload_screen_params(DStim* stim, uint32_t screen_idx)
+{
+    ANN(stim);
+    ASSERT(screen_idx < DSTIM_MAX_SCREENS);
+
+    DvzBatch* batch = stim->batch;
+    ANN(batch);
+
+    ASSERT(stim->screen_params_id != DVZ_ID_NONE);
+
+    DScreen* screen = &stim->screens[screen_idx];
+
+    DStimScreenParams params = {0};
+    fill_screen_params(stim, screen_idx, &params);
+
+    // Diff with the parameters already on the GPU: skip the upload if nothing changed.
+    if (screen->has_gpu_params &&
+        memcmp(&params, &screen->gpu_params, sizeof(DStimScreenParams)) == 0)
+    {
+        stim->stats.skipped_count++;
+        return;
+    }
+    screen->gpu_params = params;
+    screen->has_gpu_params = true;
+
+    dvz_upload_dat(
+        batch, stim->screen_params_id, screen_idx * sizeof(DStimScreenParams),
+        sizeof(DStimScreenParams), &params, 0);
+}
+
+
+
+/*************************************************************************************************/
+/*  Ingestion                                                                                    */
+/*************************************************************************************************/
+
+// Quantize count contiguous values in [0, 1] to unorm8 (rounded, clamped, NaN to 0).
+static void quantize_f32(const float* src, uint32_t count, uint8_t* dst)
+{
+    uint32_t i = 0;
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    const float32x4_t one = vdupq_n_f32(1.0f);
+    const float32x4_t scale = vdupq_n_f32(255.0f);
+    const float32x4_t half = vdupq_n_f32(0.5f);
+    for (; i + 8 <= count; i += 8)
+    {
+        float32x4_t a = vminq_f32(vmaxq_f32(vld1q_f32(&src[i]), zero), one);
+        float32x4_t b = vminq_f32(vmaxq_f32(vld1q_f32(&src[i + 4]), zero), one);
+        uint32x4_t qa = vcvtq_u32_f32(vfmaq_f32(half, a, scale));
+        uint32x4_t qb = vcvtq_u32_f32(vfmaq_f32(half, b, scale));
+        vst1_u8(&dst[i], vmovn_u16(vcombine_u16(vmovn_u32(qa), vmovn_u32(qb))));
+    }
+#endif
+    for (; i < count; i++)
+    {
+        float x = src[i];
+        float v = x == x ? (x < 0 ? 0 : (x > 1 ? 1 : x)) : 0;
+        dst[i] = (uint8_t)(v * 255.0f + 0.5f);
+    }
+}
+
+
+
+static void quantize_f64(const double* src, uint32_t count, uint8_t* dst)
+{
+    uint32_t i = 0;
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    const float32x4_t one = vdupq_n_f32(1.0f);
+    const float32x4_t scale = vdupq_n_f32(255.0f);
+    const float32x4_t half = vdupq_n_f32(0.5f);
+    for (; i + 8 <= count; i += 8)
+    {
+        float32x4_t a = vcombine_f32(
+            vcvt_f32_f64(vld1q_f64(&src[i])), vcvt_f32_f64(vld1q_f64(&src[i + 2])));
+        float32x4_t b = vcombine_f32(
+            vcvt_f32_f64(vld1q_f64(&src[i + 4])), vcvt_f32_f64(vld1q_f64(&src[i + 6])));
+        a = vminq_f32(vmaxq_f32(a, zero), one);
+        b = vminq_f32(vmaxq_f32(b, zero), one);
+        uint32x4_t qa = vcvtq_u32_f32(vfmaq_f32(half, a, scale));
+        uint32x4_t qb = vcvtq_u32_f32(vfmaq_f32(half, b, scale));
+        vst1_u8(&dst[i], vmovn_u16(vcombine_u16(vmovn_u32(qa), vmovn_u32(qb))));
+    }
+#endif
+    for (; i < count; i++)
+    {
+        double x = src[i];
+        double v = x == x ? (x < 0 ? 0 : (x > 1 ? 1 : x)) : 0;
+        dst[i] = (uint8_t)(v * 255.0 + 0.5);
+    }
+}
+
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// NOTE: the AVX2 kernels are compiled for AVX2 whatever the compiler flags, and only called when
+// the CPU supports it, so that the binary runs on any x86 CPU. max(x, 0) returns its second
+// operand when x is NaN, which maps NaN to 0 as in the scalar kernels.
+__attribute__((target("avx2"))) static void
+quantize_f32_avx2(const float* src, uint32_t count, uint8_t* dst)
+{
+    uint32_t i = 0;
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 scale = _mm256_set1_ps(255.0f);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 v = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(&src[i]), zero), one);
+        __m256i q = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(v, scale), half));
+        __m128i q16 =
+            _mm_packus_epi32(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1));
+        _mm_storel_epi64((__m128i*)&dst[i], _mm_packus_epi16(q16, q16));
+    }
+    quantize_f32(&src[i], count - i, &dst[i]);
+}
+
+
+
+__attribute__((target("avx2"))) static void
+quantize_f64_avx2(const double* src, uint32_t count, uint8_t* dst)
+{
+    uint32_t i = 0;
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 scale = _mm256_set1_ps(255.0f);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 v = _mm256_set_m128(
+            _mm256_cvtpd_ps(_mm256_loadu_pd(&src[i + 4])),
+            _mm256_cvtpd_ps(_mm256_loadu_pd(&src[i])));
+        v = _mm256_min_ps(_mm256_max_ps(v, zero), one);
+        __m256i q = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(v, scale), half));
+        __m128i q16 =
+            _mm_packus_epi32(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1));
+        _mm_storel_epi64((__m128i*)&dst[i], _mm_packus_epi16(q16, q16));
+    }
+    quantize_f64(&src[i], count - i, &dst[i]);
+}
+
+#endif
+
+
+
+// Write the texels i0 <= i < i1, j0 <= j < j1 of a quantized tile to the texture rows.
+static void store_texels(
+    uint8_t tile[][DSTIM_INGEST_TILE_WIDTH][DSTIM_INGEST_TILE_HEIGHT], uint32_t i0, uint32_t i1,
+    uint32_t j0, uint32_t j1, uint32_t texel_size, uint8_t* dst, DvzSize stride)
+{
+    for (uint32_t j = j0; j < j1; j++)
+    {
+        uint8_t* row = &dst[j * stride];
+        if (texel_size == 1)
+        {
+            for (uint32_t i = i0; i < i1; i++)
+                row[i] = tile[0][i][j];
+        }
+        else
+        {
+            for (uint32_t i = i0; i < i1; i++)
+            {
+                row[4 * i + 0] = tile[0][i][j];
+                row[4 * i + 1] = tile[1][i][j];
+                row[4 * i + 2] = tile[2][i][j];
+                row[4 * i + 3] = tile[3][i][j];
+            }
+        }
+    }
+}
+
+
+
+// Write a quantized m x n tile (column-major per channel) to the texture rows, starting at dst,
+// interleaving the channels of RGBA textures. Blocks of 16x16 texels are transposed in registers
+// with four rounds of byte interleaving (the 16 rows r[k] and r[k + 8] interleaved into r[2k]
+// and r[2k + 1]), then interleaved across channels.
+static void store_tile(
+    uint8_t tile[][DSTIM_INGEST_TILE_WIDTH][DSTIM_INGEST_TILE_HEIGHT], uint32_t m, uint32_t n,
+    uint32_t texel_size, uint8_t* dst, DvzSize stride)
+{
+    uint32_t plane_count = texel_size == 1 ? 1 : 4;
+    uint32_t m16 = 0, n16 = 0;
+#if defined(__SSE2__)
+    m16 = m & ~15u;
+    n16 = n & ~15u;
+    for (uint32_t j0 = 0; j0 < n16; j0 += 16)
+    {
+        for (uint32_t i0 = 0; i0 < m16; i0 += 16)
+        {
+            __m128i r[4][16], t[16];
+            for (uint32_t c = 0; c < plane_count; c++)
+            {
+                for (uint32_t k = 0; k < 16; k++)
+                    r[c][k] = _mm_loadu_si128((const __m128i*)&tile[c][i0 + k][j0]);
+                for (uint32_t round = 0; round < 4; round++)
+                {
+                    for (uint32_t k = 0; k < 8; k++)
+                    {
+                        t[2 * k] = _mm_unpacklo_epi8(r[c][k], r[c][k + 8]);
+                        t[2 * k + 1] = _mm_unpackhi_epi8(r[c][k], r[c][k + 8]);
+                    }
+                    memcpy(r[c], t, sizeof(t));
+                }
+            }
+
+            for (uint32_t k = 0; k < 16; k++)
+            {
+                __m128i* row = (__m128i*)&dst[(j0 + k) * stride + i0 * texel_size];
+                if (texel_size == 1)
+                {
+                    _mm_storeu_si128(row, r[0][k]);
+                    continue;
+                }
+                __m128i rg_lo = _mm_unpacklo_epi8(r[0][k], r[1][k]);
+                __m128i rg_hi = _mm_unpackhi_epi8(r[0][k], r[1][k]);
+                __m128i ba_lo = _mm_unpacklo_epi8(r[2][k], r[3][k]);
+                __m128i ba_hi = _mm_unpackhi_epi8(r[2][k], r[3][k]);
+                _mm_storeu_si128(&row[0], _mm_unpacklo_epi16(rg_lo, ba_lo));
+                _mm_storeu_si128(&row[1], _mm_unpackhi_epi16(rg_lo, ba_lo));
+                _mm_storeu_si128(&row[2], _mm_unpacklo_epi16(rg_hi, ba_hi));
+                _mm_storeu_si128(&row[3], _mm_unpackhi_epi16(rg_hi, ba_hi));
+            }
+        }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    m16 = m & ~15u;
+    n16 = n & ~15u;
+    for (uint32_t j0 = 0; j0 < n16; j0 += 16)
+    {
+        for (uint32_t i0 = 0; i0 < m16; i0 += 16)
+        {
+            uint8x16x4_t r[16];
+            uint8x16_t t[16];
+            for (uint32_t c = 0; c < plane_count; c++)
+            {
+                uint8x16_t v[16];
+                for (uint32_t k = 0; k < 16; k++)
+                    v[k] = vld1q_u8(&tile[c][i0 + k][j0]);
+                for (uint32_t round = 0; round < 4; round++)
+                {
+                    for (uint32_t k = 0; k < 8; k++)
+                    {
+                        t[2 * k] = vzip1q_u8(v[k], v[k + 8]);
+                        t[2 * k + 1] = vzip2q_u8(v[k], v[k + 8]);
+                    }
+                    memcpy(v, t, sizeof(t));
+                }
+                for (uint32_t k = 0; k < 16; k++)
+                    r[k].val[c] = v[k];
+            }
+
+            for (uint32_t k = 0; k < 16; k++)
+            {
+                uint8_t* row = &dst[(j0 + k) * stride + i0 * texel_size];
+                if (texel_size == 1)
+                    vst1q_u8(row, r[k].val[0]);
+                else
+                    vst4q_u8(row, r[k]);
+            }
+        }
+    }
+#endif
+
+    // Remaining columns, then remaining rows of the transposed columns (scalar).
+    store_texels(tile, m16, m, 0, n, texel_size, dst, stride);
+    store_texels(tile, 0, m16, n16, n, texel_size, dst, stride);
+}
+
+
+
+static void ingest_matlab(
+    const void* data, DStimMatlabClass matlab_class, uint32_t width, uint32_t height,
+    uint32_t channel_count, uint8_t tile[][DSTIM_INGEST_TILE_WIDTH][DSTIM_INGEST_TILE_HEIGHT],
+    uint8_t* texture)
+{
+    ANN(data);
+    ANN(tile);
+    ANN(texture);
+
+    // Single-channel arrays go to R8 textures, RGB and RGBA arrays to RGBA8 textures.
+    uint32_t texel_size = channel_count == 1 ? 1 : 4;
+    DvzSize plane = (DvzSize)width * height;
+
+    // Quantization kernels, AVX2 if the CPU supports it.
+    void (*quantize_double)(const double*, uint32_t, uint8_t*) = quantize_f64;
+    void (*quantize_single)(const float*, uint32_t, uint8_t*) = quantize_f32;
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        quantize_double = quantize_f64_avx2;
+        quantize_single = quantize_f32_avx2;
+    }
+#endif
+
+    // Opaque alpha channel for RGB arrays.
+    memset(tile[3], 255, sizeof(tile[3]));
+
+    // NOTE: the element (y, x, c) of a MATLAB array is at y + x * height + c * width * height.
+    // Each tile is quantized along its contiguous columns, then transposed to the texture rows.
+    // The tiles go down the columns, in the L2 cache.
+    for (uint32_t x0 = 0; x0 < width; x0 += DSTIM_INGEST_TILE_WIDTH)
+    {
+        uint32_t m = MIN(DSTIM_INGEST_TILE_WIDTH, width - x0);
+        for (uint32_t y0 = 0; y0 < height; y0 += DSTIM_INGEST_TILE_HEIGHT)
+        {
+            uint32_t n = MIN(DSTIM_INGEST_TILE_HEIGHT, height - y0);
+            for (uint32_t c = 0; c < channel_count; c++)
+            {
+                for (uint32_t i = 0; i < m; i++)
+                {
+                    DvzSize offset = c * plane + (DvzSize)(x0 + i) * height + y0;
+                    if (matlab_class == DSTIM_MATLAB_DOUBLE)
+                        quantize_double(&((const double*)data)[offset], n, tile[c][i]);
+                    else
+                        quantize_single(&((const float*)data)[offset], n, tile[c][i]);
+                }
+            }
+
+            store_tile(
+                tile, m, n, texel_size, &texture[((DvzSize)y0 * width + x0) * texel_size],
+                (DvzSize)width * texel_size);
+        }
+    }
+}
+
+
+
+/*************************************************************************************************/
+/*  Movie                                                                                        */
+/*************************************************************************************************/
+
+// Parse the dict of a NPY header, e.g.
+// {'descr': '|u1', 'fortran_order': False, 'shape': (100, 512, 512, 4), }
+static bool parse_npy_header(
+    const char* header, char* descr, bool* fortran_order, uint64_t* shape, uint32_t* ndim)
+{
+    ANN(header);
+    ANN(descr);
+    ANN(fortran_order);
+    ANN(shape);
+    ANN(ndim);
+
+    const char* s = strstr(header, "'descr'");
+    if (s == NULL || sscanf(s, "'descr' : '%15[^']'", descr) != 1)
+        return false;
+
+    s = strstr(header, "'fortran_order'");
+    s = s != NULL ? strchr(s, ':') : NULL;
+    if (s == NULL)
+        return false;
+    s += strspn(s + 1, " ") + 1;
+    if (strncmp(s, "True", 4) != 0 && strncmp(s, "False", 5) != 0)
+        return false;
+    *fortran_order = s[0] == 'T';
+
+    s = strstr(header, "'shape'");
+    s = s != NULL ? strchr(s, '(') : NULL;
+    if (s == NULL)
+        return false;
+    s++;
+    *ndim = 0;
+    while (true)
+    {
+        s += strspn(s, " ,");
+        if (*s == ')')
+            return true;
+        char* end = NULL;
+        uint64_t dim = strtoull(s, &end, 10);
+        if (end == s || *ndim >= DSTIM_NPY_MAX_DIMS)
+            return false;
+        shape[(*ndim)++] = dim;
+        s = end;
+    }
+}
+
+
+
+// Check the header of a NPY file against the movie's format and frame size, and get the offset
+// of the data and the number of frames. Raw files have no header: offset and frame count 0.
+static bool read_npy_header(
+    FILE* file, const char* path, DvzFormat format, uint32_t width, uint32_t height,
+    DvzSize frame_nbytes, long* offset, uint64_t* frame_count)
+{
+    ANN(file);
+    ANN(path);
+    ANN(offset);
+    ANN(frame_count);
+
+    *offset = 0;
+    *frame_count = 0;
+
+    // Magic string, version, header length (4 bytes from NPY 2.0, 2 bytes before), header.
+    uint8_t preamble[12] = {0};
+    rewind(file);
+    if (fread(preamble, 1, 10, file) != 10 || memcmp(preamble, "\x93NUMPY", 6) != 0)
+        return true;
+    long preamble_len = 10;
+    long header_len = preamble[8] | (preamble[9] << 8);
+    if (preamble[6] >= 2)
+    {
+        preamble_len = 12;
+        if (fread(&preamble[10], 1, 2, file) != 2)
+            header_len = 0;
+        header_len |= ((long)preamble[10] << 16) | ((long)preamble[11] << 24);
+    }
+    if (header_len <= 0 || header_len > DSTIM_NPY_MAX_HEADER)
+    {
+        log_error("movie %s: invalid NPY header length %ld", path, header_len);
+        return false;
+    }
+    char* header = (char*)calloc((size_t)header_len + 1, 1);
+    ANN(header);
+    char descr[16] = {0};
+    bool fortran_order = false;
+    uint64_t shape[DSTIM_NPY_MAX_DIMS] = {0};
+    uint32_t ndim = 0;
+    bool is_valid = fread(header, 1, (size_t)header_len, file) == (size_t)header_len &&
+                    parse_npy_header(header, descr, &fortran_order, shape, &ndim);
+    FREE(header);
+    if (!is_valid)
+    {
+        log_error("movie %s: invalid NPY header", path);
+        return false;
+    }
+    *offset = preamble_len + header_len;
+
+    // Frames of height x width texels, with the format's channels.
+    if (fortran_order)
+    {
+        log_error("movie %s: the NPY array must be in C order, not Fortran order", path);
+        return false;
+    }
+    if (ndim != 3 && ndim != 4)
+    {
+        log_error("movie %s: the NPY array must be (frames, height, width[, channels])", path);
+        return false;
+    }
+    if (shape[1] != height || shape[2] != width)
+    {
+        log_error(
+            "movie %s: the NPY frames are %dx%d, not %dx%d", path, (int)shape[2], (int)shape[1],
+            width, height);
+        return false;
+    }
+
+    // NOTE: multi-byte types must be little-endian, as the textures.
+    uint64_t channel_count = ndim == 4 ? shape[3] : 1;
+    uint64_t item_size = strtoull(&descr[2], NULL, 10);
+    if (descr[0] == '>' && item_size > 1)
+    {
+        log_error("movie %s: the NPY dtype %s must be little-endian", path, descr);
+        return false;
+    }
+    const char* expected = NULL;
+    uint64_t expected_channels = 1;
+    switch (format)
+    {
+    case DVZ_FORMAT_R8G8B8A8_UNORM:
+        expected = "u1";
+        expected_channels = 4;
+        break;
+    case DVZ_FORMAT_R8_UNORM:
+        expected = "u1";
+        break;
+    case DVZ_FORMAT_R16_UNORM:
+        expected = "u2";
+        break;
+    case DVZ_FORMAT_R16_SFLOAT:
+        expected = "f2";
+        break;
+    default:
+        break;
+    }
+    bool is_expected = expected == NULL ||
+                       (strcmp(&descr[1], expected) == 0 && channel_count == expected_channels);
+    if (!is_expected)
+    {
+        log_error(
+            "movie %s: the NPY dtype %s with %d channels does not match the format, which needs "
+            "%s with %d channels",
+            path, descr, (int)channel_count, expected, (int)expected_channels);
+        return false;
+    }
+    if (shape[1] * shape[2] * channel_count * item_size != frame_nbytes)
+    {
+        log_error(
+            "movie %s: the NPY frames have %d bytes, not %d", path,
+            (int)(shape[1] * shape[2] * channel_count * item_size), (int)frame_nbytes);
+        return false;
+    }
+
+    *frame_count = shape[0];
+    return true;
+}
+
+
+
+static void* movie_reader(void* user_data)
+{
+    DMovie* movie = (DMovie*)user_data;
+    ANN(movie);
+
+    struct timespec wait = {0, 1000000}; // 1 ms
+
+    // Read the frames ahead, in order, in the free slots of the ring.
+    uint64_t frame = 0;
+    while (frame < movie->frame_count && atomic_load(&movie->is_running))
+    {
+        uint32_t slot = frame % DSTIM_MOVIE_RING_SIZE;
+        if (atomic_load(&movie->slot_frames[slot]) != -1)
+        {
+            nanosleep(&wait, NULL); // the ring is full
+            continue;
+        }
+        if (fread(movie->frames[slot], 1, movie->frame_nbytes, movie->file) !=
+            movie->frame_nbytes)
+        {
+            log_error("could not read movie frame %d, the movie stops", (int)frame);
+            atomic_store(&movie->is_failed, true);
+            break;
+        }
+        atomic_store(&movie->slot_frames[slot], (int64_t)frame);
+        frame++;
+    }
+    return NULL;
+}
+
+
+
+static void destroy_movie(DMovie* movie)
+{
+    ANN(movie);
+    ASSERT(movie->ref_count == 0);
+
+    for (uint32_t i = 0; i < DSTIM_MOVIE_RING_SIZE; i++)
+    {
+        FREE(movie->frames[i]);
+    }
+    FREE(movie);
+}
+
+
+
+static void release_movie_frame(uint8_t* rgba, void* user_data)
+{
+    DMovie* movie = (DMovie*)user_data;
+    ANN(movie);
+
+    // Give the frame's slot back to the reader thread.
+    for (uint32_t i = 0; i < DSTIM_MOVIE_RING_SIZE; i++)
+    {
+        if (movie->frames[i] == rgba)
+            atomic_store(&movie->slot_frames[i], -1);
+    }
+
+    // The movie may have been stopped while the frame was shown.
+    ASSERT(movie->ref_count > 0);
+    if (--movie->ref_count == 0)
+        destroy_movie(movie);
+}
+
+
+
+static void stop_movie(DStim* stim, DLayer* layer)
+{
+    ANN(stim);
+    ANN(layer);
+
+    DMovie* movie = layer->movie;
+    if (movie == NULL)
+        return;
+
+    atomic_store(&movie->is_running, false);
+    pthread_join(movie->thread, NULL);
+    fclose(movie->file);
+    layer->movie = NULL;
+
+    // NOTE: the movie is destroyed once the frame shown by the layer is released.
+    ASSERT(movie->ref_count > 0);
+    if (--movie->ref_count == 0)
+        destroy_movie(movie);
+}
+
+
+
+static void update_movie(DStim* stim, uint32_t layer_idx, double present_time)
+{
+    ANN(stim);
+    GET_LAYER
+
+    DMovie* movie = layer->movie;
+    ANN(movie);
+
+    // The first frame is presented with the first update after the movie was set.
+    if (movie->start_time < 0)
+        movie->start_time = present_time;
+
+    // Frame matching the predicted present time.
+    int64_t target = (int64_t)floor((present_time - movie->start_time) * movie->fps);
+    target = MIN(target, (int64_t)movie->frame_count - 1);
+
+    // Find the latest frame read up to the target, dropping the older ones. The reader thread is
+    // never waited for: if the target frame is not read yet, the latest read frame is shown.
+    int64_t frame = -1;
+    while ((int64_t)movie->next_frame <= target)
+    {
+        uint32_t slot = movie->next_frame % DSTIM_MOVIE_RING_SIZE;
+        if (atomic_load(&movie->slot_frames[slot]) != (int64_t)movie->next_frame)
+        {
+            // NOTE: a failed movie holds its last frame, it has no more frames to wait for.
+            if (!atomic_load(&movie->is_failed))
+                stim->stats.underrun_count++;
+            break;
+        }
+        if (frame >= 0)
+            atomic_store(&movie->slot_frames[frame % DSTIM_MOVIE_RING_SIZE], -1);
+        frame = (int64_t)movie->next_frame++;
+    }
+    if (frame < 0)
+        return;
+
+    // Show the frame without copy, its slot is reused once it is released.
+    movie->ref_count++;
+    borrow_texture(
+        stim, layer_idx, movie->format, movie->width, movie->height, movie->frame_nbytes,
+        movie->frames[frame % DSTIM_MOVIE_RING_SIZE], release_movie_frame, movie);
+}
+
+
+
+/*************************************************************************************************/
+/*  DStim functions                                                                              */
+/*************************************************************************************************/
+
+DStim* dstim_init(uint32_t width, uint32_t height)
+{
+    if (width == 0)
+    {
+        log_error("width cannot be zero");
+        return NULL;
+    }
+    if (height == 0)
+    {
+        log_error("height cannot be zero");
+        return NULL;
+    }
+
+    DStim* stim = (DStim*)calloc(1, sizeof(DStim));
+    stim->width = width;
+    stim->height = height;
+    stim->is_record_dirty = true;
+    stim->app_thread = pthread_self();
+    init_commands(stim);
+    stim->frame_log = (DStimFrame*)calloc(DSTIM_FRAME_LOG_SIZE, sizeof(DStimFrame));
+    stim->ingest_tile = calloc(4, sizeof(*stim->ingest_tile));
+    ANN(stim->ingest_tile);
+
+    // App.
+    // --------------------------------------------------------------------------------------------
+
+    DvzApp* app = dvz_app(0);
+    DvzBatch* batch = dvz_app_batch(app);
+
+    stim->app = app;
+    stim->batch = batch;
+    stim->has_clip_distance = has_clip_distance();
+
+    DvzRequest req = {0};
+
+
+    // Background.
+    // --------------------------------------------------------------------------------------------
+
+    create_background(stim);
+    upload_rectangle(batch, stim->background_vertex_id, (vec2){-1, -1}, (vec2){+2, +2});
+    dstim_background(stim, DSTIM_DEFAULT_BACKGROUND);
+
+
+    // Square.
+    // --------------------------------------------------------------------------------------------
+
+    create_square(stim);
+    uint32_t sw = DSTIM_DEFAULT_SQUARE_WIDTH;
+    uint32_t sh = DSTIM_DEFAULT_SQUARE_HEIGHT;
+    dstim_square_pos(stim, width - sw, height - sh, sw, sh);
+    dstim_square_color(stim, DSTIM_DEFAULT_SQUARE_COLOR);
+
+
+    // Sphere.
+    // --------------------------------------------------------------------------------------------
+
+    // Generate the sphere mesh and create its vertex and index buffer dats.
+    dstim_sphere(stim, DSTIM_DEFAULT_TESSELLATION);
+
+    // Create the uniform buffer dats with the layer and screen parameters, and the storage
+    // buffer dat with the curves.
+    create_layer_params_buffer(stim);
+    create_screen_params_buffer(stim);
+    create_curves_buffer(stim);
+
+    // Load the sphere shaders once, they are shared by all sphere pipelines.
+    stim->sphere_vertex_shader_id =
+        create_shader_spv(batch, DVZ_SHADER_VERTEX, "shaders/sphere.vert.spv");
+    stim->sphere_multiview_vertex_shader_id =
+        create_shader_spv(batch, DVZ_SHADER_VERTEX, "shaders/sphere_multiview.vert.spv");
+    stim->sphere_compact_vertex_shader_id =
+        create_shader_spv(batch, DVZ_SHADER_VERTEX, "shaders/sphere_compact.vert.spv");
+    stim->sphere_multiview_compact_vertex_shader_id = create_shader_spv(
+        batch, DVZ_SHADER_VERTEX, "shaders/sphere_multiview_compact.vert.spv");
+    stim->sphere_fragment_shader_id =
+        create_shader_spv(batch, DVZ_SHADER_FRAGMENT, "shaders/sphere.frag.spv");
+    stim->sphere_array_fragment_shader_id =
+        create_shader_spv(batch, DVZ_SHADER_FRAGMENT, "shaders/sphere_array.frag.spv");
+    stim->sphere_raycast_vertex_shader_id =
+        create_shader_spv(batch, DVZ_SHADER_VERTEX, "shaders/sphere_raycast.vert.spv");
+    stim->sphere_raycast_fragment_shader_id =
+        create_shader_spv(batch, DVZ_SHADER_FRAGMENT, "shaders/sphere_raycast.frag.spv");
+    stim->sphere_raycast_array_fragment_shader_id =
+        create_shader_spv(batch, DVZ_SHADER_FRAGMENT, "shaders/sphere_raycast_array.frag.spv");
+    stim->sphere_mipmap_fragment_shader_id =
+        create_shader_spv(batch, DVZ_SHADER_FRAGMENT, "shaders/sphere_mipmap.frag.spv");
+    stim->sphere_raycast_mipmap_fragment_shader_id = create_shader_spv(
+        batch, DVZ_SHADER_FRAGMENT, "shaders/sphere_raycast_mipmap.frag.spv");
+
+
+    // Canvas.
+    // --------------------------------------------------------------------------------------------
+
+    req = dvz_create_canvas(batch, width, height, DVZ_DEFAULT_CLEAR_COLOR, 0);
+    stim->canvas_id = req.id;
+
+
+    return stim;
+}
+
+
+
+void dstim_background(DStim* stim, uint8_t red, uint8_t green, uint8_t blue, uint8_t alpha)
+{
+    ANN(stim);
+    GET_STATE
+
+    cvec4 color = {red, green, blue, alpha};
+    if (memcmp(color, stim->background_color, sizeof(cvec4)) == 0)
+    {
+        stim->stats.skipped_count++;
+        return;
+    }
+    memcpy(stim->background_color, color, sizeof(cvec4));
+
+    // Threaded mode: uploaded by the render thread, see apply_state().
+    if (stim->is_shadow)
+        return;
+
+    rectangle_color(stim->batch, stim->background_params_id, red, green, blue, alpha);
+}
+
+
+
+void dstim_vertices(DStim* stim, uint32_t vertex_count, DStimVertex* vertices)
+{
+    ANN(stim);
+    CHECK_UNTHREADED
+    ASSERT(vertex_count > 0);
+    ANN(vertices);
+
+    set_sphere_vertices(stim, vertex_count, vertices, false);
+}
+
+
+
+void dstim_indices(DStim* stim, uint32_t index_count, uint32_t* indices)
+{
+    ANN(stim);
+    CHECK_UNTHREADED
+    ASSERT(index_count > 0);
+    ANN(indices);
+
+    DvzSize buffer_size = index_count * sizeof(DvzIndex);
+    ASSERT(buffer_size > 0);
+    create_sphere_index_buffer(stim, index_count);
+
+    // Split the mesh into spatial chunks, and upload the indices sorted by chunk.
+    if (stim->sphere_indices != NULL)
+    {
+        FREE(stim->sphere_indices);
+    }
+    stim->sphere_indices = _cpy(buffer_size, indices);
+    stim->sphere_index_count = index_count;
+    build_chunks(stim);
+    upload_sphere_indices(stim);
+}
+
+
+
+void dstim_sphere(DStim* stim, uint32_t tessellation)
+{
+    ANN(stim);
+    CHECK_UNTHREADED
+    if (tessellation < 2)
+    {
+        log_error("tessellation must be at least 2");
+        return;
+    }
+
+    uint32_t vertex_count = 0;
+    DStimVertex* vertices = NULL;
+    uint32_t index_count = 0;
+    DvzIndex* indices = NULL;
+    generate_sphere(tessellation, &vertex_count, &vertices, &index_count, &indices);
+    log_debug(
+        "generate sphere mesh with %d vertices and %d indices", vertex_count, index_count);
+
+    // The previous indices do not match the new vertices, do not build chunks with them.
+    if (stim->sphere_indices != NULL)
+    {
+        FREE(stim->sphere_indices);
+    }
+    set_sphere_vertices(stim, vertex_count, vertices, true);
+    dstim_indices(stim, index_count, indices);
+
+    FREE(vertices);
+    FREE(indices);
+}
+
+
+
+void dstim_square_pos(DStim* stim, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+    ANN(stim);
+    GET_STATE
+
+    uint32_t rect[4] = {x, y, w, h};
+    if (memcmp(rect, stim->square_rect, sizeof(rect)) == 0)
+    {
+        stim->stats.skipped_count++;
+        return;
+    }
+    memcpy(stim->square_rect, rect, sizeof(rect));
+
+    // Threaded mode: uploaded by the render thread, see apply_state().
+    if (stim->is_shadow)
+        return;
+
+    // from pixels to NDC
+    float xf = -1 + 2.0 * (float)x / (float)stim->width;
+    float yf = -1 + 2.0 * (float)y / (float)stim->height;
+
+    float wf = 2.0 * (float)w / (float)stim->width;
+    float hf = 2.0 * (float)h / (float)stim->height;
+
+    upload_rectangle(stim->batch, stim->square_vertex_id, (vec2){xf, yf}, (vec2){wf, hf});
+}
+
+
+
+void dstim_square_color(DStim* stim, uint8_t red, uint8_t green, uint8_t blue, uint8_t alpha)
+{
+    ANN(stim);
+    GET_STATE
+
+    cvec4 color = {red, green, blue, alpha};
+    if (memcmp(color, stim->square_color, sizeof(cvec4)) == 0)
+    {
+        stim->stats.skipped_count++;
+        return;
+    }
+    memcpy(stim->square_color, color, sizeof(cvec4));
+
+    // Threaded mode: uploaded by the render thread, see apply_state().
+    if (stim->is_shadow)
+        return;
+
+    rectangle_color(stim->batch, stim->square_params_id, red, green, blue, alpha);
+}
+
+
+
+void dstim_model(DStim* stim, mat4 model)
+{
+    ANN(stim);
+    GET_STATE
+    if (memcmp(model, stim->model, sizeof(mat4)) == 0)
+        return;
+
+    TOUCH_RECORD
+    TOUCH_CULLING
+    glm_mat4_copy(model, stim->model);
+}
+
+
+
+void dstim_render_mode(DStim* stim, DStimRenderMode render_mode)
+{
+    ANN(stim);
+    CHECK_UNTHREADED
+
+    // Without clip distances, the screens are drawn one after the other.
+    if (render_mode == DSTIM_RENDER_MULTIVIEW && !stim->has_clip_distance)
+    {
+        log_warn("shaderClipDistance is not supported, falling back to the instanced rendering");
+        render_mode = DSTIM_RENDER_INSTANCED;
+    }
+    if (stim->render_mode == render_mode)
+        return;
+
+    // The layers move in or out of the texture array, and change pipelines, in the next call to
+    // dstim_update().
+    stim->render_mode = render_mode;
+    for (uint32_t layer_idx = 0; layer_idx < stim->layer_count; layer_idx++)
+    {
+        stim->layers[layer_idx].is_state_dirty = true;
+    }
+    TOUCH_RECORD
+}
+
+
+
+void dstim_cleanup(DStim* stim)
+{
+    ANN(stim);
+
+    // Cleanup.
+    dvz_app_destroy(stim->app);
+
+    // Free the copy of the sphere mesh.
+    if (stim->sphere_vertices != NULL)
+    {
+        FREE(stim->sphere_vertices);
+    }
+    if (stim->sphere_indices != NULL)
+    {
+        FREE(stim->sphere_indices);
+    }
+
+    // Stop the movies, release the caller's buffers, and free the staging buffers of the layers.
+    process_releases(stim, true);
+    DLayer* layer = NULL;
+    for (uint32_t layer_idx = 0; layer_idx < stim->layer_count; layer_idx++)
+    {
+        layer = &stim->layers[layer_idx];
+        stop_movie(stim, layer);
+        layer->is_uploaded = false; // the renderer has been destroyed
+        release_texture(stim, layer);
+        for (uint32_t i = 0; i < DSTIM_FRAMES_IN_FLIGHT; i++)
+        {
+            if (layer->staging[i] != NULL)
+            {
+                FREE(layer->staging[i]);
+            }
+        }
+        if (layer->region != NULL)
+        {
+            FREE(layer->region);
+        }
+        if (layer->mips != NULL)
+        {
+            FREE(layer->mips);
+        }
+    }
+
+    // Free the frame log and the conversion tile.
+    FREE(stim->frame_log);
+    FREE(stim->ingest_tile);
+
+    // Free the keyframes.
+    for (uint32_t i = 0; i < stim->track_count; i++)
+    {
+        FREE(stim->tracks[i].times);
+        FREE(stim->tracks[i].values);
+    }
+    for (uint32_t i = 0; i < DSTIM_MAX_LAYERS; i++)
+    {
+        for (uint32_t j = 0; j < DSTIM_CURVE_PARAM_COUNT; j++)
+        {
+            if (stim->curves[i][j].samples != NULL)
+            {
+                FREE(stim->curves[i][j].samples);
+            }
+        }
+    }
+
+    FREE(stim);
+}
+
+
+
+/*************************************************************************************************/
+/*  Events                                                                                       */
+/*************************************************************************************************/
+
+void dstim_mouse(DStim* stim, double* x, double* y, DvzMouseButton* button)
+{
+    ANN(stim);
+    ANN(stim->app);
+
+    // Threaded mode: state polled by the render thread after its last frame.
+    if (is_threaded(stim))
+    {
+        *x = atomic_load(&stim->mouse_x);
+        *y = atomic_load(&stim->mouse_y);
+        *button = (DvzMouseButton)atomic_load(&stim->mouse_button);
+        return;
+    }
+    dvz_app_mouse(stim->app, stim->canvas_id, x, y, button);
+}
+
+
+
+void dstim_keyboard(DStim* stim, DvzKeyCode* key)
+{
+    ANN(stim);
+    ANN(stim->app);
+
+    if (is_threaded(stim))
+    {
+        *key = (DvzKeyCode)atomic_load(&stim->key);
+        return;
+    }
+    dvz_app_keyboard(stim->app, stim->canvas_id, key);
+}
+
+
+
+static inline double _time_to_double(uint64_t seconds, uint64_t nanoseconds)
+{
+    return (double)seconds + (double)nanoseconds * 1e-9;
+}
+
+
+
+double dstim_time(DStim* stim)
+{
+    DvzTime time = {0};
+    dvz_time(&time);
+    return _time_to_double(time.seconds, time.nanoseconds);
+}
+
+
+
+double dstim_frame_time(DStim* stim)
+{
+    ANN(stim);
+    ANN(stim->app);
+
+    // Threaded mode: present time of the render thread's last frame, without waiting.
+    if (is_threaded(stim))
+        return atomic_load(&stim->frame_time);
+
+    dvz_app_wait(stim->app);
+
+    // Return the presentation time.
+    uint64_t seconds = 0;
+    uint64_t nanoseconds = 0;
+    dvz_app_timestamps(stim->app, stim->canvas_id, 1, &seconds, &nanoseconds);
+    return _time_to_double(seconds, nanoseconds);
+}
+
+
+
+/*************************************************************************************************/
+/*  Screen                                                                                       */
+/*************************************************************************************************/
+
+void dstim_screen(DStim* stim, uint32_t screen_idx, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+    ANN(stim);
+
+    GET_STATE
+    GET_SCREEN
+    if (screen->offset[0] == x && screen->offset[1] == y && //
+        screen->size[0] == w && screen->size[1] == h)
+        return;
+
+    TOUCH_SCREEN
+    TOUCH_RECORD
+    screen->offset[0] = x;
+    screen->offset[1] = y;
+    screen->size[0] = w;
+    screen->size[1] = h;
+}
+
+
+
+void dstim_projection(DStim* stim, uint32_t screen_idx, mat4 projection)
+{
+    ANN(stim);
+
+    GET_STATE
+    GET_SCREEN
+    if (memcmp(projection, screen->projection, sizeof(mat4)) == 0)
+        return;
+
+    TOUCH_SCREEN
+    TOUCH_CULLING
+    glm_mat4_copy(projection, screen->projection);
+}
+
+
+
+/*************************************************************************************************/
+/*  Texture bank                                                                                 */
+/*************************************************************************************************/
+
+void dstim_bank(DStim* stim, DvzFormat format, uint32_t width, uint32_t height, uint32_t count)
+{
+    ANN(stim);
+    CHECK_UNTHREADED
+
+    DvzBatch* batch = stim->batch;
+    ANN(batch);
+
+    ASSERT(width > 0);
+    ASSERT(height > 0);
+    if (count == 0 || count > DSTIM_BANK_MAX_SIZE)
+    {
+        log_error("the texture bank must have between 1 and %d images", DSTIM_BANK_MAX_SIZE);
+        return;
+    }
+    if (width > DSTIM_BANK_MAX_SIZE || height > DSTIM_BANK_MAX_SIZE)
+    {
+        log_error(
+            "the texture bank images cannot be larger than %dx%d, not %dx%d", DSTIM_BANK_MAX_SIZE,
+            DSTIM_BANK_MAX_SIZE, width, height);
+        return;
+    }
+
+    // NOTE: DRP has no 2D array textures, so the bank is a 3D texture with one slice per image.
+    if (stim->bank_id != DVZ_ID_NONE)
+    {
+        forget_texture(stim, stim->bank_id);
+        delete_later(stim, stim->bank_id, true);
+    }
+    log_debug("create texture bank %dx%dx%d", width, height, count);
+    DvzRequest req = dvz_create_tex(batch, 3, format, (uvec3){width, height, count}, 0);
+    stim->bank_id = req.id;
+    stim->bank_format = format;
+    stim->bank_size[0] = width;
+    stim->bank_size[1] = height;
+    stim->bank_count = count;
+
+    // The banked layers need new pipelines and slice coordinates.
+    DLayer* layer = NULL;
+    for (uint32_t layer_idx = 0; layer_idx < stim->layer_count; layer_idx++)
+    {
+        layer = &stim->layers[layer_idx];
+        if (layer->is_banked)
+        {
+            layer->bank_image = MIN(layer->bank_image, count - 1);
+            TOUCH_LAYER
+            TOUCH_LAYER_STATE
+        }
+    }
+}
+
+
+
+void dstim_bank_image(DStim* stim, uint32_t image_idx, DvzSize tex_nbytes, uint8_t* rgba)
+{
+    ANN(stim);
+    CHECK_UNTHREADED
+    ANN(rgba);
+
+    if (stim->bank_id == DVZ_ID_NONE)
+    {
+        log_error("the texture bank must be created before uploading images");
+        return;
+    }
+    if (image_idx >= stim->bank_count)
+    {
+        log_error("image_idx must be lower than %d", stim->bank_count);
+        return;
+    }
+    ASSERT(tex_nbytes > 0);
+    if (!check_texture_size(stim->bank_format, stim->bank_size[0], stim->bank_size[1], tex_nbytes))
+        return;
+
+    // Uploaded once, at setup: the request keeps a copy of the image, which the caller may free.
+    dvz_upload_tex(
+        stim->batch, stim->bank_id, (uvec3){0, 0, image_idx},
+        (uvec3){stim->bank_size[0], stim->bank_size[1], 1}, tex_nbytes, rgba, 0);
+}
+
+
+
+/*************************************************************************************************/
+/*  Layer                                                                                        */
+/*************************************************************************************************/
+
+void dstim_layer_texture(
+    DStim* stim, uint32_t layer_idx, DvzFormat format, //
+    uint32_t width, uint32_t height, DvzSize tex_nbytes, uint8_t* rgba)
+{
+    ANN(stim);
+    CHECK_UNTHREADED
+
+    ASSERT(tex_nbytes > 0);
+    ASSERT(width > 0);
+    ASSERT(height > 0);
+    ANN(rgba);
+
+    // Skip the copy and the upload if the layer already holds the same content.
+    uint64_t hash = _hash(tex_nbytes, rgba);
+    hash = hash != 0 ? hash : 1; // 0 means unknown
+    if (layer_idx < DSTIM_MAX_LAYERS)
+    {
+        DLayer* layer = &stim->layers[layer_idx];
+        if (layer->tex_hash == hash && layer->rgba != NULL && layer->format == format &&
+            layer->tex_width == width && layer->tex_height == height &&
+            layer->tex_nbytes == tex_nbytes && layer->movie == NULL && !layer->is_banked)
+        {
+            stim->stats.texture_hit_count++;
+            return;
+        }
+    }
+
+    // NOTE: make a copy for safety, in a staging buffer reused across calls.
+    uint8_t* staging =
+        dstim_layer_texture_map(stim, layer_idx, format, width, height, tex_nbytes);
+    if (staging == NULL)
+        return;
+    memcpy(staging, rgba, tex_nbytes);
+    dstim_layer_texture_unmap(stim, layer_idx);
+    stim->layers[layer_idx].tex_hash = hash;
+}
+
+
+
+void dstim_layer_texture_borrow(
+    DStim* stim, uint32_t layer_idx, DvzFormat format, //
+    uint32_t width, uint32_t height, DvzSize tex_nbytes, uint8_t* rgba,
+    DStimReleaseCallback release, void* user_data)
+{
+    ANN(stim);
+    CHECK_UNTHREADED
+
+    GET_LAYER
+    if (!check_texture_size(format, width, height, tex_nbytes))
+        return;
+    stop_movie(stim, layer);
+    borrow_texture(
+        stim, layer_idx, format, width, height, tex_nbytes, rgba, release, user_data);
+}
+
+
+
+uint8_t* dstim_layer_texture_map(
+    DStim* stim, uint32_t layer_idx, DvzFormat format, //
+    uint32_t width, uint32_t height, DvzSize tex_nbytes)
+{
+    ANN(stim);
+    if (is_threaded(stim))
+    {
+        log_error("%s() cannot be called while the render thread runs", __func__);
+        return NULL;
+    }
+
+    ASSERT(tex_nbytes > 0);
+    ASSERT(width > 0);
+    ASSERT(height > 0);
+    if (!check_texture_size(format, width, height, tex_nbytes))
+        return NULL;
+
+    if (layer_idx >= DSTIM_MAX_LAYERS)
+    {
+        log_error("layer_idx must be lower than %d", DSTIM_MAX_LAYERS);
+        return NULL;
+    }
+    stim->layer_count = MAX(stim->layer_count, layer_idx + 1);
+    DLayer* layer = &stim->layers[layer_idx];
+
+    layer->format = format;
+    layer->tex_width = width;
+    layer->tex_height = height;
+    layer->tex_nbytes = tex_nbytes;
+
+    // The caller fills a staging buffer that the renderer no longer reads.
+    stop_movie(stim, layer);
+    if (layer->is_banked)
+    {
+        layer->is_banked = false;
+        TOUCH_LAYER
+        TOUCH_LAYER_STATE
+    }
+    release_texture(stim, layer);
+    layer->rgba = get_staging(stim, layer, tex_nbytes);
+    layer->tex_hash = 0;
+    layer->is_uploaded = false;
+    return layer->rgba;
+}
+
+
+
+void dstim_layer_texture_matlab(
+    DStim* stim, uint32_t layer_idx, DStimMatlabClass matlab_class, //
+    uint32_t width, uint32_t height, uint32_t channel_count, const void* data)
+{
+    ANN(stim);
+    CHECK_UNTHREADED
+    ANN(data);
+
+    ASSERT(width > 0);
+    ASSERT(height > 0);
+    if (channel_count != 1 && channel_count != 3 && channel_count != 4)
+    {
+        log_error("MATLAB arrays must have 1, 3, or 4 channels, not %d", channel_count);
+        return;
+    }
+
+    // Convert straight into the layer's staging buffer.
+    DvzFormat format = channel_count == 1 ? DVZ_FORMAT_R8_UNORM : DVZ_FORMAT_R8G8B8A8_UNORM;
+    DvzSize tex_nbytes = (DvzSize)width * height * get_texel_size(format);
+    uint8_t* staging =
+        dstim_layer_texture_map(stim, layer_idx, format, width, height, tex_nbytes);
+    if (staging == NULL)
+        return;
+    ingest_matlab(data, matlab_class, width, height, channel_count, stim->ingest_tile, staging);
+    dstim_layer_texture_unmap(stim, layer_idx);
+}
+
+
+
+void dstim_layer_texture_unmap(DStim* stim, uint32_t layer_idx)
+{
+    ANN(stim);
+    CHECK_UNTHREADED
+
+    GET_LAYER
+    TOUCH_LAYER_TEXTURE
+    TOUCH_CULLING
+
+    ANN(layer->rgba);
+    ASSERT(!layer->is_borrowed);
+}
+
+
+
+void dstim_layer_texture_region(
+    DStim* stim, uint32_t layer_idx, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+    DvzSize nbytes, uint8_t* rgba)
+{
+    ANN(stim);
+    CHECK_UNTHREADED
+    ANN(rgba);
+
+    GET_LAYER
+    if (layer->rgba == NULL)
+    {
+        log_error("layer %d: the texture must be set before updating a region", layer_idx);
+        return;
+    }
+    if (w == 0 || h == 0 || x + w > layer->tex_width || y + h > layer->tex_height)
+    {
+        log_error("layer %d: region out of the %dx%d texture", layer_idx, layer->tex_width,
+                  layer->tex_height);
+        return;
+    }
+    DvzSize texel_size = layer->tex_nbytes / (layer->tex_width * layer->tex_height);
+    DvzSize row_size = w * texel_size;
+    ASSERT(nbytes == h * row_size);
+
+    // Update the region in the layer's texture copy.
+    copy_on_write(stim, layer);
+    for (uint32_t i = 0; i < h; i++)
+    {
+        memcpy(&layer->rgba[((y + i) * layer->tex_width + x) * texel_size], &rgba[i * row_size],
+               row_size);
+    }
+
+    // The content is no longer the one that was hashed.
+    layer->tex_hash = 0;
+
+    // Coalesce the changed regions into their bounding box, uploaded once in dstim_update().
+    if (!layer->has_dirty_region)
+    {
+        layer->dirty_region[0] = x;
+        layer->dirty_region[1] = y;
+        layer->dirty_region[2] = x + w;
+        layer->dirty_region[3] = y + h;
+        layer->has_dirty_region = true;
+    }
+    else
+    {
+        layer->dirty_region[0] = MIN(layer->dirty_region[0], x);
+        layer->dirty_region[1] = MIN(layer->dirty_region[1], y);
+        layer->dirty_region[2] = MAX(layer->dirty_region[2], x + w);
+        layer->dirty_region[3] = MAX(layer->dirty_region[3], y + h);
+    }
+}
+
+
+
+void dstim_layer_bank(DStim* stim, uint32_t layer_idx, uint32_t image_idx)
+{
+    ANN(stim);
+    GET_STATE
+
+    GET_LAYER
+    if (image_idx >= stim->bank_count)
+    {
+        log_error("image_idx must be lower than %d", stim->bank_count);
+        return;
+    }
+
+    // Threaded mode: the render thread stops the layer's movie when it applies the state.
+    if (stim->is_shadow)
+    {
+        layer->is_banked = true;
+        layer->bank_image = image_idx;
+        return;
+    }
+
+    // Switching images only changes the layer's slice coordinate, in the layer params buffer.
+    stop_movie(stim, layer);
+    TOUCH_LAYER
+    if (!layer->is_banked)
+    {
+        layer->is_banked = true;
+        TOUCH_LAYER_STATE
+        TOUCH_CULLING
+    }
+    layer->bank_image = image_idx;
+}
+
+
+
+void dstim_layer_movie(
+    DStim* stim, uint32_t layer_idx, const char* path, DvzFormat format, //
+    uint32_t width, uint32_t height, DvzSize frame_nbytes, double fps)
+{
+    ANN(stim);
+    CHECK_UNTHREADED
+    ANN(path);
+
+    ASSERT(frame_nbytes > 0);
+    ASSERT(width > 0);
+    ASSERT(height > 0);
+    ASSERT(fps > 0);
+
+    GET_LAYER
+    if (!check_texture_size(format, width, height, frame_nbytes))
+        return;
+    stop_movie(stim, layer);
+
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        log_error("could not open movie %s", path);
+        return;
+    }
+
+    // Number of frames after the NPY header, if any, checked against the format and size.
+    long offset = 0;
+    uint64_t frame_count = 0;
+    if (!read_npy_header(file, path, format, width, height, frame_nbytes, &offset, &frame_count))
+    {
+        fclose(file);
+        return;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, offset, SEEK_SET);
+    uint64_t available = size > offset ? (uint64_t)(size - offset) / frame_nbytes : 0;
+    if (offset > 0 && available < frame_count)
+    {
+        log_error(
+            "movie %s is truncated, %d frames out of %d", path, (int)available, (int)frame_count);
+        fclose(file);
+        return;
+    }
+    frame_count = offset > 0 ? frame_count : available;
+    if (frame_count == 0)
+    {
+        log_error("movie %s has no frame", path);
+        fclose(file);
+        return;
+    }
+
+    DMovie* movie = (DMovie*)calloc(1, sizeof(DMovie));
+    movie->file = file;
+    movie->format = format;
+    movie->width = width;
+    movie->height = height;
+    movie->frame_nbytes = frame_nbytes;
+    movie->frame_count = frame_count;
+    movie->fps = fps;
+    movie->start_time = -1;
+    movie->ref_count = 1;
+    for (uint32_t i = 0; i < DSTIM_MOVIE_RING_SIZE; i++)
+    {
+        movie->frames[i] = (uint8_t*)malloc(frame_nbytes);
+        atomic_init(&movie->slot_frames[i], -1);
+    }
+    atomic_init(&movie->is_running, true);
+    atomic_init(&movie->is_failed, false);
+
+    log_debug("layer %d: play %d frames of movie %s", layer_idx, (int)movie->frame_count, path);
+    if (pthread_create(&movie->thread, NULL, movie_reader, movie) != 0)
+    {
+        log_error("could not start the movie reader thread");
+        fclose(file);
+        movie->ref_count = 0;
+        destroy_movie(movie);
+        return;
+    }
+    layer->movie = movie;
+}
+
+
+
+void dstim_layer_kind(DStim* stim, uint32_t layer_idx, DStimLayerKind kind)
+{
+    ANN(stim);
+
+    GET_STATE
+    GET_LAYER
+    TOUCH_LAYER
+    TOUCH_LAYER_STATE
+    TOUCH_CULLING
+    layer->kind = kind;
+}
+
+
+
+void dstim_layer_grating(
+    DStim* stim, uint32_t layer_idx, float spatial_frequency, float phase, float contrast)
+{
+    ANN(stim);
+
+    GET_STATE
+    GET_LAYER
+    TOUCH_LAYER
+    layer->spatial_frequency = spatial_frequency;
+    layer->phase = phase;
+    layer->contrast = contrast;
+}
+
+
+
+void dstim_layer_phase(DStim* stim, uint32_t layer_idx, float phase)
+{
+    ANN(stim);
+
+    GET_STATE
+    GET_LAYER
+    TOUCH_LAYER
+    layer->phase = phase;
+}
+
+
+
+void dstim_layer_gaussian(DStim* stim, uint32_t layer_idx, float sigma)
+{
+    ANN(stim);
+
+    GET_STATE
+    GET_LAYER
+    TOUCH_LAYER
+    layer->sigma = sigma;
+}
+
+
+
+void dstim_layer_annulus(DStim* stim, uint32_t layer_idx, float inner_radius, float outer_radius)
+{
+    ANN(stim);
+
+    GET_STATE
+    GET_LAYER
+    TOUCH_LAYER
+    layer->inner_radius = inner_radius;
+    layer->outer_radius = outer_radius;
+}
+
+
+
+void dstim_layer_plaid(DStim* stim, uint32_t layer_idx, float plaid_angle)
+{
+    ANN(stim);
+
+    GET_STATE
+    GET_LAYER
+    TOUCH_LAYER
+    layer->plaid_angle = plaid_angle;
+}
+
+
+
+void dstim_layer_interpolation(DStim* stim, uint32_t layer_idx, DStimInterpolation interpolation)
+{
+    ANN(stim);
+
+    GET_STATE
+    GET_LAYER
+    TOUCH_LAYER_STATE
+    TOUCH_LAYER
+    layer->interpolation = interpolation;
+}
+
+
+
+void dstim_layer_periodic(DStim* stim, uint32_t layer_idx, bool is_periodic)
+{
+    ANN(stim);
+
+    GET_STATE
+    GET_LAYER
+    TOUCH_LAYER
+    TOUCH_LAYER_STATE
+    TOUCH_CULLING
+    layer->is_periodic = is_periodic;
+}
+
+
+
+void dstim_layer_clip(DStim* stim, uint32_t layer_idx, bool is_clipped)
+{
+    ANN(stim);
+
+    // NOTE: the part of the sphere outside the texture is otherwise drawn with the layer's
+    // min_color, only clip layers for which this has no visible effect.
+    GET_STATE
+    GET_LAYER
+    TOUCH_CULLING
+    layer->is_clipped = is_clipped;
+}
+
+
+
+void dstim_layer_blend(DStim* stim, uint32_t layer_idx, DStimBlend blend)
+{
+    ANN(stim);
+
+    GET_STATE
+    GET_LAYER
+    TOUCH_LAYER_STATE
+    layer->blend = blend;
+}
+
+
+
+void dstim_layer_mask(DStim* stim, uint32_t layer_idx, bool red, bool green, bool blue, bool alpha)
+{
+    ANN(stim);
+
+    GET_STATE
+    GET_LAYER
+    TOUCH_LAYER_STATE
+
+    layer->mask = (red ? DVZ_MASK_COLOR_R : 0) |   //
+                  (green ? DVZ_MASK_COLOR_G : 0) | //
+                  (blue ? DVZ_MASK_COLOR_B : 0) |  //
+                  (alpha ? DVZ_MASK_COLOR_A : 0);  //
+}
+
+
+
+void dstim_layer_view(DStim* stim, uint32_t layer_idx, mat4 view)
+{
+    ANN(stim);
+    // per-layer view matrix
+
+    GET_STATE
+    GET_LAYER
+    TOUCH_LAYER
+    TOUCH_CULLING
+    glm_mat4_copy(view, layer->view);
+}
+
+
+
+void dstim_layer_angle(DStim* stim, uint32_t layer_idx, float tex_angle)
+{
+    ANN(stim);
+
+    GET_STATE
+    GET_LAYER
+    TOUCH_LAYER
+    TOUCH_CULLING
+    layer->tex_angle = tex_angle;
+}
+
+
+
+void dstim_layer_offset(DStim* stim, uint32_t layer_idx, float tex_x, float tex_y)
+{
+    ANN(stim);
+
+    GET_STATE
+    GET_LAYER
+    TOUCH_LAYER
+    TOUCH_CULLING
+    layer->tex_offset[0] = tex_x;
+    layer->tex_offset[1] = tex_y;
 }
 
 
 
-void dstim_square_color(DStim* stim, uint8_t red, uint8_t green, uint8_t blue, uint8_t alpha)
+void dstim_layer_size(DStim* stim, uint32_t layer_idx, float tex_size_x, float tex_size_y)
 {
     ANN(stim);
-    rectangle_color(stim->batch, stim->square_params_id, red, green, blue, alpha);
+
+    GET_STATE
+    GET_LAYER
+    TOUCH_LAYER
+    TOUCH_CULLING
+    layer->tex_size[0] = tex_size_x;
+    layer->tex_size[1] = tex_size_y;
 }
 
 
 
-void dstim_model(DStim* stim, mat4 model)
+void dstim_layer_min_color(
+    DStim* stim, uint32_t layer_idx, uint8_t red, uint8_t green, uint8_t blue, uint8_t alpha)
 {
     ANN(stim);
-    glm_mat4_copy(model, stim->model);
+
+    GET_STATE
+    GET_LAYER
+    TOUCH_LAYER
+    layer->min_color[0] = red;
+    layer->min_color[1] = green;
+    layer->min_color[2] = blue;
+    layer->min_color[3] = alpha;
 }
 
 
 
-void dstim_cleanup(DStim* stim)
+void dstim_layer_max_color(
+    DStim* stim, uint32_t layer_idx, uint8_t red, uint8_t green, uint8_t blue, uint8_t alpha)
 {
     ANN(stim);
 
-    // Cleanup.
-    dvz_app_destroy(stim->app);
+    GET_STATE
+    GET_LAYER
+    TOUCH_LAYER
+    layer->max_color[0] = red;
+    layer->max_color[1] = green;
+    layer->max_color[2] = blue;
+    layer->max_color[3] = alpha;
+}
 
-    // Free texture copies in layers.
-    for (uint32_t layer_idx = 0; layer_idx < stim->layer_count; layer_idx++)
+
+
+void dstim_layer_show(DStim* stim, uint32_t layer_idx, bool is_visible)
+{
+    ANN(stim);
+
+    GET_STATE
+    GET_LAYER
+    if (layer->is_visible != is_visible)
     {
-        if (stim->layers[layer_idx].rgba != NULL)
-        {
-            FREE(stim->layers[layer_idx].rgba);
-        }
+        TOUCH_RECORD
+        TOUCH_CULLING
     }
-
-    FREE(stim);
+    layer->is_visible = is_visible;
 }
 
 
 
 /*************************************************************************************************/
-/*  Events                                                                                       */
+/*  Timeline                                                                                     */
 /*************************************************************************************************/
 
-void dstim_mouse(DStim* stim, double* x, double* y, DvzMouseButton* button)
+static float eval_track(DTrack* track, double time)
+{
+    ANN(track);
+
+    uint32_t n = track->key_count;
+    const double* t = track->times;
+    const float* v = track->values;
+    ASSERT(n > 0);
+
+    if (track->period > 0)
+    {
+        time = fmod(time, track->period);
+        if (time < 0)
+            time += track->period;
+    }
+    if (n == 1 || time <= t[0])
+        return v[0];
+    if (time >= t[n - 1])
+        return v[n - 1];
+
+    // Find the keyframes around the time, from the last ones as time mostly goes forward.
+    uint32_t i = track->key_idx;
+    if (i >= n - 1 || t[i] > time)
+        i = 0;
+    while (t[i + 1] <= time)
+        i++;
+    track->key_idx = i;
+
+    double h = t[i + 1] - t[i];
+    double u = (time - t[i]) / h;
+    switch (track->curve)
+    {
+    case DSTIM_CURVE_STEP:
+        return v[i];
+
+    case DSTIM_CURVE_LINEAR:
+        return v[i] + u * (v[i + 1] - v[i]);
+
+    case DSTIM_CURVE_SMOOTH:;
+        // Cubic Hermite spline, with one-sided tangents at the first and last keyframes.
+        uint32_t i0 = i > 0 ? i - 1 : i;
+        uint32_t i2 = i + 2 < n ? i + 2 : i + 1;
+        double m0 = (v[i + 1] - v[i0]) / (t[i + 1] - t[i0]);
+        double m1 = (v[i2] - v[i]) / (t[i2] - t[i]);
+        double u2 = u * u;
+        double u3 = u2 * u;
+        return (2 * u3 - 3 * u2 + 1) * v[i] + (u3 - 2 * u2 + u) * h * m0 +
+               (-2 * u3 + 3 * u2) * v[i + 1] + (u3 - u2) * h * m1;
+
+    default:
+        break;
+    }
+    return v[i];
+}
+
+
+
+// Set a layer parameter animated by a track, or posted to the command queue.
+static void set_layer_param(DStim* stim, uint32_t layer_idx, DStimTrackParam param, float value)
 {
     ANN(stim);
-    ANN(stim->app);
-    dvz_app_mouse(stim->app, stim->canvas_id, x, y, button);
+    ASSERT(layer_idx < DSTIM_MAX_LAYERS);
+    ASSERT(param < DSTIM_TRACK_PARAM_COUNT);
+
+    stim->layer_count = MAX(stim->layer_count, layer_idx + 1);
+    DLayer* layer = &stim->layers[layer_idx];
+
+    // NOTE: only the parameters that change are touched, so that a value set again triggers no
+    // upload and no culling.
+    float* field = NULL;
+    switch (param)
+    {
+    case DSTIM_TRACK_OFFSET_X:
+    case DSTIM_TRACK_OFFSET_Y:
+        field = &layer->tex_offset[param - DSTIM_TRACK_OFFSET_X];
+        break;
+    case DSTIM_TRACK_ANGLE:
+        field = &layer->tex_angle;
+        break;
+    case DSTIM_TRACK_SIZE_X:
+    case DSTIM_TRACK_SIZE_Y:
+        field = &layer->tex_size[param - DSTIM_TRACK_SIZE_X];
+        break;
+    case DSTIM_TRACK_PHASE:
+        field = &layer->phase;
+        break;
+    case DSTIM_TRACK_VISIBLE:
+        if (layer->is_visible != (value >= .5f))
+            dstim_layer_show(stim, layer_idx, value >= .5f);
+        return;
+    default:
+        break;
+    }
+
+    if (field != NULL)
+    {
+        if (*field != value)
+        {
+            *field = value;
+            TOUCH_LAYER
+            if (param != DSTIM_TRACK_PHASE)
+            {
+                TOUCH_CULLING // the layer's footprint changes
+            }
+        }
+        return;
+    }
+
+    // Colors.
+    uint8_t* color = param < DSTIM_TRACK_MAX_RED
+                         ? &layer->min_color[param - DSTIM_TRACK_MIN_RED]
+                         : &layer->max_color[param - DSTIM_TRACK_MAX_RED];
+    uint8_t c = (uint8_t)(value <= 0 ? 0 : (value >= 255 ? 255 : value + .5f));
+    if (*color != c)
+    {
+        *color = c;
+        TOUCH_LAYER
+    }
 }
 
 
 
-void dstim_keyboard(DStim* stim, DvzKeyCode* key)
+static void upload_curves(DStim* stim, float time)
 {
     ANN(stim);
-    ANN(stim->app);
-    dvz_app_keyboard(stim->app, stim->canvas_id, key);
+
+    DvzBatch* batch = stim->batch;
+    ANN(batch);
+
+    ASSERT(stim->curves_id != DVZ_ID_NONE);
+
+    // Only the timeline time changes from frame to frame.
+    DStimCurvesHeader header = {.time = time};
+    if (!stim->is_curves_dirty)
+    {
+        dvz_upload_dat(batch, stim->curves_id, 0, sizeof(header), &header, 0);
+        return;
+    }
+
+    // Pack the curves of all layers and their samples after the header.
+    uint32_t curve_count = DSTIM_MAX_LAYERS * DSTIM_CURVE_PARAM_COUNT;
+    DvzSize params_size = curve_count * sizeof(DStimCurveParams);
+    DvzSize size =
+        sizeof(header) + params_size + MAX(stim->curve_sample_count, 1) * sizeof(float);
+    uint8_t* data = (uint8_t*)calloc(size, 1);
+    ANN(data);
+    memcpy(data, &header, sizeof(header));
+    DStimCurveParams* params = (DStimCurveParams*)(data + sizeof(header));
+    float* samples = (float*)(data + sizeof(header) + params_size);
+
+    DCurve* curve = NULL;
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < curve_count; i++)
+    {
+        curve = &stim->curves[i / DSTIM_CURVE_PARAM_COUNT][i % DSTIM_CURVE_PARAM_COUNT];
+        if (curve->count == 0)
+            continue;
+        params[i].offset = offset;
+        params[i].count = curve->count;
+        params[i].rate = curve->rate;
+        params[i].period = curve->period;
+        memcpy(&samples[offset], curve->samples, curve->count * sizeof(float));
+        offset += curve->count;
+    }
+    ASSERT(offset == stim->curve_sample_count);
+
+    dvz_upload_dat(batch, stim->curves_id, 0, size, data, 0);
+    FREE(data);
+    stim->is_curves_dirty = false;
 }
 
 
 
-static inline double _time_to_double(uint64_t seconds, uint64_t nanoseconds)
+static void update_timeline(DStim* stim, double present_time)
 {
-    return (double)seconds + (double)nanoseconds * 1e-9;
+    ANN(stim);
+
+    if (stim->track_count == 0 && stim->curve_count == 0 && !stim->is_curves_dirty)
+        return;
+    if (stim->timeline_start == 0)
+        stim->timeline_start = present_time;
+    double time = present_time - stim->timeline_start;
+
+    // Evaluate all tracks, then apply the values to the layers.
+    for (uint32_t i = 0; i < stim->track_count; i++)
+        stim->track_values[i] = eval_track(&stim->tracks[i], time);
+    for (uint32_t i = 0; i < stim->track_count; i++)
+        set_layer_param(
+            stim, stim->tracks[i].layer_idx, stim->tracks[i].param, stim->track_values[i]);
+
+    // The curves are evaluated by the shaders, from the timeline time.
+    if (stim->curve_count > 0 || stim->is_curves_dirty)
+        upload_curves(stim, time);
 }
 
 
 
-double dstim_time(DStim* stim)
+static void remove_track(DStim* stim, uint32_t track_idx)
 {
-    DvzTime time = {0};
-    dvz_time(&time);
-    return _time_to_double(time.seconds, time.nanoseconds);
+    ANN(stim);
+    ASSERT(track_idx < stim->track_count);
+
+    DTrack* track = &stim->tracks[track_idx];
+    FREE(track->times);
+    FREE(track->values);
+    stim->tracks[track_idx] = stim->tracks[--stim->track_count];
 }
 
 
 
-double dstim_frame_time(DStim* stim)
+void dstim_layer_track(
+    DStim* stim, uint32_t layer_idx, DStimTrackParam param, DStimCurve curve, uint32_t key_count,
+    const double* times, const float* values, double period)
 {
     ANN(stim);
-    ANN(stim->app);
-    dvz_app_wait(stim->app);
+    CHECK_UNTHREADED
 
-    // Return the presentation time.
-    uint64_t seconds = 0;
-    uint64_t nanoseconds = 0;
-    dvz_app_timestamps(stim->app, stim->canvas_id, 1, &seconds, &nanoseconds);
-    return _time_to_double(seconds, nanoseconds);
+    // NOTE: the layer itself only changes when the timeline updates it.
+    if (layer_idx >= DSTIM_MAX_LAYERS)
+    {
+        log_error("layer_idx must be lower than %d", DSTIM_MAX_LAYERS);
+        return;
+    }
+    stim->layer_count = MAX(stim->layer_count, layer_idx + 1);
+    if (param >= DSTIM_TRACK_PARAM_COUNT)
+    {
+        log_error("unknown track parameter %d", param);
+        return;
+    }
+    for (uint32_t i = 1; i < key_count; i++)
+    {
+        if (times[i] <= times[i - 1])
+        {
+            log_error("track keyframe times must be increasing");
+            return;
+        }
+    }
+    if (period < 0 || (period > 0 && key_count > 0 && times[key_count - 1] > period))
+    {
+        log_error("track period must be positive and not before the last keyframe");
+        return;
+    }
+
+    // Replace the parameter's track if there is one.
+    for (uint32_t i = 0; i < stim->track_count; i++)
+    {
+        if (stim->tracks[i].layer_idx == layer_idx && stim->tracks[i].param == param)
+        {
+            remove_track(stim, i);
+            break;
+        }
+    }
+    if (key_count == 0)
+        return;
+    ANN(times);
+    ANN(values);
+    ASSERT(stim->track_count < DSTIM_MAX_TRACKS);
+
+    DTrack* track = &stim->tracks[stim->track_count++];
+    track->layer_idx = layer_idx;
+    track->param = param;
+    track->curve = curve;
+    track->key_count = key_count;
+    track->times = _cpy(key_count * sizeof(double), times);
+    track->values = _cpy(key_count * sizeof(float), values);
+    track->period = period;
+    track->key_idx = 0;
+}
+
+
+
+void dstim_layer_curve(
+    DStim* stim, uint32_t layer_idx, DStimTrackParam param, uint32_t sample_count,
+    const float* samples, float rate, float period)
+{
+    ANN(stim);
+    CHECK_UNTHREADED
+
+    GET_LAYER
+    if (param >= DSTIM_CURVE_PARAM_COUNT)
+    {
+        log_error("parameter %d cannot be animated by a curve", param);
+        return;
+    }
+    if (sample_count > 0 && (rate <= 0 || period < 0))
+    {
+        log_error("curve sample rate must be positive, and the period positive or zero");
+        return;
+    }
+
+    DCurve* curve = &stim->curves[layer_idx][param];
+    if (stim->curve_sample_count - curve->count + sample_count > DSTIM_MAX_CURVE_SAMPLES)
+    {
+        log_error("curves cannot have more than %d samples in total", DSTIM_MAX_CURVE_SAMPLES);
+        return;
+    }
+
+    // Replace the parameter's curve if there is one.
+    if (curve->count > 0)
+    {
+        FREE(curve->samples);
+        stim->curve_sample_count -= curve->count;
+        stim->curve_count--;
+        curve->count = 0;
+    }
+    layer->curve_mask &= ~(1u << param);
+    if (sample_count > 0)
+    {
+        ANN(samples);
+        curve->count = sample_count;
+        curve->samples = _cpy(sample_count * sizeof(float), samples);
+        curve->rate = rate;
+        curve->period = period;
+        stim->curve_sample_count += sample_count;
+        stim->curve_count++;
+        layer->curve_mask |= 1u << param;
+    }
+    stim->is_curves_dirty = true;
+    TOUCH_LAYER
+    TOUCH_CULLING // whether the layer may be clipped depends on its curves
+}
+
+
+
+void dstim_timeline_start(DStim* stim, double time)
+{
+    ANN(stim);
+    CHECK_UNTHREADED
+    stim->timeline_start = time;
 }
 
 
 
 /*************************************************************************************************/
-/*  Screen                                                                                       */
+/*  Command queue                                                                                */
 /*************************************************************************************************/
 
-void dstim_screen(DStim* stim, uint32_t screen_idx, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+// Apply the posted commands, once per layer parameter: the last value posted wins.
+static void drain_commands(DStim* stim)
 {
     ANN(stim);
 
-    GET_SCREEN
-    screen->offset[0] = x;
-    screen->offset[1] = y;
-    screen->size[0] = w;
-    screen->size[1] = h;
+    float values[DSTIM_MAX_LAYERS][DSTIM_TRACK_PARAM_COUNT];
+    uint32_t posted[DSTIM_MAX_LAYERS] = {0}; // bit per parameter
+    uint32_t count = 0;
+
+    // NOTE: only the commands claimed before the drain starts, so that producers posting
+    // continuously cannot keep the update in this loop.
+    DCommand* command = NULL;
+    size_t pos = stim->command_tail;
+    size_t head = atomic_load_explicit(&stim->command_head, memory_order_relaxed);
+    while (pos != head)
+    {
+        command = &stim->commands[pos & (DSTIM_QUEUE_SIZE - 1)];
+        if (atomic_load_explicit(&command->seq, memory_order_acquire) != pos + 1)
+            break;
+        if (posted[command->layer_idx] & (1u << command->param))
+            stim->stats.coalesced_count++;
+        posted[command->layer_idx] |= 1u << command->param;
+        values[command->layer_idx][command->param] = command->value;
+        count++;
+
+        // The slot is free again for the producer one lap later.
+        atomic_store_explicit(&command->seq, pos + DSTIM_QUEUE_SIZE, memory_order_release);
+        pos++;
+    }
+    stim->command_tail = pos;
+    if (count == 0)
+        return;
+    stim->stats.command_count += count;
+
+    for (uint32_t i = 0; i < DSTIM_MAX_LAYERS; i++)
+    {
+        for (uint32_t j = 0; j < DSTIM_TRACK_PARAM_COUNT; j++)
+        {
+            if (posted[i] & (1u << j))
+                set_layer_param(stim, i, (DStimTrackParam)j, values[i][j]);
+        }
+    }
 }
 
 
 
-void dstim_projection(DStim* stim, uint32_t screen_idx, mat4 projection)
+// Last command this thread failed to post: posting it again is a retry, not another drop.
+static _Thread_local struct
+{
+    DStim* stim;
+    uint32_t layer_idx;
+    DStimTrackParam param;
+    float value;
+} _failed_post;
+
+
+
+bool dstim_layer_post(DStim* stim, uint32_t layer_idx, DStimTrackParam param, float value)
 {
     ANN(stim);
+    if (layer_idx >= DSTIM_MAX_LAYERS || param >= DSTIM_TRACK_PARAM_COUNT)
+    {
+        log_error("invalid command for layer %d, parameter %d", layer_idx, param);
+        return false;
+    }
 
-    GET_SCREEN
-    glm_mat4_copy(projection, screen->projection);
+    bool is_retry = _failed_post.stim == stim && _failed_post.layer_idx == layer_idx &&
+                    _failed_post.param == param &&
+                    memcmp(&_failed_post.value, &value, sizeof(float)) == 0;
+
+    // Claim the slot at the enqueue position, unless the consumer has not freed it yet.
+    DCommand* command = NULL;
+    size_t pos = atomic_load_explicit(&stim->command_head, memory_order_relaxed);
+    while (true)
+    {
+        command = &stim->commands[pos & (DSTIM_QUEUE_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&command->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(
+                    &stim->command_head, &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            // The queue is full: the command is dropped, unless the caller posts it again.
+            if (!is_retry)
+            {
+                atomic_fetch_add_explicit(&stim->command_drops, 1, memory_order_relaxed);
+                _failed_post.stim = stim;
+                _failed_post.layer_idx = layer_idx;
+                _failed_post.param = param;
+                _failed_post.value = value;
+            }
+            return false;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&stim->command_head, memory_order_relaxed);
+        }
+    }
+
+    command->layer_idx = layer_idx;
+    command->param = param;
+    command->value = value;
+    atomic_store_explicit(&command->seq, pos + 1, memory_order_release);
+
+    // A retried command was not dropped after all.
+    if (is_retry)
+        atomic_fetch_sub_explicit(&stim->command_drops, 1, memory_order_relaxed);
+    _failed_post.stim = NULL;
+    return true;
+}
+
+
+
+uint64_t dstim_command_drops(DStim* stim)
+{
+    ANN(stim);
+    return atomic_load_explicit(&stim->command_drops, memory_order_relaxed);
 }
 
 
 
 /*************************************************************************************************/
-/*  Layer                                                                                        */
+/*  Frame log                                                                                    */
 /*************************************************************************************************/
 
-void dstim_layer_texture(
-    DStim* stim, uint32_t layer_idx, DvzFormat format, //
-    uint32_t width, uint32_t height, DvzSize tex_nbytes, uint8_t* rgba)
+static void log_frame(DStim* stim, DStimFrame* frame)
 {
     ANN(stim);
+    ANN(frame);
+    ANN(stim->frame_log);
 
-    ASSERT(tex_nbytes > 0);
-    ASSERT(width > 0);
-    ASSERT(height > 0);
-    ANN(rgba);
+    size_t head = atomic_load_explicit(&stim->frame_log_head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&stim->frame_log_tail, memory_order_acquire);
+    if (head - tail >= DSTIM_FRAME_LOG_SIZE)
+    {
+        stim->stats.unlogged_count++;
+        return;
+    }
+    stim->frame_log[head & (DSTIM_FRAME_LOG_SIZE - 1)] = *frame;
+    atomic_store_explicit(&stim->frame_log_head, head + 1, memory_order_release);
+}
 
-    GET_LAYER
-    TOUCH_LAYER_TEXTURE
 
-    layer->format = format;
-    layer->tex_width = width;
-    layer->tex_height = height;
-    layer->tex_nbytes = tex_nbytes;
 
-    // Free the existing copy if a new one is passed.
-    if (layer->rgba != NULL)
+static void pop_pending_frame(DStim* stim)
+{
+    ANN(stim);
+    ASSERT(stim->pending_count > 0);
+
+    log_frame(stim, &stim->pending[0]);
+    stim->pending_count--;
+    memmove(&stim->pending[0], &stim->pending[1], stim->pending_count * sizeof(DStimFrame));
+}
+
+
+
+// Time from which a frame may be presented: its submission, or its update if it sent nothing.
+static inline double get_frame_time(DStimFrame* frame)
+{
+    ANN(frame);
+    return frame->submit_time > 0 ? frame->submit_time : frame->update_time;
+}
+
+
+
+// Measure the refresh period from a new presentation timestamp, count the vsyncs missed before
+// it, and match it to the frames submitted before it that have no timestamp yet.
+// NOTE: the canvas is presented at the refresh rate whatever the update rate, so presentations
+// and frames are not 1:1. Without frame ids from Datoviz, a frame is matched to the first
+// presentation after its submission (its requests may only be shown at the next one). Frames
+// submitted within the same refresh share the presentation, the first one gets its interval and
+// missed vsyncs. Presentations without a new frame only count in the statistics.
+static void add_present(DStim* stim, double present_time)
+{
+    ANN(stim);
+
+    double interval = stim->present_time > 0 ? present_time - stim->present_time : 0;
+    stim->present_time = present_time;
+
+    uint32_t missed = 0;
+    double period = atomic_load(&stim->refresh_period);
+    if (interval >= 1e-3) // shorter intervals are not vsyncs
+    {
+        // NOTE: a shorter interval means that the previous estimate was a multiple of the period.
+        if (period == 0 || interval < .75 * period)
+            period = interval;
+        else if (interval < 1.5 * period)
+            period = .95 * period + .05 * interval;
+        else
+            missed = (uint32_t)round(interval / period) - 1;
+        atomic_store(&stim->refresh_period, period);
+        stim->stats.dropped_frame_count += missed;
+
+        uint32_t bin = (uint32_t)(interval / DSTIM_FRAME_HISTOGRAM_BIN_WIDTH);
+        bin = MIN(bin, DSTIM_FRAME_HISTOGRAM_BINS - 1);
+        atomic_fetch_add_explicit(&stim->histogram[bin], 1, memory_order_relaxed);
+    }
+
+    while (stim->pending_count > 0)
+    {
+        DStimFrame* frame = &stim->pending[0];
+        if (get_frame_time(frame) >= present_time)
+            break;
+        frame->present_time = present_time;
+        frame->interval = interval;
+        frame->missed = missed;
+        pop_pending_frame(stim);
+        interval = 0;
+        missed = 0;
+    }
+}
+
+
+
+static void poll_presents(DStim* stim)
+{
+    ANN(stim);
+    ANN(stim->app);
+
+    // NOTE: the timestamps of the last frames, without waiting for the GPU.
+    uint64_t seconds[DSTIM_FRAME_LOG_PENDING] = {0};
+    uint64_t nanoseconds[DSTIM_FRAME_LOG_PENDING] = {0};
+    dvz_app_timestamps(
+        stim->app, stim->canvas_id, DSTIM_FRAME_LOG_PENDING, seconds, nanoseconds);
+
+    // Sorted, in case of unordered timestamps.
+    double times[DSTIM_FRAME_LOG_PENDING] = {0};
+    for (uint32_t i = 0; i < DSTIM_FRAME_LOG_PENDING; i++)
+    {
+        double t = _time_to_double(seconds[i], nanoseconds[i]);
+        uint32_t j = i;
+        for (; j > 0 && times[j - 1] > t; j--)
+            times[j] = times[j - 1];
+        times[j] = t;
+    }
+
+    // NOTE: if all the timestamps are new, more frames may have been presented since the last
+    // poll than the timestamps hold (slow updates, or an idle caller). The gap before the oldest
+    // one is not a vsync interval: the measurement starts again from it, and the frames submitted
+    // before it are logged without presentation timestamp.
+    if (stim->present_time > 0 && times[0] > stim->present_time)
+    {
+        stim->present_time = 0;
+        while (stim->pending_count > 0 && get_frame_time(&stim->pending[0]) < times[0])
+            pop_pending_frame(stim);
+    }
+
+    for (uint32_t i = 0; i < DSTIM_FRAME_LOG_PENDING; i++)
     {
-        FREE(layer->rgba);
+        if (times[i] > stim->present_time)
+            add_present(stim, times[i]);
     }
-    layer->rgba =
-        _cpy(tex_nbytes, rgba); // NOTE: make a copy for safety, but will need to free it.
 }
 
 
 
-void dstim_layer_interpolation(DStim* stim, uint32_t layer_idx, DStimInterpolation interpolation)
+static void add_frame(DStim* stim, double update_time, double submit_time)
+{
+    ANN(stim);
+
+    // The oldest frame is logged without presentation timestamp if it has still none.
+    if (stim->pending_count == DSTIM_FRAME_LOG_PENDING)
+        pop_pending_frame(stim);
+
+    DStimFrame* frame = &stim->pending[stim->pending_count++];
+    memset(frame, 0, sizeof(DStimFrame));
+    frame->frame_idx = stim->frame_idx;
+    frame->update_time = update_time;
+    frame->submit_time = submit_time;
+}
+
+
+
+uint32_t dstim_frames(DStim* stim, uint32_t max_count, DStimFrame* frames)
+{
+    ANN(stim);
+    ANN(frames);
+    ANN(stim->frame_log);
+
+    size_t tail = atomic_load_explicit(&stim->frame_log_tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&stim->frame_log_head, memory_order_acquire);
+    uint32_t count = (uint32_t)MIN(head - tail, (size_t)max_count);
+    for (uint32_t i = 0; i < count; i++)
+        frames[i] = stim->frame_log[(tail + i) & (DSTIM_FRAME_LOG_SIZE - 1)];
+    atomic_store_explicit(&stim->frame_log_tail, tail + count, memory_order_release);
+    return count;
+}
+
+
+
+void dstim_frame_histogram(DStim* stim, uint64_t* counts)
 {
     ANN(stim);
-
-    GET_LAYER
-    TOUCH_LAYER
-    layer->interpolation = interpolation;
+    ANN(counts);
+    for (uint32_t i = 0; i < DSTIM_FRAME_HISTOGRAM_BINS; i++)
+        counts[i] = atomic_load_explicit(&stim->histogram[i], memory_order_relaxed);
 }
 
 
 
-void dstim_layer_periodic(DStim* stim, uint32_t layer_idx, bool is_periodic)
+double dstim_refresh_period(DStim* stim)
 {
     ANN(stim);
-
-    GET_LAYER
-    TOUCH_LAYER
-    layer->is_periodic = is_periodic;
+    return atomic_load(&stim->refresh_period);
 }
 
 
 
-void dstim_layer_blend(DStim* stim, uint32_t layer_idx, DStimBlend blend)
+/*************************************************************************************************/
+/*  Render thread                                                                                */
+/*************************************************************************************************/
+
+static void save_state(DStim* stim, DState* state)
 {
     ANN(stim);
+    ANN(state);
 
-    GET_LAYER
-    TOUCH_LAYER
-    layer->blend = blend;
+    DLayer* layer = NULL;
+    DLayerState* ls = NULL;
+    state->layer_count = stim->layer_count;
+    for (uint32_t i = 0; i < stim->layer_count; i++)
+    {
+        layer = &stim->layers[i];
+        ls = &state->layers[i];
+
+        glm_mat4_copy(layer->view, ls->view);
+        memcpy(ls->tex_offset, layer->tex_offset, sizeof(vec2));
+        memcpy(ls->tex_size, layer->tex_size, sizeof(vec2));
+        ls->tex_angle = layer->tex_angle;
+        memcpy(ls->min_color, layer->min_color, sizeof(cvec4));
+        memcpy(ls->max_color, layer->max_color, sizeof(cvec4));
+
+        ls->kind = layer->kind;
+        ls->spatial_frequency = layer->spatial_frequency;
+        ls->phase = layer->phase;
+        ls->contrast = layer->contrast;
+        ls->sigma = layer->sigma;
+        ls->inner_radius = layer->inner_radius;
+        ls->outer_radius = layer->outer_radius;
+        ls->plaid_angle = layer->plaid_angle;
+
+        ls->mask = layer->mask;
+        ls->blend = layer->blend;
+        ls->interpolation = layer->interpolation;
+        ls->is_periodic = layer->is_periodic;
+        ls->is_clipped = layer->is_clipped;
+        ls->is_visible = layer->is_visible;
+
+        ls->is_banked = layer->is_banked;
+        ls->bank_image = layer->bank_image;
+    }
+
+    state->screen_count = stim->screen_count;
+    for (uint32_t i = 0; i < stim->screen_count; i++)
+    {
+        memcpy(state->screens[i].offset, stim->screens[i].offset, sizeof(uvec2));
+        memcpy(state->screens[i].size, stim->screens[i].size, sizeof(uvec2));
+        glm_mat4_copy(stim->screens[i].projection, state->screens[i].projection);
+    }
+
+    glm_mat4_copy(stim->model, state->model);
+    memcpy(state->background_color, stim->background_color, sizeof(cvec4));
+    memcpy(state->square_color, stim->square_color, sizeof(cvec4));
+    memcpy(state->square_rect, stim->square_rect, sizeof(state->square_rect));
 }
 
 
 
-void dstim_layer_mask(DStim* stim, uint32_t layer_idx, bool red, bool green, bool blue, bool alpha)
+#define CHANGED(field) (memcmp(&next->field, &prev->field, sizeof(next->field)) != 0)
+
+// Apply the parameters that changed between two states, through the setters. The parameters the
+// experiment thread did not change keep the values set by the tracks.
+static void apply_state(DStim* stim, DState* prev, DState* next)
 {
     ANN(stim);
+    ANN(prev);
+    ANN(next);
 
-    GET_LAYER
-    TOUCH_LAYER
+    DLayerState* p = NULL;
+    DLayerState* n = NULL;
+    for (uint32_t i = 0; i < next->layer_count; i++)
+    {
+        p = &prev->layers[i];
+        n = &next->layers[i];
+        if (i >= prev->layer_count)
+            memset(p, 0, sizeof(DLayerState));
+        if (memcmp(p, n, sizeof(DLayerState)) == 0)
+            continue;
+
+        if (memcmp(p->view, n->view, sizeof(mat4)) != 0)
+            dstim_layer_view(stim, i, n->view);
+        if (memcmp(p->tex_offset, n->tex_offset, sizeof(vec2)) != 0)
+            dstim_layer_offset(stim, i, n->tex_offset[0], n->tex_offset[1]);
+        if (memcmp(p->tex_size, n->tex_size, sizeof(vec2)) != 0)
+            dstim_layer_size(stim, i, n->tex_size[0], n->tex_size[1]);
+        if (p->tex_angle != n->tex_angle)
+            dstim_layer_angle(stim, i, n->tex_angle);
+        if (memcmp(p->min_color, n->min_color, sizeof(cvec4)) != 0)
+            dstim_layer_min_color(
+                stim, i, n->min_color[0], n->min_color[1], n->min_color[2], n->min_color[3]);
+        if (memcmp(p->max_color, n->max_color, sizeof(cvec4)) != 0)
+            dstim_layer_max_color(
+                stim, i, n->max_color[0], n->max_color[1], n->max_color[2], n->max_color[3]);
+
+        if (p->kind != n->kind)
+            dstim_layer_kind(stim, i, n->kind);
+        if (p->spatial_frequency != n->spatial_frequency || p->contrast != n->contrast)
+            dstim_layer_grating(stim, i, n->spatial_frequency, n->phase, n->contrast);
+        else if (p->phase != n->phase)
+            dstim_layer_phase(stim, i, n->phase);
+        if (p->sigma != n->sigma)
+            dstim_layer_gaussian(stim, i, n->sigma);
+        if (p->inner_radius != n->inner_radius || p->outer_radius != n->outer_radius)
+            dstim_layer_annulus(stim, i, n->inner_radius, n->outer_radius);
+        if (p->plaid_angle != n->plaid_angle)
+            dstim_layer_plaid(stim, i, n->plaid_angle);
+
+        if (p->mask != n->mask)
+            dstim_layer_mask(
+                stim, i, n->mask & DVZ_MASK_COLOR_R, n->mask & DVZ_MASK_COLOR_G,
+                n->mask & DVZ_MASK_COLOR_B, n->mask & DVZ_MASK_COLOR_A);
+        if (p->blend != n->blend)
+            dstim_layer_blend(stim, i, n->blend);
+        if (p->interpolation != n->interpolation)
+            dstim_layer_interpolation(stim, i, n->interpolation);
+        if (p->is_periodic != n->is_periodic)
+            dstim_layer_periodic(stim, i, n->is_periodic);
+        if (p->is_clipped != n->is_clipped)
+            dstim_layer_clip(stim, i, n->is_clipped);
+        if (p->is_visible != n->is_visible)
+            dstim_layer_show(stim, i, n->is_visible);
+
+        // NOTE: the experiment thread can switch a layer to the bank, not back to a texture.
+        if (n->is_banked && (!p->is_banked || p->bank_image != n->bank_image))
+            dstim_layer_bank(stim, i, n->bank_image);
+    }
 
-    layer->mask = (red ? DVZ_MASK_COLOR_R : 0) |   //
-                  (green ? DVZ_MASK_COLOR_G : 0) | //
-                  (blue ? DVZ_MASK_COLOR_B : 0) |  //
-                  (alpha ? DVZ_MASK_COLOR_A : 0);  //
+    DScreenState* ss = NULL;
+    for (uint32_t i = 0; i < next->screen_count; i++)
+    {
+        ss = &next->screens[i];
+        dstim_screen(stim, i, ss->offset[0], ss->offset[1], ss->size[0], ss->size[1]);
+        dstim_projection(stim, i, ss->projection);
+    }
+
+    if (CHANGED(model))
+        dstim_model(stim, next->model);
+    if (CHANGED(background_color))
+        dstim_background(
+            stim, next->background_color[0], next->background_color[1],
+            next->background_color[2], next->background_color[3]);
+    if (CHANGED(square_color))
+        dstim_square_color(
+            stim, next->square_color[0], next->square_color[1], next->square_color[2],
+            next->square_color[3]);
+    if (CHANGED(square_rect))
+        dstim_square_pos(
+            stim, next->square_rect[0], next->square_rect[1], next->square_rect[2],
+            next->square_rect[3]);
 }
 
+#undef CHANGED
 
 
-void dstim_layer_view(DStim* stim, uint32_t layer_idx, mat4 view)
+
+// Experiment thread: publish the shadow's parameters, and take the state the render thread no
+// longer reads to fill it next time.
+static void publish_state(DStim* stim)
 {
     ANN(stim);
-    // per-layer view matrix
+    ANN(stim->shadow);
 
-    GET_LAYER
-    TOUCH_LAYER
-    glm_mat4_copy(view, layer->view);
+    save_state(stim->shadow, &stim->states[stim->state_back]);
+    stim->state_back =
+        atomic_exchange(&stim->state_middle, stim->state_back | DSTIM_STATE_FRESH) &
+        ~DSTIM_STATE_FRESH;
 }
 
 
 
-void dstim_layer_angle(DStim* stim, uint32_t layer_idx, float tex_angle)
+// Render thread: take the last published state, if it is new, and apply it.
+static void take_state(DStim* stim)
 {
     ANN(stim);
 
-    GET_LAYER
-    TOUCH_LAYER
-    layer->tex_angle = tex_angle;
+    if ((atomic_load(&stim->state_middle) & DSTIM_STATE_FRESH) == 0)
+        return;
+    stim->state_front =
+        atomic_exchange(&stim->state_middle, stim->state_front) & ~DSTIM_STATE_FRESH;
+
+    DState* next = &stim->states[stim->state_front];
+    apply_state(stim, &stim->render_state, next);
+    stim->render_state = *next;
 }
 
 
 
-void dstim_layer_offset(DStim* stim, uint32_t layer_idx, float tex_x, float tex_y)
+static void render_loop(DStim* stim)
 {
     ANN(stim);
+    _is_render_thread = true;
 
-    GET_LAYER
-    TOUCH_LAYER
-    layer->tex_offset[0] = tex_x;
-    layer->tex_offset[1] = tex_y;
+    double x = 0;
+    double y = 0;
+    DvzMouseButton button = {0};
+    DvzKeyCode key = {0};
+    while (atomic_load(&stim->is_rendering))
+    {
+        take_state(stim);
+        dstim_update(stim);
+
+        // Present the frame: only this thread waits for the vsync.
+        dvz_app_run(stim->app, 1);
+
+        // Frame time and input state, for the experiment thread.
+        uint64_t seconds = 0;
+        uint64_t nanoseconds = 0;
+        dvz_app_timestamps(stim->app, stim->canvas_id, 1, &seconds, &nanoseconds);
+        atomic_store(&stim->frame_time, _time_to_double(seconds, nanoseconds));
+        dstim_mouse(stim, &x, &y, &button);
+        dstim_keyboard(stim, &key);
+        atomic_store(&stim->mouse_x, x);
+        atomic_store(&stim->mouse_y, y);
+        atomic_store(&stim->mouse_button, (int)button);
+        atomic_store(&stim->key, (int)key);
+    }
+
+    _is_render_thread = false;
 }
 
 
 
-void dstim_layer_size(DStim* stim, uint32_t layer_idx, float tex_size_x, float tex_size_y)
+static void* run_experiment(void* user_data)
 {
+    DStim* stim = (DStim*)user_data;
     ANN(stim);
+    ANN(stim->experiment);
 
-    GET_LAYER
-    TOUCH_LAYER
-    layer->tex_size[0] = tex_size_x;
-    layer->tex_size[1] = tex_size_y;
+    stim->experiment(stim, stim->experiment_data);
+
+    // The render loop stops once the experiment has returned.
+    atomic_store(&stim->is_rendering, false);
+    return NULL;
 }
 
 
 
-void dstim_layer_min_color(
-    DStim* stim, uint32_t layer_idx, uint8_t red, uint8_t green, uint8_t blue, uint8_t alpha)
+void dstim_thread_run(DStim* stim, DStimExperiment experiment, void* user_data)
 {
     ANN(stim);
+    ANN(experiment);
+    if (stim->shadow != NULL)
+    {
+        log_error("the render thread is already running");
+        return;
+    }
 
-    GET_LAYER
-    TOUCH_LAYER
-    layer->min_color[0] = red;
-    layer->min_color[1] = green;
-    layer->min_color[2] = blue;
-    layer->min_color[3] = alpha;
+    // NOTE: GLFW requires the window events to be processed on the main thread, the one that
+    // created the window.
+    if (!pthread_equal(pthread_self(), stim->app_thread))
+    {
+        log_error("%s() must be called from the thread that called dstim_init()", __func__);
+        return;
+    }
+
+    // The shadow starts with the current parameters, the render thread only applies changes.
+    DStim* shadow = (DStim*)calloc(1, sizeof(DStim));
+    ANN(shadow);
+    shadow->is_shadow = true;
+    shadow->width = stim->width;
+    shadow->height = stim->height;
+    shadow->bank_count = stim->bank_count;
+    shadow->layer_count = stim->layer_count;
+    memcpy(shadow->layers, stim->layers, sizeof(stim->layers));
+    shadow->screen_count = stim->screen_count;
+    memcpy(shadow->screens, stim->screens, sizeof(stim->screens));
+    glm_mat4_copy(stim->model, shadow->model);
+    memcpy(shadow->background_color, stim->background_color, sizeof(cvec4));
+    memcpy(shadow->square_color, stim->square_color, sizeof(cvec4));
+    memcpy(shadow->square_rect, stim->square_rect, sizeof(stim->square_rect));
+
+    save_state(shadow, &stim->render_state);
+    stim->state_back = 0;
+    atomic_store(&stim->state_middle, 1);
+    stim->state_front = 2;
+
+    stim->shadow = shadow;
+    stim->experiment = experiment;
+    stim->experiment_data = user_data;
+    atomic_store(&stim->is_rendering, true);
+    if (pthread_create(&stim->experiment_thread, NULL, run_experiment, stim) != 0)
+    {
+        log_error("could not start the experiment thread");
+        atomic_store(&stim->is_rendering, false);
+        stim->shadow = NULL;
+        FREE(shadow);
+        return;
+    }
+
+    // This thread renders until the experiment returns.
+    render_loop(stim);
+    pthread_join(stim->experiment_thread, NULL);
+
+    // The last published state is applied to the DStim, which this thread owns again.
+    stim->shadow = NULL;
+    take_state(stim);
+    stim->experiment = NULL;
+    stim->experiment_data = NULL;
+    FREE(shadow);
 }
 
 
 
-void dstim_layer_max_color(
-    DStim* stim, uint32_t layer_idx, uint8_t red, uint8_t green, uint8_t blue, uint8_t alpha)
+/*************************************************************************************************/
+/*  Draw function                                                                                */
+/*************************************************************************************************/
+
+static bool is_layer_instanced(DStim* stim, DLayer* layer)
 {
     ANN(stim);
+    ANN(layer);
 
-    GET_LAYER
-    TOUCH_LAYER
-    layer->max_color[0] = red;
-    layer->max_color[1] = green;
-    layer->max_color[2] = blue;
-    layer->max_color[3] = alpha;
+    // The layer parameters are selected by instance, and the texture does not depend on the layer.
+    return layer->is_in_array ||
+           (stim->render_mode != DSTIM_RENDER_MESH &&
+            (layer->kind != DSTIM_LAYER_TEXTURE || layer->is_banked));
 }
 
 
 
-void dstim_layer_show(DStim* stim, uint32_t layer_idx, bool is_visible)
+static void record_layers(DStim* stim, uint32_t screen_idx, uint32_t screen_count)
 {
     ANN(stim);
 
-    GET_LAYER
-    layer->is_visible = is_visible;
-}
+    DLayer* layer = NULL;
+    DStimPush push = {0};
+    DvzId graphics_id = DVZ_ID_NONE;
+    uint32_t run_count = 0;
+    uint64_t visible[DSTIM_CHUNK_WORDS] = {0};
+
+    // Loop over all layers.
+    for (uint32_t layer_idx = 0; layer_idx < stim->layer_count; layer_idx += run_count)
+    {
+        layer = &stim->layers[layer_idx];
+        ANN(layer);
+        run_count = 1;
 
+        // Do not draw invisible layers.
+        if (!layer->is_visible)
+            continue;
 
+        // Consecutive visible layers in the texture array, or procedural, that share the same
+        // pipeline are drawn with a single instanced draw, blending in instance (layer) order.
+        if (is_layer_instanced(stim, layer))
+        {
+            graphics_id = stim->sphere_graphics_ids[layer_idx];
+            for (uint32_t i = layer_idx + 1; i < stim->layer_count; i++)
+            {
+                if (!stim->layers[i].is_visible || !is_layer_instanced(stim, &stim->layers[i]) ||
+                    stim->sphere_graphics_ids[i] != graphics_id)
+                    break;
+                run_count++;
+            }
+        }
 
-/*************************************************************************************************/
-/*  Draw function                                                                                */
-/*************************************************************************************************/
+        // One instance per layer and per screen, screen-major.
+        log_debug("layers %d-%d: record draw command", layer_idx, layer_idx + run_count - 1);
+        fill_push(stim, layer_idx, run_count, screen_idx, &push);
+        push_sphere_pipeline(stim, layer_idx, &push);
+        get_visible_chunks(stim, layer_idx, run_count, screen_idx, screen_count, visible);
+        draw_sphere_pipeline(stim, layer_idx, run_count * screen_count, visible);
 
-void dstim_update(DStim* stim)
+        // TODO: use dynamic state instead
+    }
+}
+
+
+
+static void record_commands(DStim* stim)
 {
     ANN(stim);
 
@@ -1285,13 +6104,104 @@ void dstim_update(DStim* stim)
     dvz_record_draw(batch, canvas_id, stim->background_graphics_id, 0, SQUARE_VERTEX_COUNT, 0, 1);
 
 
-    DScreen* screen = NULL;
+    if (stim->render_mode == DSTIM_RENDER_MULTIVIEW)
+    {
+        // All screens in a single pass with the window viewport: each instance maps its screen's
+        // NDC to the screen's part of the window.
+        if (stim->screen_count > 0)
+            record_layers(stim, 0, stim->screen_count);
+    }
+    else
+    {
+        DScreen* screen = NULL;
+
+        // Loop over all screens.
+        for (uint32_t screen_idx = 0; screen_idx < stim->screen_count; screen_idx++)
+        {
+            screen = &stim->screens[screen_idx];
+            ANN(screen);
+
+            // Screen viewport.
+            dvz_record_viewport(
+                batch, canvas_id,                             //
+                (vec2){screen->offset[0], screen->offset[1]}, //
+                (vec2){screen->size[0], screen->size[1]});
+
+            record_layers(stim, screen_idx, 1);
+        }
+    }
+
+    // Square.
+    dvz_record_viewport(batch, canvas_id, (vec2){0, 0}, (vec2){stim->width, stim->height});
+    dvz_record_draw(batch, canvas_id, stim->square_graphics_id, 0, SQUARE_VERTEX_COUNT, 0, 1);
+
+    // End recording.
+    dvz_record_end(batch, canvas_id);
+}
+
+
+
+void dstim_update(DStim* stim)
+{
+    ANN(stim);
+
+    // Threaded mode: publish the parameters set since the last call, the render thread applies
+    // them to its next frame.
+    if (is_threaded(stim))
+    {
+        publish_state(stim);
+        return;
+    }
+
+    DvzBatch* batch = stim->batch;
+    ANN(batch);
+
     DLayer* layer = NULL;
-    DStimPush push = {0};
-    DvzId sphere_graphics_id = DVZ_ID_NONE;
+    bool has_texture = false;
 
-    // Global model matrix.
-    glm_mat4_copy(stim->model, push.model);
+    // Release the caller's buffers, and delete the pipelines and textures, that the renderer no
+    // longer uses.
+    process_releases(stim, false);
+    process_deletions(stim);
+
+    // Apply the parameters posted by any thread since the last update.
+    drain_commands(stim);
+
+    double time = dstim_time(stim);
+    if (stim->update_time > 0)
+    {
+        double period = time - stim->update_time;
+        stim->frame_period =
+            stim->frame_period > 0 ? .9 * stim->frame_period + .1 * period : period;
+    }
+    stim->update_time = time;
+
+    // Log the presentation timestamps of the previous frames.
+    poll_presents(stim);
+
+    // The frame being prepared is presented at the next vsync: the last presentation timestamp
+    // plus a whole number of refresh periods. Until they are known, about one update interval
+    // from now.
+    double present_time = time + stim->frame_period;
+    double refresh_period = atomic_load(&stim->refresh_period);
+    if (refresh_period > 0 && stim->present_time > 0)
+    {
+        double vsyncs = MAX(ceil((time - stim->present_time) / refresh_period), 1);
+        present_time = stim->present_time + vsyncs * refresh_period;
+    }
+
+    // Set the animated layer parameters to their values at the predicted present time.
+    update_timeline(stim, present_time);
+
+    // Show the movie frames matching the predicted present time.
+    for (uint32_t layer_idx = 0; layer_idx < stim->layer_count; layer_idx++)
+    {
+        if (stim->layers[layer_idx].movie != NULL)
+            update_movie(stim, layer_idx, present_time);
+    }
+
+    // Decide which layers are drawn from the texture array, and resize it if needed.
+    update_array(stim);
 
     // First pass: go through all layers and prepare them if needed.
     for (uint32_t layer_idx = 0; layer_idx < stim->layer_count; layer_idx++)
@@ -1299,69 +6209,122 @@ void dstim_update(DStim* stim)
         layer = &stim->layers[layer_idx];
         ANN(layer);
 
-        // Only once per application: create the pipeline, texture, sampler, and make the bindings.
-        if (layer->is_blank)
+        // Every time the texture format or size changes: take a texture from the texture pool
+        // (procedural layers may have none).
+        prepare_layer(stim, layer_idx);
+
+        // Every time the fixed state changes: find or create the pipeline in the pipeline cache.
+        if (layer->is_state_dirty)
         {
-            log_debug("layer %d: prepare sphere pipeline", layer_idx);
-            prepare_sphere_pipeline(stim, layer_idx);
-            layer->is_blank = false;
+            log_debug("layer %d: resolve sphere pipeline", layer_idx);
+            resolve_pipeline(stim, layer_idx);
+            layer->is_state_dirty = false;
         }
 
         // Every time the texture data changes: upload it.
-        if (layer->is_texture_dirty)
+        // NOTE: a full upload supersedes the regions changed since the last upload. Banked layers
+        // have no texture, the data is uploaded when they get one back.
+        has_texture = layer->is_in_array || stim->texture_ids[layer_idx] != DVZ_ID_NONE;
+        if (layer->is_texture_dirty && has_texture)
         {
             log_debug("layer %d: upload texture", layer_idx);
-            upload_texture(stim, layer_idx);
-            layer->is_texture_dirty = false;
+            if (layer->tex_hash != 0)
+                stim->stats.texture_miss_count++;
+            if (layer->is_in_array)
+                upload_array_texture(stim, layer_idx);
+            else
+                upload_texture(stim, layer_idx);
+            layer->has_dirty_region = false;
         }
-    }
+        layer->is_texture_dirty = false;
 
+        // Every time texture regions change: upload their bounding box.
+        // NOTE: the mip levels depend on the whole texture, the mip atlas is built again.
+        if (layer->has_dirty_region && has_texture)
+        {
+            log_debug("layer %d: upload texture region", layer_idx);
+            if (get_mip_levels(layer) > 0)
+                upload_texture(stim, layer_idx);
+            else
+                upload_texture_region(stim, layer_idx);
+            layer->has_dirty_region = false;
+        }
+
+        // Every time the layer parameters change: update the layer's slot in the params buffer.
+        if (layer->is_dirty)
+        {
+            upload_params(stim, layer_idx);
+            layer->is_dirty = false;
+        }
+    }
 
-    // Loop over all screens.
+    // Every time a screen's viewport or projection changes: update its slot in the params buffer.
     for (uint32_t screen_idx = 0; screen_idx < stim->screen_count; screen_idx++)
     {
-        screen = &stim->screens[screen_idx];
-        ANN(screen);
+        if (stim->screens[screen_idx].is_dirty)
+        {
+            upload_screen_params(stim, screen_idx);
+            stim->screens[screen_idx].is_dirty = false;
+        }
+    }
 
-        // Screen viewport.
-        dvz_record_viewport(
-            batch, canvas_id,                             //
-            (vec2){screen->offset[0], screen->offset[1]}, //
-            (vec2){screen->size[0], screen->size[1]});
+    // Every time a projection, view, or model changes: find the chunks visible by each screen.
+    if (stim->is_culling_dirty)
+    {
+        update_culling(stim);
+        stim->is_culling_dirty = false;
+    }
 
-        // Loop over all layers.
-        for (uint32_t layer_idx = 0; layer_idx < stim->layer_count; layer_idx++)
-        {
-            layer = &stim->layers[layer_idx];
-            ANN(layer);
+    // Only record the command buffer again if the draw structure has changed.
+    if (stim->is_record_dirty)
+    {
+        log_debug("record command buffer");
+        uint32_t request_count = dvz_batch_size(batch);
+        stim->record_index_count = 0;
+        record_commands(stim);
+        stim->record_request_count = dvz_batch_size(batch) - request_count;
+        stim->is_record_dirty = false;
+        stim->stats.record_count++;
+    }
+    else
+    {
+        stim->stats.skipped_count += stim->record_request_count;
+    }
 
-            // Do not draw invisible layers.
-            if (!layer->is_visible)
-                continue;
+    // Update the canvas, unless there is nothing to send.
+    uint32_t request_count = dvz_batch_size(batch);
+    stim->stats.frame_count++;
+    stim->stats.request_count += request_count;
+    stim->stats.index_count += stim->record_index_count;
+    double submit_time = 0;
+    if (request_count > 0)
+    {
+        dvz_app_submit(stim->app);
+        submit_time = dstim_time(stim);
+    }
 
-            log_debug("layer %d: record draw command", layer_idx);
-            fill_push(stim, layer_idx, screen->projection, &push);
-            push_sphere_pipeline(stim, layer_idx, &push);
-            draw_sphere_pipeline(stim, layer_idx);
+    // The frame is logged once its presentation timestamp is known.
+    add_frame(stim, time, submit_time);
+    stim->frame_idx++;
+}
 
-            // TODO: use dynamic state instead
 
-            // NOTE TODO: optimization: once fixed state updates are supported in DRP, avoid
-            // recreating the pipeline if the states have not changed (or perhaps this should be
-            // done by the renderer)
-        }
-    }
 
-    // Square.
-    dvz_record_viewport(batch, canvas_id, (vec2){0, 0}, (vec2){stim->width, stim->height});
-    dvz_record_draw(batch, canvas_id, stim->square_graphics_id, 0, SQUARE_VERTEX_COUNT, 0, 1);
+void dstim_stats(DStim* stim, DStimStats* stats)
+{
+    ANN(stim);
+    CHECK_UNTHREADED
+    ANN(stats);
+    *stats = stim->stats;
+}
 
-    // End recording.
-    dvz_record_end(batch, canvas_id);
 
 
-    // Update the canvas.
-    dvz_app_submit(stim->app);
+void dstim_stats_reset(DStim* stim)
+{
+    ANN(stim);
+    CHECK_UNTHREADED
+    memset(&stim->stats, 0, sizeof(DStimStats));
 }
 
 
@@ -1370,6 +6333,29 @@ void dstim_update(DStim* stim)
 /*  Entry point                                                                                  */
 /*************************************************************************************************/
 
+// NOTE: the tests include this file, without the demo.
+#ifndef DSTIM_NO_MAIN
+
+static void _experiment(DStim* stim, void* user_data)
+{
+    ANN(stim);
+    (void)user_data;
+
+    struct timespec wait = {0, 50000000};
+    for (uint32_t i = 0; i < 200; i++)
+    {
+        // Sync square.
+        if (i % 2 == 0)
+            dstim_square_color(stim, DSTIM_DEFAULT_SQUARE_COLOR);
+        else
+            dstim_square_color(stim, DSTIM_ALTERNATIVE_SQUARE_COLOR);
+        dstim_update(stim);
+        nanosleep(&wait, NULL);
+    }
+}
+
+
+
 static void _on_timer(DvzApp* app, DvzId window_id, DvzTimerEvent* ev)
 {
     DStim* stim = (DStim*)ev->user_data;
@@ -1391,10 +6377,6 @@ static void _on_timer(DvzApp* app, DvzId window_id, DvzTimerEvent* ev)
     // Display information.
     // log_info("time: %.3f, mouse (%.0f, %.0f), button %d, keyboard %d", time, x, y, button, key);
 
-    double offset = -90 + 30 * fmod(ev->time, 5.0);
-    dstim_layer_offset(stim, 0, offset, 0);
-    dstim_layer_offset(stim, 1, offset, 0);
-
     // Sync square.
     if (ev->step_idx % 2 == 0)
         dstim_square_color(stim, DSTIM_DEFAULT_SQUARE_COLOR);
@@ -1472,7 +6454,11 @@ int main(int argc, char** argv)
         uint8_t* rgba = read_file("data/gaussianStencil", &tex_nbytes);
         ASSERT(tex_nbytes > 0);
         ASSERT(tex_nbytes == width * height * 4 * sizeof(uint8_t));
-        dstim_layer_texture(stim, 0, DVZ_FORMAT_R8G8B8A8_UNORM, width, height, tex_nbytes, rgba);
+
+        // The stencil is in the alpha channel: keep it only, as a single-channel texture.
+        for (uint32_t i = 0; i < width * height; i++)
+            rgba[i] = rgba[4 * i + 3];
+        dstim_layer_texture(stim, 0, DVZ_FORMAT_R8_UNORM, width, height, width * height, rgba);
         FREE(rgba);
 
         // Layer parameters.
@@ -1498,7 +6484,12 @@ int main(int argc, char** argv)
         uint8_t* rgba = read_file("data/sinusoidGrating", &tex_nbytes);
         ASSERT(tex_nbytes > 0);
         ASSERT(tex_nbytes == width * height * 4 * sizeof(uint8_t));
-        dstim_layer_texture(stim, 1, DVZ_FORMAT_R8G8B8A8_UNORM, width, height, tex_nbytes, rgba);
+
+        // The grating is grayscale and opaque: keep the red channel only, as a single-channel
+        // texture, with an opaque color mapping.
+        for (uint32_t i = 0; i < width * height; i++)
+            rgba[i] = rgba[4 * i];
+        dstim_layer_texture(stim, 1, DVZ_FORMAT_R8_UNORM, width, height, width * height, rgba);
         FREE(rgba);
 
         // Layer parameters.
@@ -1510,25 +6501,90 @@ int main(int argc, char** argv)
         dstim_layer_angle(stim, 1, 0.0);
         dstim_layer_offset(stim, 1, -90, 0);
         dstim_layer_size(stim, 1, 5.2632, 180);
+        dstim_layer_min_color(stim, 1, 0, 0, 0, 255);
+        dstim_layer_max_color(stim, 1, 255, 255, 255, 255);
+        dstim_layer_show(stim, 1, true);
+    }
+
+    // Layers 0 and 1: same windowed grating, with procedural patterns instead of textures.
+    if (0)
+    {
+        // Gaussian aperture, written to alpha only.
+        dstim_layer_kind(stim, 0, DSTIM_LAYER_GAUSSIAN);
+        dstim_layer_gaussian(stim, 0, 8.9);
+        dstim_layer_blend(stim, 0, DSTIM_BLEND_NONE);
+        dstim_layer_mask(stim, 0, false, false, false, true);
+        dstim_layer_view(stim, 0, *view);
+        dstim_layer_angle(stim, 0, 0.0);
+        dstim_layer_offset(stim, 0, -90, 0);
+        dstim_layer_size(stim, 0, 64.8, 64.8);
+        dstim_layer_min_color(stim, 0, 0, 0, 0, 0);
+        dstim_layer_max_color(stim, 0, 255, 255, 255, 255);
+        dstim_layer_show(stim, 0, true);
+
+        // Grating, blended with the aperture.
+        dstim_layer_kind(stim, 1, DSTIM_LAYER_GRATING);
+        dstim_layer_grating(stim, 1, 1 / 5.2632, 0, 1);
+        dstim_layer_view(stim, 1, *view);
+        dstim_layer_blend(stim, 1, DSTIM_BLEND_DST);
+        dstim_layer_mask(stim, 1, true, true, true, true);
+        dstim_layer_angle(stim, 1, 0.0);
+        dstim_layer_offset(stim, 1, -90, 0);
+        dstim_layer_size(stim, 1, 5.2632, 180);
         dstim_layer_min_color(stim, 1, 0, 0, 0, 0);
         dstim_layer_max_color(stim, 1, 255, 255, 255, 255);
         dstim_layer_show(stim, 1, true);
     }
 
+    // Animation: the windowed grating drifts from -90 to 60 degrees every 5 seconds.
+    if (1)
+    {
+        double times[] = {0, 5};
+        float offsets[] = {-90, 60};
+        dstim_layer_track(stim, 0, DSTIM_TRACK_OFFSET_X, DSTIM_CURVE_LINEAR, 2, times, offsets, 5);
+        dstim_layer_track(stim, 1, DSTIM_TRACK_OFFSET_X, DSTIM_CURVE_LINEAR, 2, times, offsets, 5);
+    }
+
+    // Same animation, evaluated on the GPU.
+    if (0)
+    {
+        float offsets[] = {-90, 60};
+        dstim_layer_curve(stim, 0, DSTIM_TRACK_OFFSET_X, 2, offsets, 1 / 5.0, 5);
+        dstim_layer_curve(stim, 1, DSTIM_TRACK_OFFSET_X, 2, offsets, 1 / 5.0, 5);
+    }
 
     // Important: run at least once.
     dstim_update(stim);
 
-    // Timer.
-    float dt = 0.05;
-    dvz_app_timer(stim->app, 0, dt, 0);
-    dvz_app_on_timer(stim->app, _on_timer, stim);
+    // Threaded mode: this thread presents the frames, the experiment thread only sets parameters.
+    if (0)
+    {
+        dstim_thread_run(stim, _experiment, NULL);
+    }
+    else
+    {
+        // Timer.
+        float dt = 0.05;
+        dvz_app_timer(stim->app, 0, dt, 0);
+        dvz_app_on_timer(stim->app, _on_timer, stim);
+
+        // DEBUG
+        dvz_app_run(stim->app, 0);
+    }
 
-    // DEBUG
-    dvz_app_run(stim->app, 0);
+    // Request counters.
+    DStimStats stats = {0};
+    dstim_stats(stim, &stats);
+    log_info(
+        "%lu frames, %lu requests sent, %lu requests skipped, %lu recordings, %lu indices drawn, "
+        "%lu movie underruns, %lu dropped frames",
+        stats.frame_count, stats.request_count, stats.skipped_count, stats.record_count,
+        stats.index_count, stats.underrun_count, stats.dropped_frame_count);
 
     // Cleanup.
     dstim_cleanup(stim);
     FREE(view);
     return 0;
 }
+
+#endif
@@ -52,6 +52,11 @@
 #define ANN(x) ASSERT((x) != NULL);
 #endif
 
+// Histogram of the intervals between presented frames, see dstim_frame_histogram(). The last bin
+// counts the longer intervals.
+#define DSTIM_FRAME_HISTOGRAM_BINS      128
+#define DSTIM_FRAME_HISTOGRAM_BIN_WIDTH 0.0005 // seconds
+
 
 
 /*************************************************************************************************/
@@ -61,6 +66,14 @@
 // Forward declarations.
 typedef struct DStim DStim;
 typedef struct DStimVertex DStimVertex;
+typedef struct DStimStats DStimStats;
+typedef struct DStimFrame DStimFrame;
+
+// Called once the library no longer reads a caller's texture buffer.
+typedef void (*DStimReleaseCallback)(uint8_t* rgba, void* user_data);
+
+// Experiment run on its own thread in threaded mode, see dstim_thread_run().
+typedef void (*DStimExperiment)(DStim* stim, void* user_data);
 
 
 
@@ -68,14 +81,80 @@ typedef struct DStimVertex DStimVertex;
 /*  Enums                                                                                        */
 /*************************************************************************************************/
 
+typedef enum
+{
+    DSTIM_MATLAB_DOUBLE = 0,
+    DSTIM_MATLAB_SINGLE = 1,
+} DStimMatlabClass;
+
+
+
 typedef enum
 {
     DSTIM_INTERPOLATION_NEAREST = 0,
     DSTIM_INTERPOLATION_LINEAR = 1,
+    DSTIM_INTERPOLATION_TRILINEAR = 2, // linear between the levels of a generated mip chain
 } DStimInterpolation;
 
 
 
+typedef enum
+{
+    DSTIM_RENDER_MESH,      // one draw per layer and per screen
+    DSTIM_RENDER_INSTANCED, // one instanced draw per run of layers sharing the same fixed state
+    DSTIM_RENDER_MULTIVIEW, // same as instanced, with all screens drawn in a single pass
+                            // (instanced if the device does not support shaderClipDistance)
+    DSTIM_RENDER_RAYCAST,   // same as instanced, ray-casting the sphere in a full-screen pass
+} DStimRenderMode;
+
+
+
+// Pattern drawn by a layer, in degrees about the layer's center (see dstim_layer_offset) and along
+// the layer's orientation (see dstim_layer_angle). Procedural patterns need no texture.
+typedef enum
+{
+    DSTIM_LAYER_TEXTURE,  // sampled texture (default)
+    DSTIM_LAYER_GRATING,  // sinusoidal grating in RGB, opaque
+    DSTIM_LAYER_GAUSSIAN, // Gaussian aperture in alpha
+    DSTIM_LAYER_ANNULUS,  // annulus aperture in alpha (a disk if the inner radius is zero)
+    DSTIM_LAYER_PLAID,    // sum of two gratings in RGB, opaque
+} DStimLayerKind;
+
+
+
+// Layer parameter animated by a track, see dstim_layer_track().
+typedef enum
+{
+    DSTIM_TRACK_OFFSET_X, // degrees
+    DSTIM_TRACK_OFFSET_Y,
+    DSTIM_TRACK_ANGLE,
+    DSTIM_TRACK_SIZE_X,
+    DSTIM_TRACK_SIZE_Y,
+    DSTIM_TRACK_PHASE,
+    DSTIM_TRACK_MIN_RED, // in [0, 255]
+    DSTIM_TRACK_MIN_GREEN,
+    DSTIM_TRACK_MIN_BLUE,
+    DSTIM_TRACK_MIN_ALPHA,
+    DSTIM_TRACK_MAX_RED,
+    DSTIM_TRACK_MAX_GREEN,
+    DSTIM_TRACK_MAX_BLUE,
+    DSTIM_TRACK_MAX_ALPHA,
+    DSTIM_TRACK_VISIBLE, // shown when at least 0.5
+    DSTIM_TRACK_PARAM_COUNT,
+} DStimTrackParam;
+
+
+
+// Interpolation between the keyframes of a track.
+typedef enum
+{
+    DSTIM_CURVE_STEP,   // value of the previous keyframe
+    DSTIM_CURVE_LINEAR, // linear
+    DSTIM_CURVE_SMOOTH, // cubic through the keyframes (Catmull-Rom tangents)
+} DStimCurve;
+
+
+
 typedef enum
 {
     DSTIM_BLEND_NONE,
@@ -101,6 +180,43 @@ case {'1-src' '1-source'}
 
 
 
+/*************************************************************************************************/
+/*  Structs                                                                                      */
+/*************************************************************************************************/
+
+// Request counters accumulated by dstim_update() since dstim_init() or dstim_stats_reset().
+struct DStimStats
+{
+    uint64_t frame_count;         // number of calls to dstim_update()
+    uint64_t request_count;       // number of requests sent to the GPU
+    uint64_t skipped_count;       // number of requests skipped because the state did not change
+    uint64_t record_count;        // number of times the command buffer was recorded
+    uint64_t index_count;         // number of sphere indices drawn, after frustum culling
+    uint64_t underrun_count;      // number of updates where a movie frame to show was not read yet
+    uint64_t texture_hit_count;   // texture copies or uploads skipped, the content being there
+    uint64_t texture_miss_count;  // texture uploads of content that was not on the GPU yet
+    uint64_t command_count;       // number of commands drained from the command queue
+    uint64_t coalesced_count;     // commands superseded by a later one in the same update
+    uint64_t dropped_frame_count; // vsyncs missed between consecutive presented frames
+    uint64_t unlogged_count;      // frame records lost because the frame log was full
+};
+
+
+
+// Record of a call to dstim_update() in the frame log, see dstim_frames(). Times in seconds, on
+// the dstim_time() clock.
+struct DStimFrame
+{
+    uint64_t frame_idx;
+    double update_time;  // start of dstim_update()
+    double submit_time;  // submission of the frame's requests, 0 if there was nothing to send
+    double present_time; // first presentation after the submission, 0 if it could not be matched
+    double interval;     // since the previous presentation, 0 if unknown or already counted
+    uint32_t missed;     // vsyncs missed before the presentation, 0 if already counted
+};
+
+
+
 EXTERN_C_ON
 
 /*************************************************************************************************/
@@ -128,6 +244,12 @@ DSTIM_EXPORT void dstim_indices(
 
 
 
+DSTIM_EXPORT void dstim_sphere(
+    DStim* stim,
+    uint32_t tessellation); // generate a UV sphere with tessellation x (2 * tessellation) quads
+
+
+
 DSTIM_EXPORT void dstim_square_pos(
     DStim* stim, uint32_t x, uint32_t y, uint32_t w, uint32_t h); // position and size in pixels
 
@@ -142,6 +264,10 @@ DSTIM_EXPORT void dstim_model(DStim* stim, mat4 model); // global model matrix
 
 
 
+DSTIM_EXPORT void dstim_render_mode(DStim* stim, DStimRenderMode render_mode);
+
+
+
 DSTIM_EXPORT void
 dstim_screen(DStim* stim, uint32_t screen_idx, uint32_t x, uint32_t y, uint32_t w, uint32_t h);
 
@@ -151,14 +277,102 @@ DSTIM_EXPORT void dstim_projection(DStim* stim, uint32_t screen_idx, mat4 projec
 
 
 
+// Texture bank of count images of the same size and format, a 3D texture: the width, height and
+// count are at most 2048 (only 256 is guaranteed by Vulkan, portable banks stay below).
+DSTIM_EXPORT void
+dstim_bank(DStim* stim, DvzFormat format, uint32_t width, uint32_t height, uint32_t count);
+
+
+
+DSTIM_EXPORT void dstim_bank_image(
+    DStim* stim, uint32_t image_idx, DvzSize tex_nbytes,
+    uint8_t* rgba); // upload an image of the texture bank once, at setup
+
+
+
 DSTIM_EXPORT void dstim_layer_texture(
     DStim* stim, uint32_t layer_idx, DvzFormat format, uint32_t width, uint32_t height,
-    DvzSize tex_nbytes, uint8_t* rgba);
+    DvzSize tex_nbytes, uint8_t* rgba); // copy of rgba in a staging buffer reused across calls
+
+
+
+DSTIM_EXPORT void dstim_layer_texture_borrow(
+    DStim* stim, uint32_t layer_idx, DvzFormat format, uint32_t width, uint32_t height,
+    DvzSize tex_nbytes, uint8_t* rgba, DStimReleaseCallback release,
+    void* user_data); // no copy, rgba must outlive the stim if release is NULL
+
+
+
+DSTIM_EXPORT uint8_t* dstim_layer_texture_map(
+    DStim* stim, uint32_t layer_idx, DvzFormat format, uint32_t width, uint32_t height,
+    DvzSize tex_nbytes); // staging buffer to fill before calling dstim_layer_texture_unmap()
+
+
+
+DSTIM_EXPORT void dstim_layer_texture_unmap(DStim* stim, uint32_t layer_idx);
+
+
+
+DSTIM_EXPORT void dstim_layer_texture_matlab(
+    DStim* stim, uint32_t layer_idx, DStimMatlabClass matlab_class, uint32_t width,
+    uint32_t height, uint32_t channel_count,
+    const void* data); // column-major (MATLAB) height x width x 1, 3 or 4 array in [0, 1]
+
+
+
+DSTIM_EXPORT void dstim_layer_texture_region(
+    DStim* stim, uint32_t layer_idx, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+    DvzSize nbytes, uint8_t* rgba); // update a region of the texture, rgba has w x h texels
+
+
+
+DSTIM_EXPORT void dstim_layer_bank(
+    DStim* stim, uint32_t layer_idx,
+    uint32_t image_idx); // show an image of the texture bank, until the layer's texture is set
+                         // (also from the experiment thread, see dstim_thread_run)
+
+
+
+// Stream the frames of a raw or NPY file, until the layer's texture is set. NPY files must hold a
+// C-ordered (frames, height, width[, channels]) array with the format's little-endian dtype.
+DSTIM_EXPORT void dstim_layer_movie(
+    DStim* stim, uint32_t layer_idx, const char* path, DvzFormat format, uint32_t width,
+    uint32_t height, DvzSize frame_nbytes, double fps);
+
+
+
+DSTIM_EXPORT void
+dstim_layer_kind(DStim* stim, uint32_t layer_idx, DStimLayerKind kind); // texture or procedural
+
+
+
+DSTIM_EXPORT void dstim_layer_grating(
+    DStim* stim, uint32_t layer_idx, float spatial_frequency, float phase,
+    float contrast); // cycles per degree, degrees, in [0, 1] (grating and plaid)
+
+
+
+DSTIM_EXPORT void dstim_layer_phase(DStim* stim, uint32_t layer_idx, float phase); // degrees
+
+
+
+DSTIM_EXPORT void dstim_layer_gaussian(DStim* stim, uint32_t layer_idx, float sigma); // degrees
+
+
+
+DSTIM_EXPORT void dstim_layer_annulus(
+    DStim* stim, uint32_t layer_idx, float inner_radius, float outer_radius); // degrees
+
+
+
+DSTIM_EXPORT void
+dstim_layer_plaid(DStim* stim, uint32_t layer_idx, float plaid_angle); // between the 2 gratings
 
 
 
 DSTIM_EXPORT void dstim_layer_interpolation(
-    DStim* stim, uint32_t layer_idx, DStimInterpolation interpolation); // 0=nearest, 1=linear
+    DStim* stim, uint32_t layer_idx,
+    DStimInterpolation interpolation); // 0=nearest, 1=linear, 2=trilinear (UNORM formats)
 
 
 
@@ -166,6 +380,12 @@ DSTIM_EXPORT void dstim_layer_periodic(DStim* stim, uint32_t layer_idx, bool is_
 
 
 
+DSTIM_EXPORT void dstim_layer_clip(
+    DStim* stim, uint32_t layer_idx,
+    bool is_clipped); // only draw the part of the sphere covered by a non-periodic texture
+
+
+
 DSTIM_EXPORT void dstim_layer_blend(
     DStim* stim, uint32_t layer_idx,
     DStimBlend blend); // per-layer blend options (there will be a few predefined options)
@@ -209,12 +429,77 @@ DSTIM_EXPORT void dstim_layer_show(DStim* stim, uint32_t layer_idx, bool is_visi
 
 
 
+DSTIM_EXPORT void dstim_layer_track(
+    DStim* stim, uint32_t layer_idx, DStimTrackParam param, DStimCurve curve, uint32_t key_count,
+    const double* times, const float* values,
+    double period); // keyframes in seconds, looping if period > 0, no keyframe to remove the track
+
+
+
+DSTIM_EXPORT void dstim_layer_curve(
+    DStim* stim, uint32_t layer_idx, DStimTrackParam param, uint32_t sample_count,
+    const float* samples, float rate,
+    float period); // samples per second on the timeline, evaluated by the GPU, 0 to remove
+
+
+
+DSTIM_EXPORT void dstim_timeline_start(
+    DStim* stim, double time); // timeline origin (dstim_time() clock), default: first update
+
+
+
 DSTIM_EXPORT void
 dstim_update(DStim* stim); // send all updates since that last call to this function to the GPU,
 // and returns the update timestamp when the update has finished
 
 
 
+DSTIM_EXPORT bool dstim_layer_post(
+    DStim* stim, uint32_t layer_idx, DStimTrackParam param,
+    float value); // from any thread, never blocks, applied by dstim_update(), false if full
+
+
+
+// Number of commands not posted because the queue was full. A command posted again right after
+// failing is counted once, and no longer once it is posted.
+DSTIM_EXPORT uint64_t dstim_command_drops(DStim* stim);
+
+
+
+DSTIM_EXPORT uint32_t dstim_frames(
+    DStim* stim, uint32_t max_count,
+    DStimFrame* frames); // drain up to max_count frame records, oldest first, from any thread
+
+
+
+DSTIM_EXPORT void dstim_frame_histogram(
+    DStim* stim,
+    uint64_t* counts); // DSTIM_FRAME_HISTOGRAM_BINS counts of the present intervals, any thread
+
+
+
+DSTIM_EXPORT double dstim_refresh_period(DStim* stim); // measured, 0 until known
+
+
+
+// Threaded mode: run the experiment on a new thread, where dstim_update() only publishes the
+// parameters, while the calling thread renders. Returns once the experiment has returned.
+// NOTE: GLFW requires the window events to be processed on the main thread (fatal on macOS), so
+// this must be called from the thread that called dstim_init(), normally the main thread.
+DSTIM_EXPORT void
+dstim_thread_run(DStim* stim, DStimExperiment experiment, void* user_data);
+
+
+
+DSTIM_EXPORT void
+dstim_stats(DStim* stim, DStimStats* stats); // request counters, not while the render thread runs
+
+
+
+DSTIM_EXPORT void dstim_stats_reset(DStim* stim);
+
+
+
 DSTIM_EXPORT void dstim_mouse(DStim* stim, double* x, double* y, DvzMouseButton* button);
 
 
@@ -1,34 +1,172 @@
 #version 450
+#extension GL_GOOGLE_include_directive : require
+
+#include "sphere_common.glsl"
 
 // Varying.
+#ifdef RAYCAST
+// Two points of the pixel's ray in the sphere's object space, see sphere_raycast.vert.
+layout(location = 0) noperspective in vec4 rayNear;
+layout(location = 1) flat in uint layerIdx;
+layout(location = 2) noperspective in vec4 rayFar;
+#else
 layout(location = 0) in vec2 UV;
+layout(location = 1) flat in uint layerIdx;
+#endif
 
 // Attachment output.
 layout(location = 0) out vec4 color;
 
 
-// Push constant.
-layout(push_constant) uniform Push
+// Descriptor slots.
+#ifdef TEXTURE_ARRAY
+// NOTE: the texture array (or bank) is a 3D texture with one slice per layer (or image).
+layout(binding = 0) uniform sampler3D myTextureSampler;
+#else
+layout(binding = 0) uniform sampler2D myTextureSampler;
+#endif
+
+
+
+vec4 sampleLayer(Layer layer, vec2 uv)
 {
-    // WARNING: the variables should be sorted by decreasing size to avoid alignment issues.
-    mat4 model;
-    mat4 view;
-    mat4 projection;
-
-    vec4 min_color;
-    vec4 max_color;
-    vec2 tex_offset; /* offset the texture, degrees */
-    vec2 tex_size;   /* size of the texture, degrees */
-    float tex_angle; /* rotate the texture, degrees */
-
-    // For fragment shader.
-    /* float viewAngle;*/ /* rotation of view, degrees */
-    /* vec2 pos;*/        /* position of layer [azimuth, altitude], degrees */
+#ifdef TEXTURE_ARRAY
+    // The layer texture only covers part of its slice: wrap and clamp here, not in the sampler.
+    if ((layer.flags & LAYER_PERIODIC) != 0u)
+        uv = fract(uv);
+    else if (any(lessThan(uv, vec2(0.0))) || any(greaterThan(uv, vec2(1.0))))
+        return vec4(0.0); // transparent border
+
+    vec2 halfTexel = 0.5 / vec2(textureSize(myTextureSampler, 0).xy);
+    uv = clamp(uv * layer.tex_scale, halfTexel, layer.tex_scale - halfTexel);
+    return textureLod(myTextureSampler, vec3(uv, layer.tex_slice), 0.0);
+#elif defined(RAYCAST)
+    // NOTE: the texture coordinates jump at the seam, do not use derivatives.
+    return textureLod(myTextureSampler, uv, 0.0);
+#else
+    return texture(myTextureSampler, uv);
+#endif
 }
-params;
 
-// Descriptor slots.
-layout(binding = 0) uniform sampler2D myTextureSampler;
+
+
+#ifdef MIPMAP
+// Position (xy) and size (zw), in texels, of a mip level in the mip atlas: the base level on the
+// left, the smaller levels stacked on its right. Must match get_texture_size().
+vec4 mipRect(vec2 size, int level)
+{
+    vec2 offset = vec2(0.0);
+    vec2 levelSize = size;
+    for (int k = 1; k <= level; k++)
+    {
+        offset = vec2(size.x, k == 1 ? 0.0 : offset.y + levelSize.y);
+        levelSize = max(floor(levelSize * 0.5), vec2(1.0));
+    }
+    return vec4(offset, levelSize);
+}
+
+
+
+vec4 sampleMipLevel(vec2 uv, vec4 rect)
+{
+    // Bilinear sampling, clamped to the level's texels.
+    vec2 texel = clamp(uv * rect.zw, vec2(0.5), rect.zw - 0.5);
+    vec2 atlasSize = vec2(textureSize(myTextureSampler, 0));
+    return textureLod(myTextureSampler, (rect.xy + texel) / atlasSize, 0.0);
+}
+
+
+
+// Trilinear sampling of the mip atlas, dx and dy being the screen-space derivatives of uv.
+vec4 sampleMip(Layer layer, vec2 uv, vec2 dx, vec2 dy)
+{
+    // The levels only cover part of the atlas: wrap and clamp here, not in the sampler.
+    if ((layer.flags & LAYER_PERIODIC) != 0u)
+        uv = fract(uv);
+    else if (any(lessThan(uv, vec2(0.0))) || any(greaterThan(uv, vec2(1.0))))
+        return vec4(0.0); // transparent border
+
+    // Level of detail from the number of base texels covered by the pixel.
+    vec2 size = layer.mip_size;
+    float rho = max(length(dx * size), length(dy * size));
+    float lod = clamp(log2(max(rho, 1e-8)), 0.0, float(layer.mip_levels - 1u));
+    int level = int(floor(lod));
+
+    vec4 color = sampleMipLevel(uv, mipRect(size, level));
+    if (level + 1 < int(layer.mip_levels))
+        color = mix(color, sampleMipLevel(uv, mipRect(size, level + 1)), lod - float(level));
+    return color;
+}
+#endif
+
+
+
+// Procedural pattern at the texture coordinates uv, which cover tex_size degrees, aa being the
+// screen-space width of the edges in degrees.
+vec4 proceduralLayer(Layer layer, vec2 uv, float aa)
+{
+    // Degrees about the layer's center, along the layer's orientation.
+    vec2 xy = (uv - 0.5) * layer.tex_size;
+    float r = length(xy);
+
+    // Gratings in RGB, opaque.
+    float k = 2 * pi * layer.spatial_frequency;
+    float phase = layer.phase * pi / 180;
+    float a = layer.plaid_angle * pi / 180;
+    float grating = cos(k * xy.x + phase);
+    if (layer.kind == LAYER_GRATING)
+        return vec4(vec3(0.5 + 0.5 * layer.contrast * grating), 1.0);
+    if (layer.kind == LAYER_PLAID)
+    {
+        grating += cos(k * dot(xy, vec2(cos(a), sin(a))) + phase);
+        return vec4(vec3(0.5 + 0.25 * layer.contrast * grating), 1.0);
+    }
+
+    // Apertures in alpha.
+    float sigma = max(layer.sigma, 1e-6);
+    if (layer.kind == LAYER_GAUSSIAN)
+        return vec4(vec3(0.0), exp(-r * r / (2 * sigma * sigma)));
+    if (layer.kind == LAYER_ANNULUS)
+    {
+        float inner = layer.inner_radius > 0.0
+                          ? smoothstep(layer.inner_radius - aa, layer.inner_radius + aa, r)
+                          : 1.0;
+        float outer = smoothstep(layer.outer_radius - aa, layer.outer_radius + aa, r);
+        return vec4(vec3(0.0), inner * (1.0 - outer));
+    }
+
+    return vec4(0.0);
+}
+
+
+
+#ifdef RAYCAST
+// Intersect the pixel's ray with the unit sphere, and return whether it hits it. vertexUV is the
+// vertexUV of the intersection, or of the sphere point closest to the ray on a miss, so that the
+// derivatives of the neighbouring pixels remain defined: the caller discards after taking them.
+bool raycastUV(out vec2 vertexUV)
+{
+    vec3 origin = rayNear.xyz / rayNear.w;
+    vec3 dir = normalize(rayFar.xyz / rayFar.w - origin);
+
+    float b = dot(origin, dir);
+    float c = dot(origin, origin) - 1.0;
+    float disc = b * b - c;
+
+    // First intersection in front of the viewer (the far one when inside the sphere).
+    float t = -b - sqrt(max(disc, 0.0));
+    if (t < 0.0)
+        t = -b + sqrt(max(disc, 0.0));
+    bool isHit = disc >= 0.0 && t >= 0.0;
+    if (!isHit)
+        t = -b;
+
+    // Same convention as the sphere mesh: y = cos(pi * v), (x, z) along 2 * pi * u.
+    vec3 p = normalize(origin + t * dir);
+    vertexUV = vec2(fract(atan(p.z, p.x) / (2 * pi)), acos(clamp(p.y, -1.0, 1.0)) / pi);
+    return isHit;
+}
+#endif
 
 
 
@@ -41,8 +179,52 @@ void main()
     scale.x = 360/size.x;
     scale.y = 180/size.y;*/
 
-    color = texture(myTextureSampler, UV).rgba;
-    color = color * (params.max_color - params.min_color) + params.min_color;
+    Layer layer = animateLayer(layers[layerIdx], layerIdx);
+
+#ifdef RAYCAST
+    vec2 vertexUV;
+    bool isHit = raycastUV(vertexUV);
+    vec2 UV = layerUV(layer, vertexUV);
+#endif
+
+    // Screen-space derivatives, in uniform control flow: before any discard.
+    float aa = fwidth(length((UV - 0.5) * layer.tex_size)); // antialiased procedural edges
+#ifdef MIPMAP
+#ifdef RAYCAST
+    // NOTE: the azimuth wraps around at the seam, take the short way.
+    vec2 dx = dFdx(vertexUV);
+    vec2 dy = dFdy(vertexUV);
+    dx.x -= round(dx.x);
+    dy.x -= round(dy.x);
+    dx = layerUV(layer, vertexUV + dx) - UV;
+    dy = layerUV(layer, vertexUV + dy) - UV;
+#else
+    vec2 dx = dFdx(UV);
+    vec2 dy = dFdy(UV);
+#endif
+#endif
+
+#ifdef RAYCAST
+    if (!isHit)
+        discard;
+#endif
+
+    if (layer.kind == LAYER_TEXTURE)
+    {
+#ifdef MIPMAP
+        color = sampleMip(layer, UV, dx, dy);
+#else
+        color = sampleLayer(layer, UV).rgba;
+#endif
+        // Single-channel textures: the channel drives all the components of the color mapping.
+        if ((layer.flags & LAYER_SINGLE_CHANNEL) != 0u)
+            color = color.rrrr;
+    }
+    else
+    {
+        color = proceduralLayer(layer, UV, aa);
+    }
+    color = color * (layer.max_color - layer.min_color) + layer.min_color;
 
     // DEBUG
     // vec4 max_color = vec4(1, 1, 0, 1);
@@ -1,48 +1,28 @@
 #version 450
+#extension GL_GOOGLE_include_directive : require
+
+#include "sphere_common.glsl"
 
-const float pi = 3.1415926535897932384626433832795;
 const vec3 xax = vec3(1.0f, 0.0f, 0.0f);
 const vec3 yax = vec3(0.0f, 1.0f, 0.0f);
 const vec3 zax = vec3(0.0f, 0.0f, 1.0f);
 
-mat3 trans2(vec2 v);
-mat3 scale2(vec2 v);
-mat3 rot2(float angle);
 mat4 rot3(vec3 axis, float angle);
 mat3 uvScaleOffsetMatrix(vec2 scale, vec2 off);
 
 
 // Vertex attributes.
+#ifdef COMPACT_MESH
+// Compact unit sphere: vertexUV packed as two unorm16, the position is derived from it.
+layout(location = 0) in uint vertexPackedUV;
+#else
 layout(location = 0) in vec3 vertexPos;
 layout(location = 1) in vec2 vertexUV;
+#endif
 
 // Varying.
 layout(location = 0) out vec2 UV;
-
-
-// Push constant.
-layout(push_constant) uniform Push
-{
-    // WARNING: the variables should be sorted by decreasing size to avoid alignment issues.
-    mat4 model;
-    mat4 view;
-    mat4 projection;
-
-    vec4 min_color;
-    vec4 max_color;
-    vec2 tex_offset; /* offset the texture, degrees */
-    vec2 tex_size;   /* size of the texture, degrees */
-    float tex_angle; /* rotate the texture, degrees */
-
-    // For fragment shader.
-    /* float viewAngle;*/ /* rotation of view, degrees */
-    /* vec2 pos;*/        /* position of layer [azimuth, altitude], degrees */
-}
-params;
-
-
-// Descriptor slots.
-layout(binding = 0) uniform sampler2D myTextureSampler;
+layout(location = 1) flat out uint layerIdx;
 
 
 
@@ -53,28 +33,42 @@ void main()
     /*mat4 view = rot3(zax, posRad.y)*rot3(yax, posRad.x)*rot3(xax, viewRad);*/
     /*mat4 view = rot3(yax, posRad.x)*rot3(zax, posRad.y)*rot3(xax, viewRad);*/
 
-    float tex_angle = params.tex_angle;
-    vec2 tex_offset = params.tex_offset;
-    vec2 tex_size = params.tex_size;
+#ifdef COMPACT_MESH
+    vec2 vertexUV = unpackUnorm2x16(vertexPackedUV);
+    float theta = pi * vertexUV.y;
+    float phi = 2 * pi * vertexUV.x;
+    vec3 vertexPos = vec3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+#endif
+
+    // One instance per layer and per screen (screen-major) with instanced draws.
+    uint instance = uint(gl_InstanceIndex);
+    layerIdx = push.layer_idx + instance % push.layer_count;
+    Layer layer = animateLayer(layers[layerIdx], layerIdx);
+    Screen screen = screens[push.screen_idx + instance / push.layer_count];
 
     gl_Position =
-        params.projection * mat4(params.view) * mat4(params.model) * vec4(vertexPos.xyz, 1.0f);
+        screen.projection * mat4(layer.view) * mat4(push.model) * vec4(vertexPos.xyz, 1.0f);
 
     // Vulkan conversion.
     gl_Position.y *= -1.0;
     gl_Position.z = (gl_Position.z + gl_Position.w) * 0.5;
 
+#ifdef MULTIVIEW
+    // All screens share the window viewport: clip against the screen's own frustum, then map the
+    // screen's NDC to its part of the window.
+    gl_ClipDistance[0] = gl_Position.w + gl_Position.x;
+    gl_ClipDistance[1] = gl_Position.w - gl_Position.x;
+    gl_ClipDistance[2] = gl_Position.w + gl_Position.y;
+    gl_ClipDistance[3] = gl_Position.w - gl_Position.y;
+    gl_Position.xy =
+        gl_Position.xy * screen.ndc_transform.xy + gl_Position.w * screen.ndc_transform.zw;
+#endif
+
     // DEBUG
     // gl_Position = vec4(vertexPos.xyz, 1.0f);
     // gl_PointSize = 2;
 
-    vec2 safeTexSize =
-        vec2(tex_size.x != 0.0f ? tex_size.x : 1e-10, tex_size.y != 0.0f ? tex_size.y : 1e-10);
-    vec2 texScale = vec2(180.0 / safeTexSize.x, 180.0 / safeTexSize.y);
-    vec2 texTrans = vec2(-tex_offset.x / safeTexSize.x, -tex_offset.y / safeTexSize.y);
-    mat3 uvTrans = trans2(vec2(0.5) + texTrans) * scale2(texScale) * rot2(tex_angle * pi / 180) *
-                   scale2(vec2(2.0, 1.0)) * trans2(vec2(-0.5));
-    UV = (uvTrans * vec3(vertexUV.xy, 1.0f)).xy;
+    UV = layerUV(layer, vertexUV);
 
     // DEBUG
     // UV = vertexUV;
@@ -90,17 +84,6 @@ mat3 uvScaleOffsetMatrix(vec2 scale, vec2 off)
         0.5 * (1 - scale.x) + off.x, 0.5 * (1 - scale.y) + off.y, 1.0); /*translate column*/
 }
 
-mat3 scale2(vec2 s) { return mat3(s.x, 0.0, 0.0, 0.0, s.y, 0.0, 0.0, 0.0, 1.0); }
-
-mat3 trans2(vec2 v) { return mat3(1.0, 0.0, 0.0, 0.0, 1.0, 0.0, v.x, v.y, 1.0); }
-
-mat3 rot2(float angle)
-{
-    float c = cos(angle);
-    float s = sin(angle);
-    return mat3(c, s, 0, -s, c, 0, 0, 0, 1);
-}
-
 mat4 rot3(vec3 axis, float angle)
 {
     axis = normalize(axis);
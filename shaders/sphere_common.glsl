@@ -0,0 +1,177 @@
+// Declarations shared by the sphere shaders.
+
+const uint MAX_LAYERS = 16; // NOTE: must match DSTIM_MAX_LAYERS
+const uint MAX_SCREENS = 8; // NOTE: must match DSTIM_MAX_SCREENS
+
+// Layer flags, must match DSTIM_LAYER_FLAG_*.
+const uint LAYER_PERIODIC = 0x1;
+const uint LAYER_SINGLE_CHANNEL = 0x2;
+const uint LAYER_ANIMATED = 0x4;
+
+// Layer kinds, must match DStimLayerKind.
+const uint LAYER_TEXTURE = 0;
+const uint LAYER_GRATING = 1;
+const uint LAYER_GAUSSIAN = 2;
+const uint LAYER_ANNULUS = 3;
+const uint LAYER_PLAID = 4;
+
+// Layer parameters animated by curves, must match DStimTrackParam.
+const uint CURVE_OFFSET_X = 0;
+const uint CURVE_OFFSET_Y = 1;
+const uint CURVE_ANGLE = 2;
+const uint CURVE_SIZE_X = 3;
+const uint CURVE_SIZE_Y = 4;
+const uint CURVE_PHASE = 5;
+const uint CURVE_MIN_COLOR = 6; /* 4 components */
+const uint CURVE_MAX_COLOR = 10;
+const uint CURVE_PARAM_COUNT = 14; // NOTE: must match DSTIM_CURVE_PARAM_COUNT
+
+
+// Push constant.
+layout(push_constant) uniform Push
+{
+    // WARNING: the variables should be sorted by decreasing size to avoid alignment issues.
+    mat4 model;
+    uint layer_idx;   /* index of the first layer in the layer params buffer */
+    uint layer_count; /* number of consecutive layers drawn with instancing */
+    uint screen_idx;  /* index of the first screen in the screen params buffer */
+}
+push;
+
+
+// Layer parameters, must match DStimParams.
+struct Layer
+{
+    mat4 view;
+
+    vec4 min_color;
+    vec4 max_color;
+    vec2 tex_offset; /* offset the texture, degrees */
+    vec2 tex_size;   /* size of the texture, degrees */
+    vec2 tex_scale;  /* part of the texture array slice covered by the layer texture */
+    float tex_angle; /* rotate the texture, degrees */
+    float tex_slice; /* slice coordinate in the texture array or bank */
+    uint flags;
+
+    // Procedural patterns, in degrees.
+    uint kind;
+    float spatial_frequency; /* cycles per degree */
+    float phase;
+    float contrast;
+    float sigma;
+    float inner_radius;
+    float outer_radius;
+    float plaid_angle; /* angle between the two gratings of a plaid */
+
+    // Mip atlas.
+    uint mip_levels; /* number of mip levels, 0 without mip atlas */
+    vec2 mip_size;   /* size of the base level, texels */
+
+    // For fragment shader.
+    /* float viewAngle;*/ /* rotation of view, degrees */
+    /* vec2 pos;*/        /* position of layer [azimuth, altitude], degrees */
+};
+
+layout(std140, binding = 1) uniform Layers { Layer layers[MAX_LAYERS]; };
+
+
+// Screen parameters, must match DStimScreenParams.
+struct Screen
+{
+    mat4 projection;
+    vec4 ndc_transform; /* scale (xy) and offset (zw) from the screen's NDC to the window's NDC */
+};
+
+layout(std140, binding = 2) uniform Screens { Screen screens[MAX_SCREENS]; };
+
+
+// Sampled curves, must match DStimCurveParams.
+struct Curve
+{
+    uint offset;  /* index of the first sample */
+    uint count;   /* number of samples, 0 if the parameter is not animated */
+    float rate;   /* samples per second */
+    float period; /* loop period, 0 to hold the last sample */
+};
+
+// Curves buffer, must match DStimCurvesHeader.
+layout(std430, binding = 3) readonly buffer Curves
+{
+    float time; /* seconds since the timeline origin, at the present time of the frame */
+    uint _padding[3];
+    Curve curves[MAX_LAYERS * CURVE_PARAM_COUNT];
+    float samples[];
+};
+
+
+
+// Value of a layer parameter at the timeline time, linear between the curve samples.
+float curveValue(uint layerIdx, uint param, float value)
+{
+    Curve curve = curves[layerIdx * CURVE_PARAM_COUNT + param];
+    if (curve.count == 0u)
+        return value;
+
+    float t = curve.period > 0.0 ? mod(time, curve.period) : time;
+    float x = clamp(t * curve.rate, 0.0, float(curve.count - 1u));
+    uint i = min(uint(x), max(curve.count, 2u) - 2u);
+    uint j = min(i + 1u, curve.count - 1u);
+    return mix(samples[curve.offset + i], samples[curve.offset + j], x - float(i));
+}
+
+
+
+// Layer parameters with the curves of animated layers applied.
+Layer animateLayer(Layer layer, uint layerIdx)
+{
+    if ((layer.flags & LAYER_ANIMATED) == 0u)
+        return layer;
+
+    layer.tex_offset.x = curveValue(layerIdx, CURVE_OFFSET_X, layer.tex_offset.x);
+    layer.tex_offset.y = curveValue(layerIdx, CURVE_OFFSET_Y, layer.tex_offset.y);
+    layer.tex_angle = curveValue(layerIdx, CURVE_ANGLE, layer.tex_angle);
+    layer.tex_size.x = curveValue(layerIdx, CURVE_SIZE_X, layer.tex_size.x);
+    layer.tex_size.y = curveValue(layerIdx, CURVE_SIZE_Y, layer.tex_size.y);
+    layer.phase = curveValue(layerIdx, CURVE_PHASE, layer.phase);
+
+    // NOTE: the colors of the curves are in [0, 255], like the colors set by the CPU.
+    for (uint k = 0u; k < 4u; k++)
+    {
+        layer.min_color[k] =
+            curveValue(layerIdx, CURVE_MIN_COLOR + k, 255.0 * layer.min_color[k]) / 255.0;
+        layer.max_color[k] =
+            curveValue(layerIdx, CURVE_MAX_COLOR + k, 255.0 * layer.max_color[k]) / 255.0;
+    }
+    return layer;
+}
+
+
+
+// Texture coordinates of a layer at a point of the sphere, from the point's vertexUV (azimuth
+// and elevation in [0, 1]).
+const float pi = 3.1415926535897932384626433832795;
+
+mat3 scale2(vec2 s) { return mat3(s.x, 0.0, 0.0, 0.0, s.y, 0.0, 0.0, 0.0, 1.0); }
+
+mat3 trans2(vec2 v) { return mat3(1.0, 0.0, 0.0, 0.0, 1.0, 0.0, v.x, v.y, 1.0); }
+
+mat3 rot2(float angle)
+{
+    float c = cos(angle);
+    float s = sin(angle);
+    return mat3(c, s, 0, -s, c, 0, 0, 0, 1);
+}
+
+vec2 layerUV(Layer layer, vec2 vertexUV)
+{
+    vec2 tex_size = layer.tex_size;
+    vec2 tex_offset = layer.tex_offset;
+
+    vec2 safeTexSize =
+        vec2(tex_size.x != 0.0f ? tex_size.x : 1e-10, tex_size.y != 0.0f ? tex_size.y : 1e-10);
+    vec2 texScale = vec2(180.0 / safeTexSize.x, 180.0 / safeTexSize.y);
+    vec2 texTrans = vec2(-tex_offset.x / safeTexSize.x, -tex_offset.y / safeTexSize.y);
+    mat3 uvTrans = trans2(vec2(0.5) + texTrans) * scale2(texScale) *
+                   rot2(layer.tex_angle * pi / 180) * scale2(vec2(2.0, 1.0)) * trans2(vec2(-0.5));
+    return (uvTrans * vec3(vertexUV.xy, 1.0f)).xy;
+}
@@ -0,0 +1,32 @@
+#version 450
+#extension GL_GOOGLE_include_directive : require
+
+#include "sphere_common.glsl"
+
+// Vertex attributes: rectangle covering the screen's viewport, in NDC.
+layout(location = 0) in vec3 pos;
+
+// Varying: two points of the pixel's ray in the sphere's object space, in homogeneous
+// coordinates (linear in NDC, hence interpolated without perspective correction).
+layout(location = 0) noperspective out vec4 rayNear;
+layout(location = 1) flat out uint layerIdx;
+layout(location = 2) noperspective out vec4 rayFar;
+
+
+
+void main()
+{
+    // One instance per layer with instanced draws.
+    uint instance = uint(gl_InstanceIndex);
+    layerIdx = push.layer_idx + instance % push.layer_count;
+    Layer layer = layers[layerIdx];
+    Screen screen = screens[push.screen_idx + instance / push.layer_count];
+
+    // Inverse of the sphere's transform, see sphere.vert.
+    mat4 inv = inverse(screen.projection * mat4(layer.view) * mat4(push.model));
+    rayNear = inv * vec4(pos.xy, -1.0, 1.0);
+    rayFar = inv * vec4(pos.xy, 0.0, 1.0);
+
+    gl_Position = vec4(pos.xy, 0.0, 1.0);
+    gl_Position.y = -gl_Position.y; // Vulkan has y downwards
+}
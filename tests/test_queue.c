@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2025 Cyrille Rossant and contributors. All rights reserved.
+ * Licensed under the MIT license. See LICENSE file in the project root for details.
+ * SPDX-License-Identifier: MIT
+ */
+
+// Stress test and enqueue latency benchmark of the command queue: producer threads post to their
+// own layer while the consumer drains, as dstim_update() does. No GPU is needed.
+
+/*************************************************************************************************/
+/*  Imports                                                                                      */
+/*************************************************************************************************/
+
+#include <sched.h>
+
+#define DSTIM_NO_MAIN
+#include "../datostim.c"
+
+
+
+/*************************************************************************************************/
+/*  Constants                                                                                    */
+/*************************************************************************************************/
+
+#define PRODUCER_COUNT 8
+#define POST_COUNT     1000000
+
+// One post out of this many is timed.
+#define SAMPLE_PERIOD 1000
+#define SAMPLE_COUNT  (POST_COUNT / SAMPLE_PERIOD)
+
+
+
+/*************************************************************************************************/
+/*  Structs                                                                                      */
+/*************************************************************************************************/
+
+typedef struct Producer Producer;
+
+struct Producer
+{
+    pthread_t thread;
+    DStim* stim;
+    uint32_t layer_idx;
+    bool retry; // post again when the queue is full, instead of dropping
+
+    float last_posted; // last value posted successfully
+    uint64_t latencies[SAMPLE_COUNT];
+};
+
+
+
+/*************************************************************************************************/
+/*  Utils                                                                                        */
+/*************************************************************************************************/
+
+static atomic_uint running_count;
+
+
+
+static uint64_t get_ns(void)
+{
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+
+
+static int compare_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : (x > y);
+}
+
+
+
+static void* produce(void* user_data)
+{
+    Producer* producer = (Producer*)user_data;
+    ANN(producer);
+
+    for (uint32_t i = 1; i <= POST_COUNT; i++)
+    {
+        bool is_sampled = i % SAMPLE_PERIOD == 0;
+        uint64_t start = is_sampled ? get_ns() : 0;
+        bool is_posted =
+            dstim_layer_post(producer->stim, producer->layer_idx, DSTIM_TRACK_OFFSET_X, i);
+        if (is_sampled)
+            producer->latencies[i / SAMPLE_PERIOD - 1] = get_ns() - start;
+
+        if (is_posted)
+        {
+            producer->last_posted = i;
+            continue;
+        }
+
+        // NOTE: the queue is full, let the consumer drain it, even on a single core.
+        sched_yield();
+        if (producer->retry)
+            i--;
+    }
+
+    atomic_fetch_sub(&running_count, 1);
+    return NULL;
+}
+
+
+
+static DStim* create_stim(void)
+{
+    // NOTE: the queue and the layer parameters only, without renderer.
+    DStim* stim = (DStim*)calloc(1, sizeof(DStim));
+    ANN(stim);
+    init_commands(stim);
+    return stim;
+}
+
+
+
+/*************************************************************************************************/
+/*  Tests                                                                                        */
+/*************************************************************************************************/
+
+// Producers post continuously while the consumer drains. Every command is either drained or
+// counted as dropped, the retried commands not being counted, and the last value drained for each
+// layer is the last one posted.
+static int test_stress(bool retry)
+{
+    DStim* stim = create_stim();
+    Producer* producers = (Producer*)calloc(PRODUCER_COUNT, sizeof(Producer));
+    ANN(producers);
+
+    atomic_store(&running_count, PRODUCER_COUNT);
+    for (uint32_t i = 0; i < PRODUCER_COUNT; i++)
+    {
+        producers[i].stim = stim;
+        producers[i].layer_idx = i;
+        producers[i].retry = retry;
+        pthread_create(&producers[i].thread, NULL, produce, &producers[i]);
+    }
+
+    // Each drain returns even though the producers keep posting.
+    uint64_t drain_count = 0;
+    while (atomic_load(&running_count) > 0)
+    {
+        drain_commands(stim);
+        drain_count++;
+    }
+    for (uint32_t i = 0; i < PRODUCER_COUNT; i++)
+        pthread_join(producers[i].thread, NULL);
+    drain_commands(stim);
+
+    int failures = 0;
+    uint64_t total = (uint64_t)PRODUCER_COUNT * POST_COUNT;
+    uint64_t drained = stim->stats.command_count;
+    uint64_t drops = dstim_command_drops(stim);
+    if (drained + drops != total)
+    {
+        printf("FAIL: %lu drained + %lu dropped != %lu posted\n", drained, drops, total);
+        failures++;
+    }
+    // Without retries, both the drain and the drop paths must have run under contention.
+    if (!retry && (drained < POST_COUNT || drops == 0))
+    {
+        printf("FAIL: %lu drained and %lu dropped, the stress test did not contend\n", drained,
+               drops);
+        failures++;
+    }
+    if (retry && drops != 0)
+    {
+        printf("FAIL: %lu commands counted as dropped with retries\n", drops);
+        failures++;
+    }
+    for (uint32_t i = 0; i < PRODUCER_COUNT; i++)
+    {
+        float value = stim->layers[i].tex_offset[0];
+        if (value != producers[i].last_posted)
+        {
+            printf("FAIL: layer %d holds %g, last posted %g\n", i, value,
+                   producers[i].last_posted);
+            failures++;
+        }
+    }
+    printf(
+        "stress (%s): %d producers, %lu drained, %lu dropped, %lu coalesced, %lu drains\n",
+        retry ? "retry" : "drop", PRODUCER_COUNT, drained, drops, stim->stats.coalesced_count,
+        drain_count);
+
+    // Enqueue latency, sampled under contention.
+    uint64_t* latencies = (uint64_t*)malloc(PRODUCER_COUNT * SAMPLE_COUNT * sizeof(uint64_t));
+    ANN(latencies);
+    for (uint32_t i = 0; i < PRODUCER_COUNT; i++)
+        memcpy(
+            &latencies[i * SAMPLE_COUNT], producers[i].latencies,
+            SAMPLE_COUNT * sizeof(uint64_t));
+    uint32_t count = PRODUCER_COUNT * SAMPLE_COUNT;
+    qsort(latencies, count, sizeof(uint64_t), compare_u64);
+    printf(
+        "post latency (%s): p50 %lu ns, p99 %lu ns, max %lu ns\n", retry ? "retry" : "drop",
+        latencies[count / 2], latencies[count * 99 / 100], latencies[count - 1]);
+
+    FREE(latencies);
+    FREE(producers);
+    FREE(stim);
+    return failures;
+}
+
+
+
+// Enqueue latency without contention, the consumer draining every 1024 posts.
+static int bench_uncontended(void)
+{
+    DStim* stim = create_stim();
+
+    uint64_t start = get_ns();
+    for (uint32_t i = 0; i < POST_COUNT; i++)
+    {
+        dstim_layer_post(stim, 0, DSTIM_TRACK_ANGLE, i);
+        if (i % 1024 == 1023)
+            drain_commands(stim);
+    }
+    double elapsed = (double)(get_ns() - start);
+    printf("post latency (uncontended): %.1f ns per post\n", elapsed / POST_COUNT);
+
+    int failures = 0;
+    if (dstim_command_drops(stim) != 0)
+    {
+        printf("FAIL: %lu commands dropped\n", dstim_command_drops(stim));
+        failures++;
+    }
+
+    FREE(stim);
+    return failures;
+}
+
+
+
+/*************************************************************************************************/
+/*  Entry point                                                                                  */
+/*************************************************************************************************/
+
+int main(int argc, char** argv)
+{
+    int failures = 0;
+    failures += test_stress(false);
+    failures += test_stress(true);
+    failures += bench_uncontended();
+
+    printf(failures == 0 ? "OK\n" : "%d FAILURES\n", failures);
+    return failures == 0 ? 0 : 1;
+}